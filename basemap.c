@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "basemap.h"
+
+#define FACES		6
+#define NPROBES		4
+#define MAGIC		"basemap1"
+
+struct basemap {
+	int size;		/* samples along a face edge */
+	int octaves;
+	float scale;
+	float probe[NPROBES];	/* see struct header */
+
+	/* FACES grids of (size+2)^2 samples: each face has a
+	   one-sample apron from past its edges, so the bicubic taps
+	   never need to cross to another face */
+	float *data;
+
+	void *map;		/* file mapping, if mapped */
+	size_t maplen;
+};
+
+/* File header; the samples follow immediately */
+struct header {
+	char magic[8];
+	int32_t size;
+	int32_t octaves;
+	float scale;
+
+	/* The function at some fixed points, to check the file was
+	   made from the same fractal */
+	float probe[NPROBES];
+};
+
+static const vec3_t probes[NPROBES] = {
+	VEC3i( .3,  .5,  .8),
+	VEC3i(-.7,  .2,  .1),
+	VEC3i( .1, -.9,  .4),
+	VEC3i( .6,  .6, -.5),
+};
+
+static int stride(int size)
+{
+	return size + 2;
+}
+
+static size_t data_size(int size)
+{
+	return sizeof(float) * FACES * stride(size) * stride(size);
+}
+
+/* Face f is axis f/2, negative if f is odd.  Like
+   patch_sample_normal(), i runs along the next axis round from the
+   face's, and j along the one after that. */
+static void face_point(int f, float u, float v, vec3_t *p)
+{
+	int axis = f / 2;
+
+	p->v[axis] = (f & 1) ? -1 : 1;
+	p->v[(axis + 1) % 3] = u;
+	p->v[(axis + 2) % 3] = v;
+
+	vec3_normalize(p);
+}
+
+static void make_probes(const struct fractal *frac, float scale, int octaves,
+			float probe[NPROBES])
+{
+	for(int i = 0; i < NPROBES; i++) {
+		vec3_t p = probes[i];
+
+		vec3_normalize(&p);
+		probe[i] = fractal_fBm_partial(frac, p.v, scale, 0, octaves);
+	}
+}
+
+struct basemap *basemap_create(const struct fractal *frac, float scale,
+			       int octaves, int size)
+{
+	struct basemap *bm = malloc(sizeof(*bm));
+
+	if (bm == NULL)
+		return NULL;
+
+	bm->size = size;
+	bm->octaves = octaves;
+	bm->scale = scale;
+	bm->map = NULL;
+	bm->maplen = 0;
+	bm->data = malloc(data_size(size));
+
+	if (bm->data == NULL) {
+		free(bm);
+		return NULL;
+	}
+
+	make_probes(frac, scale, octaves, bm->probe);
+
+	int s = stride(size);
+
+	for(int f = 0; f < FACES; f++) {
+		float *grid = &bm->data[f * s * s];
+
+		for(int y = 0; y < s; y++)
+			for(int x = 0; x < s; x++) {
+				float u = (x - 1) * 2.f / (size - 1) - 1;
+				float v = (y - 1) * 2.f / (size - 1) - 1;
+				vec3_t p;
+
+				face_point(f, u, v, &p);
+				grid[y * s + x] = fractal_fBm_partial(frac, p.v, scale,
+								      0, octaves);
+			}
+	}
+
+	return bm;
+}
+
+int basemap_save(const struct basemap *bm, const char *path)
+{
+	struct header hdr;
+	char tmp[strlen(path) + 8];
+	mode_t mask;
+	FILE *f;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+	hdr.size = bm->size;
+	hdr.octaves = bm->octaves;
+	hdr.scale = bm->scale;
+	memcpy(hdr.probe, bm->probe, sizeof(hdr.probe));
+
+	/* write to a temporary and rename, so a half-written file is
+	   never mapped; it has a unique name, so processes saving at
+	   once don't write into each other's */
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return 0;
+
+	/* the permissions fopen() would have given it */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return 0;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(bm->data, data_size(bm->size), 1, f) != 1) {
+		fclose(f);
+		unlink(tmp);
+		return 0;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+static struct basemap *map_file(const char *path, const struct fractal *frac,
+				float scale, int octaves, int size)
+{
+	struct basemap *bm = NULL;
+	const struct header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 ||
+	    st.st_size != sizeof(*hdr) + data_size(size)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	float probe[NPROBES];
+
+	make_probes(frac, scale, octaves, probe);
+
+	hdr = map;
+	if (memcmp(hdr->magic, MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->size != size || hdr->octaves != octaves || hdr->scale != scale ||
+	    memcmp(hdr->probe, probe, sizeof(probe)) != 0)
+		goto fail;
+
+	bm = malloc(sizeof(*bm));
+	if (bm == NULL)
+		goto fail;
+
+	bm->size = size;
+	bm->octaves = octaves;
+	bm->scale = scale;
+	bm->data = (float *)(hdr + 1);
+	bm->map = map;
+	bm->maplen = st.st_size;
+	memcpy(bm->probe, probe, sizeof(probe));
+
+	return bm;
+
+  fail:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+struct basemap *basemap_load(const char *path, const struct fractal *frac,
+			     float scale, int octaves, int size)
+{
+	struct basemap *bm = map_file(path, frac, scale, octaves, size);
+
+	if (bm != NULL)
+		return bm;
+
+	bm = basemap_create(frac, scale, octaves, size);
+	if (bm != NULL && !basemap_save(bm, path))
+		printf("basemap: can't save to %s\n", path);
+
+	return bm;
+}
+
+void basemap_free(struct basemap *bm)
+{
+	if (bm == NULL)
+		return;
+
+	if (bm->map)
+		munmap(bm->map, bm->maplen);
+	else
+		free(bm->data);
+	free(bm);
+}
+
+int basemap_octaves(const struct basemap *bm)
+{
+	return bm->octaves;
+}
+
+/* Catmull-Rom weights for the 4 taps around t */
+static void cubic_weights(float t, float w[4])
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+
+	w[0] = -.5f * t3 + t2 - .5f * t;
+	w[1] = 1.5f * t3 - 2.5f * t2 + 1;
+	w[2] = -1.5f * t3 + 2 * t2 + .5f * t;
+	w[3] = .5f * t3 - .5f * t2;
+}
+
+float basemap_sample(const struct basemap *bm, const vec3_t *v)
+{
+	float ax = fabsf(v->x), ay = fabsf(v->y), az = fabsf(v->z);
+	int axis;
+
+	/* the same choice of face as vec3_majoraxis() */
+	if (ax > ay && ax > az)
+		axis = 0;
+	else if (ay > ax && ay > az)
+		axis = 1;
+	else
+		axis = 2;
+
+	float m = fabsf(v->v[axis]);
+	int f = axis * 2 + (v->v[axis] < 0);
+	float u = v->v[(axis + 1) % 3] / m;
+	float w = v->v[(axis + 2) % 3] / m;
+
+	int s = stride(bm->size);
+	float gx = (u + 1) * .5f * (bm->size - 1) + 1;
+	float gy = (w + 1) * .5f * (bm->size - 1) + 1;
+	int ix = floorf(gx);
+	int iy = floorf(gy);
+
+	/* keep all 4 taps inside the apron */
+	if (ix < 1)
+		ix = 1;
+	if (ix > bm->size - 1)
+		ix = bm->size - 1;
+	if (iy < 1)
+		iy = 1;
+	if (iy > bm->size - 1)
+		iy = bm->size - 1;
+
+	float wx[4], wy[4];
+
+	cubic_weights(gx - ix, wx);
+	cubic_weights(gy - iy, wy);
+
+	const float *grid = &bm->data[f * s * s + (iy - 1) * s + (ix - 1)];
+	float value = 0;
+
+	for(int y = 0; y < 4; y++) {
+		float row = 0;
+
+		for(int x = 0; x < 4; x++)
+			row += grid[y * s + x] * wx[x];
+		value += row * wy[y];
+	}
+
+	return value;
+}
@@ -0,0 +1,38 @@
+#ifndef _BASEMAP_H
+#define _BASEMAP_H
+
+#include "geom.h"
+#include "noise.h"
+
+/*
+   A base map holds the lowest octaves of an fBm, baked once onto a
+   grid per cube face.  The faces use the same i/j parameterisation
+   as the quadtree's patches, so the grid lines up with patch
+   samples.  Sampling is bicubic, so the baked octaves should have
+   several grid samples per feature; fractal_smooth_octaves() with
+   a spacing of 2/size gives a suitable octave count.
+
+   The value stored is fractal_fBm_partial(frac, p, scale, 0, octaves)
+   at each grid point p.
+
+   A base map can be saved to a file and mapped back in later rather
+   than being baked again.
+ */
+
+struct basemap;
+
+struct basemap *basemap_create(const struct fractal *frac, float scale,
+			       int octaves, int size);
+
+/* Map the base map in from path if it holds one for the same
+   parameters; otherwise bake it and save it there. */
+struct basemap *basemap_load(const char *path, const struct fractal *frac,
+			     float scale, int octaves, int size);
+int basemap_save(const struct basemap *bm, const char *path);
+
+void basemap_free(struct basemap *bm);
+
+int basemap_octaves(const struct basemap *bm);
+float basemap_sample(const struct basemap *bm, const vec3_t *v);
+
+#endif	/* _BASEMAP_H */
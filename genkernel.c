@@ -0,0 +1,331 @@
+/*
+   Generate a specialised noise kernel for a fixed terrain.
+
+   Usage: genkernel [-h] name variant ndim seed H lacunarity octaves [offset thresh]
+
+   The permutation and gradient tables, the exponent table, the
+   dimensionality and the octave count are all baked into the emitted
+   C, and the octave loop is unrolled, so there's no runtime dispatch
+   at all.  variant is one of fBm, fBmtest, turbulence or ridged
+   (which also takes offset and thresh).  With -h, the header for the
+   kernel is emitted instead.
+
+   The kernel does exactly the same arithmetic as the matching
+   fractal_*() function, in the same order, so it gives identical
+   results.  The header records the parameters as name_NDIM,
+   name_SEED, name_H and name_LACUNARITY (and name_OFFSET and
+   name_THRESH for ridged), so the fractal itself can be made to
+   match.  It defines:
+
+   float name(const float *f, float octaves);	octaves clamped to the baked count
+   float name_fixed(const float *f);		always the baked count
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "noise.h"
+#include "noise_priv.h"
+
+enum variant {
+	V_FBM,
+	V_FBMTEST,
+	V_TURBULENCE,
+	V_RIDGED,
+};
+
+static const char *variants[] = {
+	[V_FBM]		= "fBm",
+	[V_FBMTEST]	= "fBmtest",
+	[V_TURBULENCE]	= "turbulence",
+	[V_RIDGED]	= "ridged",
+};
+
+static const char *name;
+static int ndim;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: genkernel [-h] name variant ndim seed H lacunarity octaves [offset thresh]\n");
+	exit(1);
+}
+
+/* print a float exactly */
+static void flt(float f)
+{
+	printf("%af", f);
+}
+
+/* Multiply the point by the lacunarity */
+static void emit_scale(float lacunarity)
+{
+	for(int i = 0; i < ndim; i++) {
+		printf("\tp[%d] *= ", i);
+		flt(lacunarity);
+		printf(";\n");
+	}
+}
+
+/* The same sequence of operations as noise_gen(), with the hashes
+   shared between corners as in noise_lanes(). */
+static void emit_noise(const struct fractal *frac)
+{
+	int ncorners = 1 << ndim;
+
+	printf("static const unsigned char %s_map[256] = {", name);
+	for(int i = 0; i < 256; i++)
+		printf("%s%3d,", (i % 12) ? " " : "\n\t", frac->noise.map[i]);
+	printf("\n};\n\n");
+
+	printf("static const float %s_grad[256][%d] = {\n", name, ndim);
+	for(int i = 0; i < 256; i++) {
+		printf("\t{ ");
+		for(int j = 0; j < ndim; j++) {
+			flt(frac->noise.buffer[i][j]);
+			printf(", ");
+		}
+		printf("},\n");
+	}
+	printf("};\n\n");
+
+	printf("static inline __attribute__((always_inline)) float %s_noise(const float *p)\n{\n", name);
+	for(int i = 0; i < ndim; i++) {
+		printf("\tint n%d = floorf(p[%d]);\n", i, i);
+		printf("\tfloat r%d = p[%d] - n%d;\n", i, i, i);
+		printf("\tfloat w%d = r%d * r%d * (3 - 2*r%d);\n", i, i, i, i);
+	}
+	printf("\tunsigned idx[%d];\n", ncorners);
+	printf("\tfloat v[%d];\n\n", ncorners);
+
+	printf("\tidx[0] = 0;\n");
+	for(int i = 0; i < ndim; i++) {
+		int count = 1 << i;
+
+		for(int c = 0; c < count; c++) {
+			printf("\tidx[%d] = %s_map[(idx[%d] + n%d + 1) %% 256];\n",
+			       c + count, name, c, i);
+			printf("\tidx[%d] = %s_map[(idx[%d] + n%d) %% 256];\n",
+			       c, name, c, i);
+		}
+	}
+	printf("\n");
+
+	for(int c = 0; c < ncorners; c++) {
+		printf("\tv[%d] = 0.f", c);
+		for(int i = 0; i < ndim; i++) {
+			if ((c >> i) & 1)
+				printf(" + %s_grad[idx[%d]][%d] * (r%d - 1)", name, c, i, i);
+			else
+				printf(" + %s_grad[idx[%d]][%d] * r%d", name, c, i, i);
+		}
+		printf(";\n");
+	}
+	printf("\n");
+
+	for(int i = 0; i < ndim; i++) {
+		int count = 1 << (ndim - i - 1);
+
+		for(int k = 0; k < count; k++)
+			printf("\tv[%d] = v[%d] + w%d * (v[%d] - v[%d]);\n",
+			       k, 2*k, i, 2*k + 1, 2*k);
+	}
+
+	printf("\n\tv[0] = v[0] < -0.99999f ? -0.99999f : v[0];\n");
+	printf("\tv[0] = v[0] < 0.99999f ? v[0] : 0.99999f;\n");
+	printf("\treturn v[0];\n}\n\n");
+}
+
+static void emit_clamp(const char *min, const char *max, const char *var)
+{
+	printf("\t%s = %s < %s ? %s : %s;\n", var, var, min, min, var);
+	printf("\t%s = %s < %s ? %s : %s;\n", var, var, max, var, max);
+}
+
+/* fBm and its relatives: sum of octaves, with the last faded in */
+static void emit_sum(enum variant v, const struct fractal *frac, int whole)
+{
+	const char *abs0 = v == V_TURBULENCE ? "fabsf(" : "";
+	const char *abs1 = v == V_TURBULENCE ? ")" : "";
+
+	printf("\tfloat value = 0;\n");
+	printf("\tint whole = octaves;\n\n");
+
+	for(int i = 0; i < whole; i++) {
+		printf("\tif (whole <= %d)\n\t\tgoto tail;\n", i);
+		printf("\tvalue += %s%s_noise(p)%s * ", abs0, name, abs1);
+		flt(frac->exponent[i]);
+		printf(";\n");
+		emit_scale(frac->lacunarity);
+	}
+
+	printf("\n  tail:\n");
+	printf("\toctaves -= whole;\n");
+	printf("\tif (octaves > ");
+	flt(EPSILON);
+	printf(")\n\t\tvalue += octaves * %s%s_noise(p)%s * %s_exponent[whole];\n\n",
+	       abs0, name, abs1, name);
+
+	if (v == V_FBMTEST) {
+		printf("\tif (value < 0.f)\n\t\treturn -powf(-value, 0.7f);\n");
+		printf("\treturn powf(value, 1 + %s_noise(p) * value);\n", name);
+	} else {
+		emit_clamp("-0.99999f", "0.99999f", "value");
+		printf("\treturn value;\n");
+	}
+}
+
+static void emit_ridged(const struct fractal *frac, int last, float offset, float thresh)
+{
+	printf("\tfloat result, weight, signal;\n");
+	printf("\tint whole = octaves;\n");
+	printf("\tfloat rem = octaves - whole;\n");
+	printf("\tint last = whole + (rem > ");
+	flt(EPSILON);
+	printf(");\n\n");
+
+	printf("\tsignal = ");
+	flt(offset);
+	printf(" - fabsf(%s_noise(p));\n", name);
+	printf("\tsignal *= signal;\n");
+	printf("\tresult = signal;\n\n");
+
+	for(int i = 1; i < last; i++) {
+		printf("\tif (last <= %d)\n\t\treturn result;\n", i);
+		emit_scale(frac->lacunarity);
+		printf("\tweight = signal * ");
+		flt(thresh);
+		printf(";\n");
+		emit_clamp("0.f", "1.f", "weight");
+		printf("\tsignal = ");
+		flt(offset);
+		printf(" - fabsf(%s_noise(p));\n", name);
+		printf("\tsignal *= signal;\n");
+		printf("\tsignal *= weight;\n");
+		printf("\tif (%d < whole)\n\t\tresult += signal * ", i);
+		flt(frac->exponent[i]);
+		printf(";\n\telse\n\t\tresult += rem * signal * ");
+		flt(frac->exponent[i]);
+		printf(";\n");
+	}
+
+	printf("\treturn result;\n");
+}
+
+int main(int argc, char **argv)
+{
+	int header = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+		header = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc != 8 && argc != 10)
+		usage();
+
+	name = argv[1];
+
+	enum variant v;
+	for(v = 0; v < sizeof(variants) / sizeof(*variants); v++)
+		if (strcmp(argv[2], variants[v]) == 0)
+			break;
+	if (v == sizeof(variants) / sizeof(*variants))
+		usage();
+
+	ndim = atoi(argv[3]);
+	unsigned seed = strtoul(argv[4], NULL, 0);
+	float H = atof(argv[5]);
+	float lacunarity = atof(argv[6]);
+	float octaves = atof(argv[7]);
+	float offset = argc > 8 ? atof(argv[8]) : 1;
+	float thresh = argc > 9 ? atof(argv[9]) : 2;
+
+	/* noise_gen() hashes 1 and 4 dimensional lattices differently,
+	   and they aren't worth a kernel */
+	if (ndim < 2 || ndim > 3) {
+		fprintf(stderr, "genkernel: only 2 and 3 dimensions are supported\n");
+		exit(1);
+	}
+	if (octaves < 1 || octaves >= MAX_OCTAVES) {
+		fprintf(stderr, "genkernel: octaves must be in [1, %d)\n", MAX_OCTAVES);
+		exit(1);
+	}
+
+	if (header) {
+		printf("/* Generated by genkernel; do not edit */\n");
+		printf("#ifndef _%s_H\n#define _%s_H\n\n", name, name);
+		printf("/* %s: %dD %s, seed %u, H %g, lacunarity %g, %g octaves */\n",
+		       name, ndim, variants[v], seed, H, lacunarity, octaves);
+		printf("#define %s_OCTAVES\t%af\n\n", name, octaves);
+
+		/* the parameters, so the fractal the kernel stands for
+		   can be made from the same numbers */
+		printf("#define %s_NDIM\t\t%d\n", name, ndim);
+		printf("#define %s_SEED\t\t%uu\n", name, seed);
+		printf("#define %s_H\t\t%af\n", name, H);
+		printf("#define %s_LACUNARITY\t%af\n", name, lacunarity);
+		if (v == V_RIDGED) {
+			printf("#define %s_OFFSET\t%af\n", name, offset);
+			printf("#define %s_THRESH\t%af\n", name, thresh);
+		}
+		printf("\n");
+		printf("float %s(const float *f, float octaves);\n", name);
+		printf("float %s_fixed(const float *f);\n", name);
+		printf("\n#endif\n");
+		return 0;
+	}
+
+	struct fractal frac;
+
+	fractal_init(&frac, ndim, seed, H, lacunarity);
+
+	int whole = octaves;
+	int last = whole + (octaves - whole > EPSILON);
+
+	printf("/* Generated by genkernel; do not edit */\n");
+	printf("/* %s: %dD %s, seed %u, H %g, lacunarity %g, %g octaves */\n",
+	       name, ndim, variants[v], seed, H, lacunarity, octaves);
+	printf("#include <math.h>\n");
+	printf("#include \"%s.h\"\n\n", name);
+
+	printf("static const float %s_exponent[%d] = {\n", name, whole + 1);
+	for(int i = 0; i <= whole; i++) {
+		printf("\t");
+		flt(frac.exponent[i]);
+		printf(",\n");
+	}
+	printf("};\n\n");
+
+	emit_noise(&frac);
+
+	printf("static inline __attribute__((always_inline)) float %s_eval(const float *f, float octaves)\n{\n", name);
+	printf("\tfloat p[%d];\n\n", ndim);
+	printf("\tif (octaves > ");
+	flt(octaves);
+	printf(")\n\t\toctaves = ");
+	flt(octaves);
+	printf(";\n");
+	printf("\tif (octaves < 0)\n\t\toctaves = 0;\n\n");
+	for(int i = 0; i < ndim; i++)
+		printf("\tp[%d] = f[%d]%s;\n", i, i, v == V_FBMTEST ? " * 2" : "");
+	printf("\n");
+
+	if (v == V_RIDGED)
+		emit_ridged(&frac, last, offset, thresh);
+	else
+		emit_sum(v, &frac, whole);
+
+	printf("}\n\n");
+
+	printf("float %s(const float *f, float octaves)\n{\n", name);
+	printf("\treturn %s_eval(f, octaves);\n}\n\n", name);
+
+	printf("float %s_fixed(const float *f)\n{\n", name);
+	printf("\treturn %s_eval(f, ", name);
+	flt(octaves);
+	printf(");\n}\n");
+
+	return 0;
+}
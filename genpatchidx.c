@@ -1,16 +1,39 @@
-/* 
+/*
    Generate the 16 different forms of patch geometry
+
+   Usage: genpatchidx [-s] [-c cachesize]
+
+   The indices are emitted as triangle strips, or with PATCH_LISTS as
+   triangle lists reordered for the post-transform vertex cache
+   (using Tom Forsyth's "Linear-Speed Vertex Cache Optimisation").
+   With -s, nothing is emitted; instead each form is run through FIFO
+   and LRU cache simulations for a range of patch sizes, printing the
+   average cache miss ratio (ACMR, misses per triangle) and average
+   transform to vertex ratio (ATVR, misses per vertex used).
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <GL/gl.h>
 #include "quadtree.h"
 #include "quadtree_priv.h"
 
-int main()
+#define MAX_SAMPLES	32		/* largest patch size simulated */
+#define MAX_MESH	(MAX_SAMPLES + 1)
+#define MAX_VERTICES	(MAX_MESH * MAX_MESH + 4 * MAX_SAMPLES)
+#define MAX_INDICES	(MAX_SAMPLES * MAX_SAMPLES * 6 + 4 * MAX_SAMPLES * 12 + 16)
+
+#define NCLASSES	9
+#define SKIRT_CLASS	NCLASSES	/* the skirted mesh */
+
+static int cachesize = 16;
+
+/* A triangle strip for neighbour class (ud, lr) of an n sample patch */
+static int class_strip(int n, int ud, int lr, unsigned *out)
 {
-	printf("#include <GL/gl.h>\n");
-	printf("#include \"quadtree_priv.h\"\n\n");
-	printf("const patch_index_t patch_indices[9][INDICES_PER_PATCH] = {\n");
+	int mesh = n + 1;
+	int count = 0;
 
 	/* This generates 9 sets of indices for the 9 possible
 	   combinations of neighbour relations.  While there are 4
@@ -38,46 +61,419 @@ int main()
 #define R	(1<<0)
 #define U	(1<<1)
 #define D	(1<<0)
-	for(int ud = 0; ud < 3; ud++) {
-		for(int lr = 0; lr < 3; lr++) {
-			printf("\t/* ud=%d lr=%d */\n", ud, lr);
-			printf("\t{ ");
-			for(int y = 0; y < MESH_SAMPLES-1; y++) {
-				for(int x = 0; x < MESH_SAMPLES; x++) {
-					int xmask0 = ~0, xadd0 = 0;
-					int xmask1 = ~0, xadd1 = 0;
-					int ymask = ~0, yadd = 0;
-
-					if ((lr & L) && x == 0) {
-						ymask = ~1;
-						yadd = 1;
-					}
-
-					if ((lr & R) && x == MESH_SAMPLES-1)
-						ymask = ~1;
-
-					if ((ud & D) && y == 0) {
-						xmask0 = ~1;
-						xadd0 = 1;
-					}
-
-					if ((ud & U) && y == MESH_SAMPLES-2)
-						xmask1 = ~1;
-
-					if (y != 0 && x == 0)
-						printf("\n\t  %u, ", ((y+1 + yadd) & ymask) * MESH_SAMPLES + ((x + xadd1) & xmask1));
-
-					printf("%u, %u, ",
-					       ((y+1 + yadd) & ymask) * MESH_SAMPLES + ((x + xadd1) & xmask1),
-					       ((y+0 + yadd) & ymask) * MESH_SAMPLES + ((x + xadd0) & xmask0));
-
-					if (y != MESH_SAMPLES-2 && x == MESH_SAMPLES-1)
-						printf("%u, ", ((y+0 + yadd) & ymask) * MESH_SAMPLES + ((x + xadd0) & xmask0));
+	for(int y = 0; y < mesh-1; y++) {
+		for(int x = 0; x < mesh; x++) {
+			int xmask0 = ~0, xadd0 = 0;
+			int xmask1 = ~0, xadd1 = 0;
+			int ymask = ~0, yadd = 0;
+
+			if ((lr & L) && x == 0) {
+				ymask = ~1;
+				yadd = 1;
+			}
+
+			if ((lr & R) && x == mesh-1)
+				ymask = ~1;
+
+			if ((ud & D) && y == 0) {
+				xmask0 = ~1;
+				xadd0 = 1;
+			}
+
+			if ((ud & U) && y == mesh-2)
+				xmask1 = ~1;
+
+			if (y != 0 && x == 0)
+				out[count++] = ((y+1 + yadd) & ymask) * mesh + ((x + xadd1) & xmask1);
+
+			out[count++] = ((y+1 + yadd) & ymask) * mesh + ((x + xadd1) & xmask1);
+			out[count++] = ((y+0 + yadd) & ymask) * mesh + ((x + xadd0) & xmask0);
+
+			if (y != mesh-2 && x == mesh-1)
+				out[count++] = ((y+0 + yadd) & ymask) * mesh + ((x + xadd0) & xmask0);
+		}
+	}
+
+	return count;
+}
+
+/* Edge sample k of the skirt ring, going anticlockwise from 0,0.  Its
+   skirt vertex is at mesh^2 + k. */
+static unsigned skirt_ring(int n, int k)
+{
+	int mesh = n + 1;
+	int side = k / n;
+	int i = k % n;
+
+	switch(side) {
+	case 0:	return i;				/* bottom */
+	case 1:	return i * mesh + n;			/* right */
+	case 2:	return n * mesh + (n - i);		/* top */
+	default: return (n - i) * mesh;			/* left */
+	}
+}
+
+/* Skirted patches: the unstitched mesh, then a strip round the skirt
+   and back again the other way, so the skirt is two-sided */
+static int skirt_strip(int n, unsigned *out)
+{
+	int mesh = n + 1;
+	int ring = 4 * n;
+	int count = class_strip(n, 0, 0, out);
+
+	/* the mesh strip has an even length and ends at (n, n-1);
+	   repeating that and the first ring vertex puts the first skirt
+	   triangle at an even position, so it keeps its winding */
+	out[count++] = (n-1) * mesh + n;
+	out[count++] = skirt_ring(n, 0);
+	out[count++] = skirt_ring(n, 0);
+
+	for(int k = 0; k <= ring; k++) {
+		out[count++] = skirt_ring(n, k % ring);
+		out[count++] = mesh * mesh + (k % ring);
+	}
+
+	for(int k = ring-1; k >= 0; k--) {
+		out[count++] = skirt_ring(n, k);
+		out[count++] = mesh * mesh + k;
+	}
+
+	return count;
+}
+
+/* Convert a strip to a list, dropping degenerate triangles */
+static int strip_to_list(const unsigned *strip, int count, unsigned *out)
+{
+	int n = 0;
+
+	for(int i = 0; i + 2 < count; i++) {
+		unsigned a = strip[i], b = strip[i+1], c = strip[i+2];
+
+		if (a == b || b == c || a == c)
+			continue;
+
+		/* odd triangles are wound the other way */
+		if (i & 1) {
+			unsigned t = a;
+			a = b;
+			b = t;
+		}
+
+		out[n++] = a;
+		out[n++] = b;
+		out[n++] = c;
+	}
+
+	return n;
+}
+
+/*
+   Forsyth's vertex cache optimisation.  Triangles are emitted
+   greedily, choosing the one whose vertices score highest: vertices
+   recently used score highly (except for the last triangle's, which
+   score a bit less so the mesh isn't traversed as a strip), and
+   vertices with few triangles left get a boost so they get finished
+   off rather than left as stragglers.
+ */
+#define FORSYTH_CACHE		32
+#define FORSYTH_DECAY		1.5f
+#define FORSYTH_LAST_TRI	.75f
+#define FORSYTH_VALENCE_SCALE	2.f
+#define FORSYTH_VALENCE_POWER	.5f
+
+static float vertex_score(int cachepos, int remaining)
+{
+	float score = 0;
+
+	if (remaining == 0)
+		return -1;
+
+	if (cachepos >= 0) {
+		if (cachepos < 3)
+			score = FORSYTH_LAST_TRI;
+		else
+			score = powf(1.f - (float)(cachepos - 3) / (FORSYTH_CACHE - 3),
+				     FORSYTH_DECAY);
+	}
+
+	return score + FORSYTH_VALENCE_SCALE * powf(remaining, -FORSYTH_VALENCE_POWER);
+}
+
+static void forsyth(unsigned *idx, int count)
+{
+	int ntris = count / 3;
+	unsigned out[MAX_INDICES];
+	int remaining[MAX_VERTICES];
+	int cachepos[MAX_VERTICES];
+	char done[MAX_INDICES / 3];
+	int cache[FORSYTH_CACHE + 3];
+	int ncache = 0;
+
+	memset(remaining, 0, sizeof(remaining));
+	memset(done, 0, sizeof(done));
+	for(int i = 0; i < MAX_VERTICES; i++)
+		cachepos[i] = -1;
+	for(int i = 0; i < count; i++)
+		remaining[idx[i]]++;
+
+	for(int n = 0; n < ntris; n++) {
+		int best = -1;
+		float bestscore = 0;
+
+		/* only triangles using cached vertices are worth
+		   considering, unless there aren't any */
+		for(int t = 0; t < ntris; t++) {
+			if (done[t])
+				continue;
+
+			int cached = 0;
+			float score = 0;
+
+			for(int k = 0; k < 3; k++) {
+				unsigned v = idx[t * 3 + k];
+
+				cached |= cachepos[v] >= 0;
+				score += vertex_score(cachepos[v], remaining[v]);
+			}
+
+			if (ncache && !cached)
+				score -= 1000;
+
+			if (best < 0 || score > bestscore) {
+				best = t;
+				bestscore = score;
+			}
+		}
+
+		done[best] = 1;
+
+		/* move the triangle's vertices to the front of the
+		   cache */
+		int newcache[FORSYTH_CACHE + 3];
+		int nnew = 0;
+
+		for(int k = 0; k < 3; k++) {
+			unsigned v = idx[best * 3 + k];
+
+			out[n * 3 + k] = v;
+			remaining[v]--;
+			newcache[nnew++] = v;
+		}
+
+		for(int i = 0; i < ncache; i++) {
+			int v = cache[i];
+
+			if (v != newcache[0] && v != newcache[1] && v != newcache[2])
+				newcache[nnew++] = v;
+		}
+
+		for(int i = 0; i < ncache; i++)
+			cachepos[cache[i]] = -1;
+
+		ncache = nnew < FORSYTH_CACHE ? nnew : FORSYTH_CACHE;
+		for(int i = 0; i < ncache; i++) {
+			cache[i] = newcache[i];
+			cachepos[cache[i]] = i;
+		}
+	}
+
+	memcpy(idx, out, sizeof(*idx) * count);
+}
+
+/* The indices for class c of an n sample patch, in the chosen
+   format */
+static int patch_form(int n, int c, int lists, unsigned *out)
+{
+	unsigned strip[MAX_INDICES];
+	int count;
+
+	if (c == SKIRT_CLASS)
+		count = skirt_strip(n, strip);
+	else
+		count = class_strip(n, c / 3, c % 3, strip);
+
+	if (!lists) {
+		memcpy(out, strip, sizeof(*out) * count);
+		return count;
+	}
+
+	count = strip_to_list(strip, count, out);
+	forsyth(out, count);
+
+	return count;
+}
+
+/* Run a FIFO or LRU cache over the vertex fetches of idx, returning
+   the number of misses */
+static int simulate(const unsigned *idx, int count, int lru)
+{
+	int cache[cachesize];
+	int ncache = 0, head = 0;
+	int misses = 0;
+
+	for(int i = 0; i < count; i++) {
+		int hit = -1;
+
+		for(int k = 0; k < ncache; k++)
+			if (cache[k] == idx[i]) {
+				hit = k;
+				break;
+			}
+
+		if (hit >= 0) {
+			if (lru) {
+				/* move to most recent */
+				memmove(&cache[1], &cache[0], sizeof(*cache) * hit);
+				cache[0] = idx[i];
+			}
+			continue;
+		}
+
+		misses++;
+
+		if (lru) {
+			if (ncache < cachesize)
+				ncache++;
+			memmove(&cache[1], &cache[0], sizeof(*cache) * (ncache - 1));
+			cache[0] = idx[i];
+		} else if (ncache < cachesize)
+			cache[ncache++] = idx[i];
+		else {
+			cache[head] = idx[i];
+			head = (head + 1) % cachesize;
+		}
+	}
+
+	return misses;
+}
+
+static void stats(void)
+{
+	static const char *formats[] = { "strip", "list", "forsyth" };
+
+	printf("%5s %5s %-8s %5s %5s   FIFO%-2d ACMR  ATVR   LRU%-2d ACMR  ATVR\n",
+	       "patch", "class", "format", "tris", "verts", cachesize, cachesize);
+
+	for(int n = 4; n <= MAX_SAMPLES; n *= 2) {
+		for(int c = 0; c <= SKIRT_CLASS; c++) {
+			for(int f = 0; f < 3; f++) {
+				unsigned idx[MAX_INDICES], list[MAX_INDICES];
+				int count, ntris;
+				char used[MAX_VERTICES];
+				int nverts = 0;
+
+				count = patch_form(n, c, 0, idx);
+
+				if (f == 0)
+					ntris = strip_to_list(idx, count, list) / 3;
+				else {
+					count = strip_to_list(idx, count, list);
+					memcpy(idx, list, sizeof(*idx) * count);
+					if (f == 2)
+						forsyth(idx, count);
+					ntris = count / 3;
 				}
 
+				memset(used, 0, sizeof(used));
+				for(int i = 0; i < count; i++)
+					if (!used[idx[i]]++)
+						nverts++;
+
+				int fifo = simulate(idx, count, 0);
+				int lru = simulate(idx, count, 1);
+				char class[8];
+
+				if (c == SKIRT_CLASS)
+					strcpy(class, "skirt");
+				else
+					sprintf(class, "%d%d", c / 3, c % 3);
+
+				printf("%5d %5s %-8s %5d %5d   %11.3f %5.3f   %10.3f %5.3f\n",
+				       n, class, formats[f], ntris, nverts,
+				       (float)fifo / ntris, (float)fifo / nverts,
+				       (float)lru / ntris, (float)lru / nverts);
 			}
-			printf(" },\n\n");
 		}
+		printf("\n");
+	}
+}
+
+static void emit(const char *decl, const unsigned *idx, int count, int pad)
+{
+	printf("%s{\n\t", decl);
+	for(int i = 0; i < count; i++)
+		printf("%u,%s", idx[i], (i % 16) == 15 ? "\n\t" : " ");
+	for(int i = count; i < pad; i++)
+		printf("0,%s", (i % 16) == 15 ? "\n\t" : " ");
+	printf("\n}");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: genpatchidx [-s] [-c cachesize]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int sim = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0)
+			sim = 1;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			cachesize = atoi(argv[++i]);
+			if (cachesize < 1)
+				usage();
+		} else
+			usage();
 	}
-	printf("};\n");
+
+	if (sim) {
+		stats();
+		return 0;
+	}
+
+	unsigned idx[MAX_INDICES];
+	int counts[NCLASSES];
+
+	printf("#include <GL/gl.h>\n");
+	printf("#include \"quadtree_priv.h\"\n\n");
+
+	printf("const patch_index_t patch_indices[9][INDICES_PER_PATCH] = {\n");
+	for(int c = 0; c < NCLASSES; c++) {
+		char decl[32];
+
+		counts[c] = patch_form(PATCH_SAMPLES, c, PATCH_LISTS, idx);
+		if (counts[c] > INDICES_PER_PATCH) {
+			fprintf(stderr, "genpatchidx: %d indices for class %d, expected at most %d\n",
+				counts[c], c, INDICES_PER_PATCH);
+			return 1;
+		}
+		sprintf(decl, "\t/* ud=%d lr=%d */\n\t", c / 3, c % 3);
+		emit(decl, idx, counts[c], INDICES_PER_PATCH);
+		printf(",\n\n");
+	}
+	printf("};\n\n");
+
+	/* stitched classes have fewer triangles as lists; the rest of
+	   their arrays is padding */
+	printf("const unsigned short patch_index_count[9] = {\n\t");
+	for(int c = 0; c < NCLASSES; c++)
+		printf("%d, ", counts[c]);
+	printf("\n};\n\n");
+
+	int count = patch_form(PATCH_SAMPLES, SKIRT_CLASS, PATCH_LISTS, idx);
+
+	if (count != SKIRT_INDICES) {
+		fprintf(stderr, "genpatchidx: %d skirt indices, expected %d\n",
+			count, SKIRT_INDICES);
+		return 1;
+	}
+
+	emit("const patch_index_t patch_skirt_indices[SKIRT_INDICES] = ",
+	     idx, count, count);
+	printf(";\n");
+
+	return 0;
 }
@@ -1,10 +1,16 @@
-#include <GL/gl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "noise.h"
+#include "texcomp.h"
+#include "gentexture.h"
 
 static const unsigned char g_cTexture[] =
 {
@@ -277,10 +283,21 @@ static float clamp(float min, float max, float x)
 	return x;
 }
 
-GLuint buildtexture(float fVariance)
-{
-	GLuint texid;
+#define MAX_THREADS	64
+
+struct texjob {
+	unsigned char *pixels;
+	struct fractal *frac;
+	unsigned seed;
+	float variance;
+	int size;
+	int next_row;
+};
 
+/* Row i of the texture; v and d have room for a row's fBm points
+   and values */
+static void texture_row(const struct texjob *job, int i, float *v, float *d)
+{
 	struct color
 	{
 		float r, g, b, a;
@@ -309,74 +326,295 @@ GLuint buildtexture(float fVariance)
 		{1.0f, 1.0f, 1.0f}
 	};
 
-#define HALF_RAND		(RAND_MAX>>1)
-#define TEXTURE_SIZE	256
+	int size = job->size;
+	float fVariance = job->variance;
+	unsigned char *pixels = &job->pixels[(size_t)i * size * 3];
+	struct random rng;
 
-	unsigned char pixels[TEXTURE_SIZE * TEXTURE_SIZE * 3];
-	struct fractal *frac;
+	/* each row has its own generator, so the texture doesn't
+	   depend on which thread made which row */
+	random_init(&rng, job->seed + i * 0x9e3779b9u);
 
-	frac = fractal_create(2, 12382, 1.f - (8. / 255), 2.25);
-
-	glGenTextures(1, &texid);
+	for(int j = 0; j < size; j++) {
+		v[j * 2 + 0] = (float)j / size;
+		v[j * 2 + 1] = (float)i / size;
+	}
+	fractal_fBm_batch(job->frac, v, size, 4, d);
 
 	int n = 0;
-	float fLattitude = 0;
-	for(int i=0; i<TEXTURE_SIZE; i++) {
-		float fAltitude = -fVariance;
-
-		for(int j=0; j<TEXTURE_SIZE; j++) {
-			float v[2] = { (float)j / TEXTURE_SIZE, (float)i / TEXTURE_SIZE };
-			float d = clamp(0, 255, 250 + fractal_fBm(frac, v, 4) * 255 * .8);
-
-			if(fAltitude < 0) {
-				if(fLattitude > 75.0f) {
-					pixels[n++] = d;
-					pixels[n++] = d;
-					pixels[n++] = 255;
-				} else {
-					float f = (1.0f - fAltitude / -fVariance) * 6.0f;
-
-					int nWhole = (int)f;
-					f -= (float)nWhole;
-
-					pixels[n++] = (255.0f * (fOcean[nWhole].r * (1-f) + fOcean[nWhole+1].r * f));
-					pixels[n++] = (255.0f * (fOcean[nWhole].g * (1-f) + fOcean[nWhole+1].g * f));
-					pixels[n++] = (255.0f * (fOcean[nWhole].b * (1-f) + fOcean[nWhole+1].b * f));
-				}
+	float fLattitude = 90.0f * i / size;
+	float fAltitude = -fVariance;
+
+	for(int j=0; j<size; j++) {
+		float d8 = clamp(0, 255, 250 + d[j] * 255 * .8);
+
+		if(fAltitude < 0) {
+			if(fLattitude > 75.0f) {
+				pixels[n++] = d8;
+				pixels[n++] = d8;
+				pixels[n++] = 255;
 			} else {
-				int a = clamp(0, 255, i + 255*fAltitude/fVariance);
-				unsigned char r,g,b;
+				float f = (1.0f - fAltitude / -fVariance) * 6.0f;
 
-				r = g_cTexture[a*3 + 0];
-				g = g_cTexture[a*3 + 1];
-				b = g_cTexture[a*3 + 2];
+				int nWhole = (int)f;
+				f -= (float)nWhole;
 
-				if (r > 250 && g > 250 && b > 250) {
-					r = d;
-					g = d;
-				}
+				pixels[n++] = (255.0f * (fOcean[nWhole].r * (1-f) + fOcean[nWhole+1].r * f));
+				pixels[n++] = (255.0f * (fOcean[nWhole].g * (1-f) + fOcean[nWhole+1].g * f));
+				pixels[n++] = (255.0f * (fOcean[nWhole].b * (1-f) + fOcean[nWhole+1].b * f));
+			}
+		} else {
+			int a = clamp(0, 255, i * 256 / size + 255*fAltitude/fVariance);
+			unsigned char r,g,b;
 
-				pixels[n++] = (255.0f * clamp(0, 1, r / 255.0f + (rand()-HALF_RAND)/(RAND_MAX*50.0f)));
-				pixels[n++] = (255.0f * clamp(0, 1, g / 255.0f + (rand()-HALF_RAND)/(RAND_MAX*50.0f)));
-				pixels[n++] = (255.0f * clamp(0, 1, b / 255.0f + (rand()-HALF_RAND)/(RAND_MAX*50.0f)));
+			r = g_cTexture[a*3 + 0];
+			g = g_cTexture[a*3 + 1];
+			b = g_cTexture[a*3 + 2];
+
+			if (r > 250 && g > 250 && b > 250) {
+				r = d8;
+				g = d8;
 			}
-			fAltitude += fVariance * 2.0f / TEXTURE_SIZE;
+
+			pixels[n++] = (255.0f * clamp(0, 1, r / 255.0f + random_range(&rng, -.01f, .01f)));
+			pixels[n++] = (255.0f * clamp(0, 1, g / 255.0f + random_range(&rng, -.01f, .01f)));
+			pixels[n++] = (255.0f * clamp(0, 1, b / 255.0f + random_range(&rng, -.01f, .01f)));
 		}
-		fLattitude += 90.0f / TEXTURE_SIZE;
+		fAltitude += fVariance * 2.0f / size;
+	}
+}
+
+static void *texture_rows(void *arg)
+{
+	struct texjob *job = arg;
+	float *v = malloc(sizeof(*v) * job->size * 3);
+	int i;
+
+	if (v == NULL)
+		return NULL;
+
+	while((i = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED)) < job->size)
+		texture_row(job, i, v, v + job->size * 2);
+
+	free(v);
+
+	return NULL;
+}
+
+int maketexture(unsigned char *pixels, unsigned seed, float variance,
+		int size, int threads)
+{
+	struct texjob job;
+	pthread_t tid[MAX_THREADS];
+	int started = 0;
+
+	if (size < 1 || size > TEXTURE_MAX_SIZE)
+		return 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads < 1)
+		threads = 1;
+
+	job.pixels = pixels;
+	job.frac = fractal_create(2, seed, 1.f - (8. / 255), 2.25);
+	job.seed = seed;
+	job.variance = variance;
+	job.size = size;
+	job.next_row = 0;
+
+	if (job.frac == NULL)
+		return 0;
+
+	for(int i = 0; i < threads - 1; i++) {
+		if (pthread_create(&tid[i], NULL, texture_rows, &job) != 0)
+			break;
+		started++;
+	}
+
+	texture_rows(&job);
+	for(int i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	free(job.frac);
+
+	/* rows are left if no thread could get the memory to start */
+	return job.next_row >= size;
+}
+
+/*
+   The cache is content addressed: a file's name is a hash of what
+   it holds the texture for, and its header says it again to guard
+   against collisions.  Data follows the header.
+ */
+#define MAGIC	"texture1"
+
+struct header {
+	char magic[8];
+	uint32_t seed;
+	float variance;
+	int32_t size;
+	int32_t bc1;
+};
+
+static size_t data_size(int size, int bc1)
+{
+	return bc1 ? texcomp_size(TEXCOMP_BC1, size, size) : (size_t)size * size * 3;
+}
+
+static void cache_path(char *path, size_t len, const char *dir,
+		       const struct header *hdr)
+{
+	const unsigned char *p = (const unsigned char *)hdr;
+	uint64_t hash = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	for(size_t i = 0; i < sizeof(*hdr); i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+
+	snprintf(path, len, "%s/texture-%016llx.cache", dir, (unsigned long long)hash);
+}
+
+static int map_texture(struct texture *tex, const char *path,
+		       const struct header *hdr)
+{
+	size_t len = sizeof(*hdr) + tex->len;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	if (fstat(fd, &st) == -1 || st.st_size != len) {
+		close(fd);
+		return 0;
 	}
 
-	free(frac);
-	assert(n == sizeof(pixels));
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	if (memcmp(map, hdr, sizeof(*hdr)) != 0) {
+		munmap(map, len);
+		return 0;
+	}
 
-	glBindTexture(GL_TEXTURE_2D, texid);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEXTURE_SIZE, TEXTURE_SIZE,
-		     0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	tex->data = (const char *)map + sizeof(*hdr);
+	tex->map = map;
 
-	if (1) {
-		int fd = open("tex.rgb", O_WRONLY|O_TRUNC|O_CREAT, 0600);
-		write(fd, pixels, sizeof(pixels));
+	return 1;
+}
+
+static int save_texture(const struct texture *tex, const char *path,
+			const struct header *hdr)
+{
+	char tmp[strlen(path) + 8];
+	mode_t mask;
+	FILE *f;
+	int fd;
+
+	/* write to a temporary and rename, as basemap_save() does */
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return 0;
+
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
 		close(fd);
+		unlink(tmp);
+		return 0;
+	}
+
+	if (fwrite(hdr, sizeof(*hdr), 1, f) != 1 ||
+	    fwrite(tex->data, tex->len, 1, f) != 1) {
+		fclose(f);
+		unlink(tmp);
+		return 0;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 0;
 	}
 
-	return texid;
+	return 1;
+}
+
+struct texture *texture_load(const char *dir, unsigned seed, float variance,
+			     int size, int bc1, int threads)
+{
+	struct texture *tex;
+	struct header hdr;
+	char path[strlen(dir) + 32];
+
+	if (size < 1 || size > TEXTURE_MAX_SIZE)
+		return NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+	hdr.seed = seed;
+	hdr.variance = variance;
+	hdr.size = size;
+	hdr.bc1 = bc1;
+
+	tex = malloc(sizeof(*tex));
+	if (tex == NULL)
+		return NULL;
+
+	tex->size = size;
+	tex->bc1 = bc1;
+	tex->len = data_size(size, bc1);
+	tex->map = NULL;
+
+	cache_path(path, sizeof(path), dir, &hdr);
+	if (map_texture(tex, path, &hdr))
+		return tex;
+
+	unsigned char *pixels = malloc((size_t)size * size * 3);
+
+	if (pixels == NULL || !maketexture(pixels, seed, variance, size, threads)) {
+		free(pixels);
+		free(tex);
+		return NULL;
+	}
+
+	if (bc1) {
+		void *blocks = malloc(tex->len);
+
+		if (blocks)
+			texcomp_encode(TEXCOMP_BC1, blocks, pixels, size, size, 3, threads);
+		free(pixels);
+		if (blocks == NULL) {
+			free(tex);
+			return NULL;
+		}
+		tex->data = blocks;
+	} else
+		tex->data = pixels;
+
+	if (!save_texture(tex, path, &hdr))
+		printf("texture: can't save to %s\n", path);
+
+	return tex;
+}
+
+void texture_free(struct texture *tex)
+{
+	if (tex == NULL)
+		return;
+
+	if (tex->map)
+		munmap(tex->map, sizeof(struct header) + tex->len);
+	else
+		free((void *)tex->data);
+	free(tex);
 }
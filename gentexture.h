@@ -0,0 +1,37 @@
+#ifndef _GENTEXTURE_H
+#define _GENTEXTURE_H
+
+#include <stddef.h>
+
+/*
+   The demo's planet texture, coloured by latitude and altitude.
+   It's made a row at a time across threads, and depends only on
+   its seed, variance and size, so it can be cached on disk.
+ */
+#define TEXTURE_SIZE		256
+#define TEXTURE_MAX_SIZE	8192
+#define TEXTURE_SEED		12382
+
+/* Make the texture's size^2 RGB pixels on threads threads (0 for
+   one per CPU).  Returns 0 if it can't be done. */
+int maketexture(unsigned char *pixels, unsigned seed, float variance,
+		int size, int threads);
+
+/* A made texture, as RGB pixels or their BC1 blocks */
+struct texture {
+	int size;
+	int bc1;
+	const void *data;
+	size_t len;
+	void *map;		/* cache file mapping, if mapped */
+};
+
+/* Map the texture in from its cache file in dir if there is one;
+   otherwise make it (BC1 coded if bc1 is set) and save it there.
+   The file is named for (seed, variance, size, bc1), so different
+   textures don't displace each other.  NULL if it can't be made. */
+struct texture *texture_load(const char *dir, unsigned seed, float variance,
+			     int size, int bc1, int threads);
+void texture_free(struct texture *tex);
+
+#endif	/* _GENTEXTURE_H */
@@ -1,24 +1,11 @@
 #include <math.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "noise.h"
-
-#define EPSILON	(1e-6f)
-
-struct noise {
-	unsigned ndim;
-	unsigned char map[256];
-	float buffer[256][MAX_DIMENSIONS];
-};
-
-struct fractal {
-	struct noise noise;
-
-	float H;
-	float lacunarity;
-	float exponent[MAX_OCTAVES];
-};
+#include "noise_priv.h"
+#include "simd.h"
 
 static void normalize(float *f, int n)
 {
@@ -65,19 +52,21 @@ void noise_init(struct noise *n, int ndim, unsigned int seed)
 	if (ndim > MAX_DIMENSIONS)
 		ndim = MAX_DIMENSIONS;
 
+	struct random rng;
+
 	n->ndim = ndim;
 
-	random_init(seed);
+	random_init(&rng, seed);
 
 	for(int i = 0; i < 256; i++) {
 		n->map[i] = i;
 		for(int j = 0; j < ndim; j++)
-			n->buffer[i][j] = random_range(-0.5f, 0.5f);
+			n->buffer[i][j] = random_range(&rng, -0.5f, 0.5f);
 		normalize(n->buffer[i], ndim);
 	}
 
 	for(int i = 0; i < 256; i++) {
-		int j = random_irange(0, 255);
+		int j = random_irange(&rng, 0, 255);
 		int t = n->map[i];
 		n->map[i] = n->map[j];
 		n->map[j] = t;
@@ -250,27 +239,199 @@ float noise_gen(const struct noise *noise, float *f)
 	return clamp(-0.99999f, 0.99999f, value);
 }
 
-void random_init(unsigned int seed)
+/* The corner hashes of the last lattice cell a batch looked up.
+   Neighbouring points of a patch row are mostly in the same cell at
+   all but the finest octaves, so the batch functions keep one of
+   these for each of their first CACHE_OCTAVES octaves, and when all
+   the lanes are in its cell they skip hashing the corners and
+   gathering their gradients a lane at a time. */
+#define CACHE_OCTAVES	32
+
+struct lattice_cache {
+	int n[MAX_DIMENSIONS];
+	unsigned index[1 << MAX_DIMENSIONS];
+};
+
+/* Evaluate noise at LANES points at once; f[d] holds dimension d of
+   each point.  This does exactly the same arithmetic as noise_gen(),
+   lane for lane, so the results are identical.  If cache is non-NULL
+   the corners are taken from it when every lane is in its cell,
+   and otherwise it's left holding the last lane's.  It is inlined
+   with a constant ndim, and the loops only pay off when fully
+   unrolled. */
+#define UNROLL	_Pragma("GCC unroll 16")
+
+static inline __attribute__((always_inline))
+v4sf noise_lanes(const struct noise *noise, const v4sf f[MAX_DIMENSIONS],
+		 const unsigned ndim, struct lattice_cache *cache)
 {
-	srand(seed);
+	v4si fl[MAX_DIMENSIONS];
+	int n[MAX_DIMENSIONS][LANES];
+	v4sf r[MAX_DIMENSIONS];
+	v4sf w[MAX_DIMENSIONS];
+	unsigned index[1 << MAX_DIMENSIONS][LANES];
+	v4sf grad[1 << MAX_DIMENSIONS][MAX_DIMENSIONS];
+	v4sf value[1 << MAX_DIMENSIONS];
+	int cached = cache != NULL;
+
+	UNROLL
+	for(int i = 0; i < ndim; i++) {
+		fl[i] = v4sf_floor(f[i]);
+
+		UNROLL
+		for(int l = 0; l < LANES; l++)
+			n[i][l] = fl[i][l];
+		r[i] = f[i] - __builtin_convertvector(fl[i], v4sf);
+		w[i] = r[i] * r[i] * (3 - 2*r[i]);
+
+		if (cached)
+			cached = !v4si_any(fl[i] != (v4si){} + cache->n[i]);
+	}
+
+	if (cached) {
+		UNROLL
+		for(unsigned c = 0; c < (1 << ndim); c++)
+			UNROLL
+			for(int i = 0; i < ndim; i++)
+				grad[c][i] = v4sf_splat(noise->buffer[cache->index[c]][i]);
+	} else {
+		/* Corner c is offset by +1 in dimension i if bit i is
+		   set.  The corner hashes share their prefixes, so build
+		   them up a dimension at a time: after dimension i there
+		   are 2^(i+1) partial hashes.  The lookups are gathers,
+		   so they're done per lane. */
+		UNROLL
+		for(int l = 0; l < LANES; l++)
+			index[0][l] = 0;
+
+		UNROLL
+		for(int i = 0; i < ndim; i++) {
+			unsigned count = 1 << i;
+
+			UNROLL
+			for(unsigned c = 0; c < count; c++) {
+				UNROLL
+				for(int l = 0; l < LANES; l++) {
+					unsigned h = index[c][l] + n[i][l];
+
+					index[c + count][l] = noise->map[(h + 1) % 256];
+					index[c][l] = noise->map[h % 256];
+				}
+			}
+		}
+
+		UNROLL
+		for(unsigned c = 0; c < (1 << ndim); c++)
+			UNROLL
+			for(int i = 0; i < ndim; i++)
+				UNROLL
+				for(int l = 0; l < LANES; l++)
+					grad[c][i][l] = noise->buffer[index[c][l]][i];
+
+		/* the next points are most likely in the last lane's cell */
+		if (cache) {
+			UNROLL
+			for(int i = 0; i < ndim; i++)
+				cache->n[i] = n[i][LANES - 1];
+
+			UNROLL
+			for(unsigned c = 0; c < (1 << ndim); c++)
+				cache->index[c] = index[c][LANES - 1];
+		}
+	}
+
+	/* Gradient dot products are done across the lanes */
+	UNROLL
+	for(unsigned c = 0; c < (1 << ndim); c++) {
+		v4sf v = v4sf_splat(0);
+
+		UNROLL
+		for(int i = 0; i < ndim; i++)
+			v += grad[c][i] * (((c >> i) & 1) ? r[i] - 1 : r[i]);
+
+		value[c] = v;
+	}
+
+	/* Interpolate along each dimension in turn, pairing corners
+	   which differ only in that dimension; this is the same
+	   nesting order as the lerp()s in noise_gen(). */
+	UNROLL
+	for(int i = 0; i < ndim; i++) {
+		unsigned count = 1 << (ndim - i - 1);
+
+		UNROLL
+		for(unsigned k = 0; k < count; k++)
+			value[k] = value[2*k] + w[i] * (value[2*k + 1] - value[2*k]);
+	}
+
+	return v4sf_clamp(-0.99999f, 0.99999f, value[0]);
 }
 
-float random_gen(void)
+/* Only the 2 and 3 dimensional cases are vectorised; the others just
+   call noise_gen() per lane, without the cache. */
+static v4sf noise_gen_lanes(const struct noise *noise, const v4sf f[MAX_DIMENSIONS],
+			    struct lattice_cache *cache)
 {
-	return (float)rand() / (float)RAND_MAX;
+	v4sf ret;
+
+	switch(noise->ndim) {
+	case 2:
+		return noise_lanes(noise, f, 2, cache);
+
+	case 3:
+		return noise_lanes(noise, f, 3, cache);
+
+	default:
+		for(int l = 0; l < LANES; l++) {
+			float pt[MAX_DIMENSIONS];
+
+			for(int i = 0; i < noise->ndim; i++)
+				pt[i] = f[i][l];
+			ret[l] = noise_gen(noise, pt);
+		}
+		return ret;
+	}
+}
+
+void random_init(struct random *r, unsigned int seed)
+{
+	/* standard PCG32 seeding; the stream is fixed */
+	r->state = 0;
+	r->inc = (0xda3e39cb94b95bdbULL << 1) | 1;
+	random_next(r);
+	r->state += seed;
+	random_next(r);
+}
+
+uint32_t random_next(struct random *r)
+{
+	uint64_t old = r->state;
+
+	r->state = old * 6364136223846793005ULL + r->inc;
+
+	uint32_t xorshifted = ((old >> 18u) ^ old) >> 27u;
+	uint32_t rot = old >> 59u;
+
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-float random_range(float min, float max)
+/* Uniform in [0, 1) */
+float random_gen(struct random *r)
+{
+	return (random_next(r) >> 8) * (1.f / (1 << 24));
+}
+
+float random_range(struct random *r, float min, float max)
 {
 	float interval = max - min;
-	float d = interval * random_gen();
+	float d = interval * random_gen(r);
 	return min + (d < interval ? d : interval);
 }
 
-unsigned int random_irange(unsigned int min, unsigned int max)
+unsigned int random_irange(struct random *r, unsigned int min, unsigned int max)
 {
 	unsigned interval = max - min;
-	unsigned i = (interval + 1.0f) * random_gen();
+	unsigned i = (interval + 1.0f) * random_gen(r);
 	return min + (i < interval ? i : interval);
 }
 
@@ -290,6 +451,7 @@ void fractal_init(struct fractal *frac, int ndim, unsigned int seed,
 
 	frac->H = H;
 	frac->lacunarity = lacunarity;
+	frac->reuse_lattice = 1;
 
 	float f = 1;
 	for(int i = 0; i < MAX_OCTAVES; i++) {
@@ -298,6 +460,28 @@ void fractal_init(struct fractal *frac, int ndim, unsigned int seed,
 	}
 }
 
+void fractal_reuse_lattice(struct fractal *frac, int enable)
+{
+	frac->reuse_lattice = enable;
+}
+
+int fractal_ndim(const struct fractal *frac)
+{
+	return frac->noise.ndim;
+}
+
+float fractal_octaves(const struct fractal *frac, float scale, float spacing,
+		      float max)
+{
+	float octaves = max;
+
+	/* octave i has features of size 1/(scale * lacunarity^i) */
+	if (spacing > 0)
+		octaves = 1 + logf(1 / (2 * scale * spacing)) / logf(frac->lacunarity);
+
+	return clamp(1, max, octaves);
+}
+
 float fractal_fBm(const struct fractal *frac, const float *f, float octaves)
 {
 	float value = 0;
@@ -306,7 +490,7 @@ float fractal_fBm(const struct fractal *frac, const float *f, float octaves)
 		tmp[i] = f[i];
 
 	int i;
-	for(i = 0; i < octaves; i++) {
+	for(i = 0; i < (int)octaves; i++) {
 		value += noise_gen(&frac->noise, tmp) * frac->exponent[i];
 		for(int j = 0; j < frac->noise.ndim; j++)
 			tmp[j] *= frac->lacunarity;
@@ -327,7 +511,7 @@ float fractal_fBmtest(const struct fractal *frac, const float *f, float octaves)
 		tmp[i] = f[i] * 2;
 
 	int i;
-	for(i = 0; i < octaves; i++) {
+	for(i = 0; i < (int)octaves; i++) {
 		value += noise_gen(&frac->noise, tmp) * frac->exponent[i];
 		for(int j = 0; j < frac->noise.ndim; j++)
 			tmp[j] *= frac->lacunarity;
@@ -341,3 +525,540 @@ float fractal_fBmtest(const struct fractal *frac, const float *f, float octaves)
 		return -powf(-value, 0.7f);
 	return powf(value, 1 + noise_gen(&frac->noise, tmp) * value);
 }
+
+/* The sum of octaves [first, octaves) of fBm at f * scale, including
+   the fractional tail, unclamped.  Octave i is evaluated at exactly
+   the same point as fractal_fBm() would use. */
+float fractal_fBm_partial(const struct fractal *frac, const float *f, float scale,
+			  int first, float octaves)
+{
+	float low;
+
+	return fractal_fBm_split(frac, f, scale, first, first, octaves, &low);
+}
+
+/* fractal_fBm_partial(), noting the sum so far when it gets to
+   octave split */
+float fractal_fBm_split(const struct fractal *frac, const float *f, float scale,
+			int first, int split, float octaves, float *low)
+{
+	float value = 0;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i] * scale;
+
+	int i;
+	for(i = 0; i < first; i++)
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+
+	*low = 0;
+	for(; i < (int)octaves; i++) {
+		if (i == split)
+			*low = value;
+		value += noise_gen(&frac->noise, tmp) * frac->exponent[i];
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+	if (i == split)
+		*low = value;
+
+	if (i == (int)octaves) {
+		octaves -= (int)octaves;
+		if (octaves > EPSILON)
+			value += octaves * noise_gen(&frac->noise, tmp) * frac->exponent[i];
+	}
+
+	return value;
+}
+
+/* The final shaping fractal_fBmtest() applies to its octave sum */
+float fractal_fBmtest_shape(const struct fractal *frac, const float *f,
+			    float value, float octaves)
+{
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i] * 2;
+
+	for(int i = 0; i < (int)octaves; i++)
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+
+	if (value < 0.f)
+		return -powf(-value, 0.7f);
+	return powf(value, 1 + noise_gen(&frac->noise, tmp) * value);
+}
+
+int fractal_smooth_octaves(const struct fractal *frac, float scale, float spacing,
+			   float ratio)
+{
+	/* octave i has features of size 1/(scale * lacunarity^i) */
+	float octaves = 1 + logf(1 / (ratio * scale * spacing)) / logf(frac->lacunarity);
+
+	if (octaves < 0)
+		return 0;
+	if (octaves > MAX_OCTAVES)
+		return MAX_OCTAVES;
+	return octaves;
+}
+
+/* Like fBm, but summing the magnitude of each octave, which gives
+   creases where the noise crosses zero. */
+float fractal_turbulence(const struct fractal *frac, const float *f, float octaves)
+{
+	float value = 0;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i];
+
+	int i;
+	for(i = 0; i < (int)octaves; i++) {
+		value += fabsf(noise_gen(&frac->noise, tmp)) * frac->exponent[i];
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		value += octaves * fabsf(noise_gen(&frac->noise, tmp)) * frac->exponent[i];
+
+	return clamp(-0.99999f, 0.99999f, value);
+}
+
+/* Multiplicative cascade: each octave scales everything below it by
+   a factor around offset, so the roughness varies from place to
+   place.  An offset of about 1 keeps the result well-behaved. */
+float fractal_multifractal(const struct fractal *frac, const float *f,
+			   float octaves, float offset)
+{
+	float value = 1;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i];
+
+	int i;
+	for(i = 0; i < (int)octaves; i++) {
+		value *= offset + noise_gen(&frac->noise, tmp) * frac->exponent[i];
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+
+	/* fade the last factor in from 1 */
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		value *= 1 + octaves * (offset + noise_gen(&frac->noise, tmp) * frac->exponent[i] - 1);
+
+	return value;
+}
+
+/* Heterogeneous terrain: each octave is scaled by the value so far,
+   so low areas stay smooth while high areas get rough. */
+float fractal_heterofractal(const struct fractal *frac, const float *f,
+			    float octaves, float offset)
+{
+	float value, increment;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i];
+
+	/* first octave is unscaled */
+	value = offset + noise_gen(&frac->noise, tmp);
+	for(int j = 0; j < frac->noise.ndim; j++)
+		tmp[j] *= frac->lacunarity;
+
+	int i;
+	for(i = 1; i < (int)octaves; i++) {
+		increment = (noise_gen(&frac->noise, tmp) + offset) * frac->exponent[i];
+		value += increment * value;
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON) {
+		increment = (noise_gen(&frac->noise, tmp) + offset) * frac->exponent[i];
+		value += octaves * increment * value;
+	}
+
+	return value;
+}
+
+/* Hybrid additive/multiplicative multifractal: each octave is
+   weighted by the octaves below it, so valleys are smooth and peaks
+   rough.  Stops early once the weight becomes insignificant. */
+float fractal_hybrid_multifractal(const struct fractal *frac, const float *f,
+				  float octaves, float offset, float gain)
+{
+	float result, weight, signal;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i];
+
+	result = noise_gen(&frac->noise, tmp) + offset;
+	weight = gain * result;
+	for(int j = 0; j < frac->noise.ndim; j++)
+		tmp[j] *= frac->lacunarity;
+
+	int i;
+	for(i = 1; weight > 0.001f && i < (int)octaves; i++) {
+		if (weight > 1.f)
+			weight = 1.f;
+
+		signal = (noise_gen(&frac->noise, tmp) + offset) * frac->exponent[i];
+		result += weight * signal;
+		weight *= gain * signal;
+
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		result += octaves * (noise_gen(&frac->noise, tmp) + offset) * frac->exponent[i];
+
+	return result;
+}
+
+/* Ridged multifractal: each octave is offset-|noise| squared, so
+   zero crossings become sharp ridges.  thresh converts each octave's
+   signal into the weight of the next, so ridges get more detail
+   than valleys. */
+float fractal_ridged_multifractal(const struct fractal *frac, const float *f,
+				  float octaves, float offset, float thresh)
+{
+	float result, weight, signal;
+	float tmp[MAX_DIMENSIONS];
+	for(int i = 0; i < frac->noise.ndim; i++)
+		tmp[i] = f[i];
+
+	signal = offset - fabsf(noise_gen(&frac->noise, tmp));
+	signal *= signal;
+	result = signal;
+
+	int i;
+	float rem = octaves - (int)octaves;
+	int last = (int)octaves + (rem > EPSILON);
+
+	for(i = 1; i < last; i++) {
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+
+		weight = clamp(0.f, 1.f, signal * thresh);
+
+		signal = offset - fabsf(noise_gen(&frac->noise, tmp));
+		signal *= signal;
+		signal *= weight;
+
+		if (i < (int)octaves)
+			result += signal * frac->exponent[i];
+		else
+			result += rem * signal * frac->exponent[i];
+	}
+
+	return result;
+}
+
+/* Load the points [first, first+LANES) into per-dimension vectors,
+   scaled by scale.  Lanes past the end repeat the last point. */
+static void load_lanes(v4sf out[MAX_DIMENSIONS], const float *f, unsigned ndim,
+		       unsigned first, unsigned npoints, float scale)
+{
+	for(int l = 0; l < LANES; l++) {
+		unsigned idx = (first + l < npoints) ? first + l : npoints - 1;
+
+		for(int i = 0; i < ndim; i++)
+			out[i][l] = f[idx * ndim + i] * scale;
+	}
+}
+
+static void store_lanes(float *out, v4sf v, unsigned first, unsigned npoints)
+{
+	for(int l = 0; l < LANES && first + l < npoints; l++)
+		out[first + l] = v[l];
+}
+
+/* Empty lattice caches for a batch's octaves, or NULL if they're not
+   to be used */
+static struct lattice_cache *start_cache(const struct fractal *frac,
+					 struct lattice_cache cache[CACHE_OCTAVES],
+					 float octaves)
+{
+	if (!frac->reuse_lattice)
+		return NULL;
+
+	for(int i = 0; i <= (int)octaves && i < CACHE_OCTAVES; i++)
+		for(int j = 0; j < MAX_DIMENSIONS; j++)
+			cache[i].n[j] = INT_MIN;
+
+	return cache;
+}
+
+static inline struct lattice_cache *octave_cache(struct lattice_cache *cache, int i)
+{
+	return cache && i < CACHE_OCTAVES ? &cache[i] : NULL;
+}
+
+/* Sum the octaves for LANES points, leaving tmp at the position of
+   the last (fractional) octave. */
+static v4sf fBm_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+		      float octaves, struct lattice_cache *cache)
+{
+	v4sf value = v4sf_splat(0);
+
+	int i;
+	for(i = 0; i < (int)octaves; i++) {
+		value += noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) * frac->exponent[i];
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] *= frac->lacunarity;
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		value += octaves * noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) * frac->exponent[i];
+
+	return value;
+}
+
+void fractal_fBm_batch(const struct fractal *frac, const float *f,
+		       unsigned npoints, float octaves, float *out)
+{
+	struct lattice_cache store[CACHE_OCTAVES];
+	struct lattice_cache *cache = start_cache(frac, store, octaves);
+
+	for(unsigned first = 0; first < npoints; first += LANES) {
+		v4sf tmp[MAX_DIMENSIONS];
+
+		load_lanes(tmp, f, frac->noise.ndim, first, npoints, 1);
+
+		v4sf value = fBm_lanes(frac, tmp, octaves, cache);
+
+		store_lanes(out, v4sf_clamp(-0.99999f, 0.99999, value),
+			    first, npoints);
+	}
+}
+
+void fractal_fBmtest_batch(const struct fractal *frac, const float *f,
+			   unsigned npoints, float octaves, float *out)
+{
+	struct lattice_cache store[CACHE_OCTAVES];
+	struct lattice_cache *cache = start_cache(frac, store, octaves);
+
+	for(unsigned first = 0; first < npoints; first += LANES) {
+		v4sf tmp[MAX_DIMENSIONS];
+
+		load_lanes(tmp, f, frac->noise.ndim, first, npoints, 2);
+
+		v4sf value = fBm_lanes(frac, tmp, octaves, cache);
+		v4sf n = noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, (int)octaves));
+
+		/* no vector powf, so finish off a lane at a time */
+		for(int l = 0; l < LANES; l++) {
+			if (value[l] < 0.f)
+				value[l] = -powf(-value[l], 0.7f);
+			else
+				value[l] = powf(value[l], 1 + n[l] * value[l]);
+		}
+
+		store_lanes(out, value, first, npoints);
+	}
+}
+
+static void scale_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS])
+{
+	for(int j = 0; j < frac->noise.ndim; j++)
+		tmp[j] *= frac->lacunarity;
+}
+
+/* Evaluate one of the fractal functions for LANES points; a and b
+   are the function-specific parameters, and cache is the batch's
+   lattice caches, or NULL. */
+typedef v4sf (fractal_lanes_t)(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+			       float octaves, float a, float b,
+			       struct lattice_cache *cache);
+
+static void fractal_batch(const struct fractal *frac, fractal_lanes_t *lanes,
+			  const float *f, unsigned npoints,
+			  float octaves, float a, float b, float *out)
+{
+	struct lattice_cache store[CACHE_OCTAVES];
+	struct lattice_cache *cache = start_cache(frac, store, octaves);
+
+	for(unsigned first = 0; first < npoints; first += LANES) {
+		v4sf tmp[MAX_DIMENSIONS];
+
+		load_lanes(tmp, f, frac->noise.ndim, first, npoints, 1);
+		store_lanes(out, (*lanes)(frac, tmp, octaves, a, b, cache), first, npoints);
+	}
+}
+
+static v4sf turbulence_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+			     float octaves, float a, float b,
+			     struct lattice_cache *cache)
+{
+	v4sf value = v4sf_splat(0);
+
+	int i;
+	for(i = 0; i < (int)octaves; i++) {
+		value += v4sf_abs(noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i))) * frac->exponent[i];
+		scale_lanes(frac, tmp);
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		value += octaves * v4sf_abs(noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i))) * frac->exponent[i];
+
+	return v4sf_clamp(-0.99999f, 0.99999f, value);
+}
+
+void fractal_turbulence_batch(const struct fractal *frac, const float *f,
+			      unsigned npoints, float octaves, float *out)
+{
+	fractal_batch(frac, turbulence_lanes, f, npoints, octaves, 0, 0, out);
+}
+
+static v4sf multifractal_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+			       float octaves, float offset, float b,
+			       struct lattice_cache *cache)
+{
+	v4sf value = v4sf_splat(1);
+
+	int i;
+	for(i = 0; i < (int)octaves; i++) {
+		value *= offset + noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) * frac->exponent[i];
+		scale_lanes(frac, tmp);
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		value *= 1 + octaves * (offset + noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) * frac->exponent[i] - 1);
+
+	return value;
+}
+
+void fractal_multifractal_batch(const struct fractal *frac, const float *f,
+				unsigned npoints, float octaves, float offset,
+				float *out)
+{
+	fractal_batch(frac, multifractal_lanes, f, npoints, octaves, offset, 0, out);
+}
+
+static v4sf heterofractal_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+				float octaves, float offset, float b,
+				struct lattice_cache *cache)
+{
+	v4sf value, increment;
+
+	value = offset + noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, 0));
+	scale_lanes(frac, tmp);
+
+	int i;
+	for(i = 1; i < (int)octaves; i++) {
+		increment = (noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) + offset) * frac->exponent[i];
+		value += increment * value;
+		scale_lanes(frac, tmp);
+	}
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON) {
+		increment = (noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) + offset) * frac->exponent[i];
+		value += octaves * increment * value;
+	}
+
+	return value;
+}
+
+void fractal_heterofractal_batch(const struct fractal *frac, const float *f,
+				 unsigned npoints, float octaves, float offset,
+				 float *out)
+{
+	fractal_batch(frac, heterofractal_lanes, f, npoints, octaves, offset, 0, out);
+}
+
+/* The scalar version stops early when the weight gets small.  Here
+   each lane stops separately: stopped lanes have their state frozen,
+   and remember which octave they stopped at for the fractional
+   tail. */
+static v4sf hybrid_multifractal_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+				      float octaves, float offset, float gain,
+				      struct lattice_cache *cache)
+{
+	v4sf result, weight, signal;
+	v4sf etail = v4sf_splat(0);
+	v4si active = ~(v4si){};
+
+	result = noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, 0)) + offset;
+	weight = gain * result;
+	scale_lanes(frac, tmp);
+
+	int i;
+	for(i = 1; i < (int)octaves; i++) {
+		etail = v4sf_select(active, v4sf_splat(frac->exponent[i]), etail);
+		active &= weight > v4sf_splat(0.001f);
+		if (!v4si_any(active))
+			break;
+
+		weight = v4sf_select(weight > v4sf_splat(1.f), v4sf_splat(1.f), weight);
+
+		signal = (noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) + offset) * frac->exponent[i];
+		result = v4sf_select(active, result + weight * signal, result);
+		weight = v4sf_select(active, weight * (gain * signal), weight);
+
+		for(int j = 0; j < frac->noise.ndim; j++)
+			tmp[j] = v4sf_select(active, tmp[j] * frac->lacunarity, tmp[j]);
+	}
+	etail = v4sf_select(active, v4sf_splat(frac->exponent[i]), etail);
+
+	octaves -= (int)octaves;
+	if (octaves > EPSILON)
+		result += octaves * (noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)) + offset) * etail;
+
+	return result;
+}
+
+void fractal_hybrid_multifractal_batch(const struct fractal *frac, const float *f,
+				       unsigned npoints, float octaves,
+				       float offset, float gain, float *out)
+{
+	fractal_batch(frac, hybrid_multifractal_lanes, f, npoints, octaves,
+		      offset, gain, out);
+}
+
+static v4sf ridged_multifractal_lanes(const struct fractal *frac, v4sf tmp[MAX_DIMENSIONS],
+				      float octaves, float offset, float thresh,
+				      struct lattice_cache *cache)
+{
+	v4sf result, weight, signal;
+
+	signal = offset - v4sf_abs(noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, 0)));
+	signal *= signal;
+	result = signal;
+
+	int i;
+	float rem = octaves - (int)octaves;
+	int last = (int)octaves + (rem > EPSILON);
+
+	for(i = 1; i < last; i++) {
+		scale_lanes(frac, tmp);
+
+		weight = v4sf_clamp(0.f, 1.f, signal * thresh);
+
+		signal = offset - v4sf_abs(noise_gen_lanes(&frac->noise, tmp, octave_cache(cache, i)));
+		signal *= signal;
+		signal *= weight;
+
+		if (i < (int)octaves)
+			result += signal * frac->exponent[i];
+		else
+			result += rem * signal * frac->exponent[i];
+	}
+
+	return result;
+}
+
+void fractal_ridged_multifractal_batch(const struct fractal *frac, const float *f,
+				       unsigned npoints, float octaves,
+				       float offset, float thresh, float *out)
+{
+	fractal_batch(frac, ridged_multifractal_lanes, f, npoints, octaves,
+		      offset, thresh, out);
+}
@@ -1,6 +1,8 @@
 #ifndef _NOISE_H
 #define _NOISE_H
 
+#include <stdint.h>
+
 #define MAX_DIMENSIONS	4	// Maximum number of dimensions in a noise object
 #define MAX_OCTAVES	128	// Maximum # of octaves in an fBm object
 
@@ -10,10 +12,22 @@ struct noise *noise_create(int ndim, unsigned int seed);
 void noise_init(struct noise *n, int ndim, unsigned int seed);
 float noise_gen(const struct noise *, float *);
 
-void random_init(unsigned int seed);
-float random_gen(void);
-float random_range(float min, float max);
-unsigned int random_irange(unsigned int min, unsigned int max);
+/*
+   Small PRNG (PCG32).  All the state is in struct random, so
+   separate generators are independent of each other, and any number
+   of threads can use their own without locking.  The sequence is
+   entirely determined by the seed.
+ */
+struct random {
+	uint64_t state;
+	uint64_t inc;
+};
+
+void random_init(struct random *r, unsigned int seed);
+uint32_t random_next(struct random *r);
+float random_gen(struct random *r);
+float random_range(struct random *r, float min, float max);
+unsigned int random_irange(struct random *r, unsigned int min, unsigned int max);
 
 
 struct fractal;
@@ -21,16 +35,92 @@ struct fractal;
 struct fractal *fractal_create(int ndim, unsigned int seed, float H, float lacunarity);
 void fractal_init(struct fractal *f, int ndim, unsigned int seed,
 		  float H, float lacunarity);
+int fractal_ndim(const struct fractal *frac);
 float fractal_fBm(const struct fractal *frac, const float *f, float octaves);
-float fractal_turbulence(const struct fractal *frac, float *f, float octaves);
-float fractal_multifractal(const struct fractal *frac, float *f,
+float fractal_turbulence(const struct fractal *frac, const float *f, float octaves);
+float fractal_multifractal(const struct fractal *frac, const float *f,
 			   float octaves, float offset);
-float fractal_heterofractal(const struct fractal *frac, float *f, 
+float fractal_heterofractal(const struct fractal *frac, const float *f,
 			    float octaves, float offset);
-float fractal_hybrid_multifractal(const struct fractal *frac, float *f,
+float fractal_hybrid_multifractal(const struct fractal *frac, const float *f,
 				  float octaves, float offset, float gain);
-float fractal_ridged_multifractal(const struct fractal *frac, float *f,
+float fractal_ridged_multifractal(const struct fractal *frac, const float *f,
 				  float octaves, float offset, float thresh);
 float fractal_fBmtest(const struct fractal *frac, const float *f, float octaves);
 
+/* The number of octaves worth evaluating for points sampled spacing
+   apart, when the point is scaled by scale before the first octave
+   (1 for fractal_fBm(), 2 for fractal_fBmtest()).  Octaves whose
+   features are smaller than twice the spacing are dropped, and the
+   fractional part fades the last one in.  The result is clamped to
+   [1, max]. */
+float fractal_octaves(const struct fractal *frac, float scale, float spacing,
+		      float max);
+
+/*
+   Pieces of fBm, for callers which want to cache some octaves.
+   fractal_fBm_partial() sums octaves [first, octaves) at f * scale,
+   without clamping; fractal_fBmtest_shape() applies fractal_fBmtest()'s
+   final shaping to such a sum (taken at scale 2).  fractal_fBm_split()
+   is fractal_fBm_partial(), also storing the sum of octaves
+   [first, split) in *low on the way (split is at most octaves); its
+   result is the same whatever split is.
+
+   fractal_smooth_octaves() is the number of leading octaves which
+   have at least ratio samples per feature at the given spacing.
+   Those octaves are smooth enough to interpolate: bilinear
+   interpolation between samples h apart of an octave with features
+   of size 1/F is in error by at most about (3/4)(hF)^2 of that
+   octave's amplitude, so at most 0.75/ratio^2 of the summed
+   amplitudes of the smooth octaves.
+ */
+float fractal_fBm_partial(const struct fractal *frac, const float *f, float scale,
+			  int first, float octaves);
+float fractal_fBm_split(const struct fractal *frac, const float *f, float scale,
+			int first, int split, float octaves, float *low);
+float fractal_fBmtest_shape(const struct fractal *frac, const float *f,
+			    float value, float octaves);
+int fractal_smooth_octaves(const struct fractal *frac, float scale, float spacing,
+			   float ratio);
+
+/*
+   Batch versions: evaluate npoints points at once, where f is an
+   array of npoints points of ndim floats each, and out has room for
+   npoints results.  The octaves are evaluated across several points
+   at a time in SIMD lanes.
+
+   The results are bit-identical to calling the scalar function on
+   each point (a tolerance of 0 ULP), so long as both paths are
+   compiled with the same floating-point contraction settings.  If
+   the compiler is allowed to fuse multiply-adds (eg -mfma with
+   -ffp-contract=fast), it may fuse differently in each path and the
+   results can differ in the last few bits.
+ */
+
+void fractal_fBm_batch(const struct fractal *frac, const float *f,
+		       unsigned npoints, float octaves, float *out);
+void fractal_fBmtest_batch(const struct fractal *frac, const float *f,
+			   unsigned npoints, float octaves, float *out);
+void fractal_turbulence_batch(const struct fractal *frac, const float *f,
+			      unsigned npoints, float octaves, float *out);
+void fractal_multifractal_batch(const struct fractal *frac, const float *f,
+				unsigned npoints, float octaves, float offset,
+				float *out);
+void fractal_heterofractal_batch(const struct fractal *frac, const float *f,
+				 unsigned npoints, float octaves, float offset,
+				 float *out);
+void fractal_hybrid_multifractal_batch(const struct fractal *frac, const float *f,
+				       unsigned npoints, float octaves,
+				       float offset, float gain, float *out);
+void fractal_ridged_multifractal_batch(const struct fractal *frac, const float *f,
+				       unsigned npoints, float octaves,
+				       float offset, float thresh, float *out);
+
+/* The batch functions hash a point's lattice cell only when it isn't
+   in the cell of the point before it, at each octave, which saves
+   most of the hashing when the points are in grid order, such as the
+   rows of a patch.  The results are the same either way; this turns
+   the reuse off (it's on by default), to measure it. */
+void fractal_reuse_lattice(struct fractal *frac, int enable);
+
 #endif	/* _NOISE_H */
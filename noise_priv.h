@@ -0,0 +1,23 @@
+#ifndef _NOISE_PRIV_H
+#define _NOISE_PRIV_H
+
+#include "noise.h"
+
+#define EPSILON	(1e-6f)
+
+struct noise {
+	unsigned ndim;
+	unsigned char map[256];
+	float buffer[256][MAX_DIMENSIONS];
+};
+
+struct fractal {
+	struct noise noise;
+
+	float H;
+	float lacunarity;
+	int reuse_lattice;	/* see fractal_reuse_lattice() */
+	float exponent[MAX_OCTAVES];
+};
+
+#endif	/* _NOISE_PRIV_H */
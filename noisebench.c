@@ -0,0 +1,292 @@
+/*
+   Measure the throughput of the fractal functions, in samples per
+   second on a single core, for both the scalar and batched
+   entrypoints.  This is what the terrain generator budget is worked
+   out from.  It also compares fractal_fBmtest() with the generated
+   terrain kernel, and the batch functions with and without lattice
+   reuse (see fractal_reuse_lattice()) over patch-sized grids, after
+   checking they give the same results as the scalar functions there.
+
+   Usage: noisebench [octaves]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "noise.h"
+#include "terrain_kernel.h"
+
+#define NPOINTS		4096
+#define MINTIME		.25	/* seconds per measurement */
+#define GRID		9	/* samples along a patch edge */
+
+static float offset = 1.f, gain = 2.f;
+
+static float fBm(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_fBm(frac, f, oct);
+}
+
+static float fBmtest(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_fBmtest(frac, f, oct);
+}
+
+static float turbulence(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_turbulence(frac, f, oct);
+}
+
+static float multifractal(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_multifractal(frac, f, oct, offset);
+}
+
+static float heterofractal(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_heterofractal(frac, f, oct, offset);
+}
+
+static float hybrid(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_hybrid_multifractal(frac, f, oct, offset, gain);
+}
+
+static float ridged(const struct fractal *frac, const float *f, float oct)
+{
+	return fractal_ridged_multifractal(frac, f, oct, offset, gain);
+}
+
+static void multifractal_batch(const struct fractal *frac, const float *f,
+			       unsigned n, float oct, float *out)
+{
+	fractal_multifractal_batch(frac, f, n, oct, offset, out);
+}
+
+static void heterofractal_batch(const struct fractal *frac, const float *f,
+				unsigned n, float oct, float *out)
+{
+	fractal_heterofractal_batch(frac, f, n, oct, offset, out);
+}
+
+static void hybrid_batch(const struct fractal *frac, const float *f,
+			 unsigned n, float oct, float *out)
+{
+	fractal_hybrid_multifractal_batch(frac, f, n, oct, offset, gain, out);
+}
+
+static void ridged_batch(const struct fractal *frac, const float *f,
+			 unsigned n, float oct, float *out)
+{
+	fractal_ridged_multifractal_batch(frac, f, n, oct, offset, gain, out);
+}
+
+static const struct variant {
+	const char *name;
+	float (*scalar)(const struct fractal *, const float *, float);
+	void (*batch)(const struct fractal *, const float *, unsigned, float, float *);
+} variants[] = {
+	{ "fBm",		fBm,		fractal_fBm_batch },
+	{ "fBmtest",		fBmtest,	fractal_fBmtest_batch },
+	{ "turbulence",		turbulence,	fractal_turbulence_batch },
+	{ "multifractal",	multifractal,	multifractal_batch },
+	{ "heterofractal",	heterofractal,	heterofractal_batch },
+	{ "hybrid",		hybrid,		hybrid_batch },
+	{ "ridged",		ridged,		ridged_batch },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile float sink;
+
+int main(int argc, char **argv)
+{
+	static float points[NPOINTS * 3];
+	static float out[NPOINTS];
+	float octaves = 8;
+
+	if (argc > 1)
+		octaves = atof(argv[1]);
+
+	struct fractal *frac = fractal_create(3, 210, 0.9, 5);
+	struct random rng;
+
+	random_init(&rng, 1);
+
+	/* points on the unit sphere, as the terrain generator uses */
+	for(int i = 0; i < NPOINTS; i++) {
+		float *p = &points[i * 3];
+		float mag = 0;
+
+		for(int j = 0; j < 3; j++) {
+			p[j] = random_range(&rng, -.5f, .5f);
+			mag += p[j] * p[j];
+		}
+		mag = 1 / sqrtf(mag);
+		for(int j = 0; j < 3; j++)
+			p[j] *= mag;
+	}
+
+	printf("%d points, %g octaves\n", NPOINTS, octaves);
+	printf("%-16s %14s %14s %8s\n", "function", "scalar/s", "batch/s", "speedup");
+
+	for(int v = 0; v < sizeof(variants)/sizeof(*variants); v++) {
+		const struct variant *var = &variants[v];
+		double start, elapsed;
+		double scalar, batch;
+		unsigned long samples;
+
+		samples = 0;
+		start = now();
+		do {
+			float sum = 0;
+
+			for(int i = 0; i < NPOINTS; i++)
+				sum += (*var->scalar)(frac, &points[i * 3], octaves);
+			sink = sum;
+			samples += NPOINTS;
+			elapsed = now() - start;
+		} while(elapsed < MINTIME);
+		scalar = samples / elapsed;
+
+		samples = 0;
+		start = now();
+		do {
+			(*var->batch)(frac, points, NPOINTS, octaves, out);
+			sink = out[0];
+			samples += NPOINTS;
+			elapsed = now() - start;
+		} while(elapsed < MINTIME);
+		batch = samples / elapsed;
+
+		printf("%-16s %14.0f %14.0f %7.2fx\n",
+		       var->name, scalar, batch, batch / scalar);
+	}
+
+	/* The generated kernel for the demo terrain, against the
+	   library function it was generated from */
+	{
+		double start, elapsed;
+		double scalar, kernel;
+		unsigned long samples;
+		float oct = terrain_kernel_OCTAVES;
+
+		samples = 0;
+		start = now();
+		do {
+			float sum = 0;
+
+			for(int i = 0; i < NPOINTS; i++)
+				sum += fractal_fBmtest(frac, &points[i * 3], oct);
+			sink = sum;
+			samples += NPOINTS;
+			elapsed = now() - start;
+		} while(elapsed < MINTIME);
+		scalar = samples / elapsed;
+
+		samples = 0;
+		start = now();
+		do {
+			float sum = 0;
+
+			for(int i = 0; i < NPOINTS; i++)
+				sum += terrain_kernel_fixed(&points[i * 3]);
+			sink = sum;
+			samples += NPOINTS;
+			elapsed = now() - start;
+		} while(elapsed < MINTIME);
+		kernel = samples / elapsed;
+
+		printf("\n%-16s %14s %14s %8s\n", "fBmtest", "scalar/s", "kernel/s", "speedup");
+		printf("%-16s %14.0f %14.0f %7.2fx\n",
+		       "terrain_kernel", scalar, kernel, kernel / scalar);
+	}
+
+	/* Patch-sized grids on the unit sphere, in row order as the
+	   quadtree generates them, for patches at several levels */
+	static float grid[GRID * GRID * 3], flat[GRID * GRID * 2];
+	static float scalar[GRID * GRID];
+	struct fractal *frac2 = fractal_create(2, 210, 0.9, 5);
+	unsigned mismatched = 0;
+
+	printf("\n%-16s %14s %14s %8s\n", "fBm 9x9", "batch/s", "reuse/s", "speedup");
+
+	for(int level = 2; level <= 14; level += 4) {
+		float size = M_PI / 2 / (1 << level);
+		double start, elapsed;
+		double rate[2];
+		unsigned long samples;
+		char name[32];
+
+		for(int j = 0; j < GRID; j++)
+			for(int i = 0; i < GRID; i++) {
+				float *p = &grid[(j * GRID + i) * 3];
+				float u = i * size / (GRID - 1), v = j * size / (GRID - 1);
+				float mag;
+
+				p[0] = .3f + u;
+				p[1] = .5f + v;
+				p[2] = .8f;
+				mag = 1 / sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+				for(int k = 0; k < 3; k++)
+					p[k] *= mag;
+
+				/* and the same grid in 2 dimensions, at
+				   a similar scale */
+				flat[(j * GRID + i) * 2] = p[0];
+				flat[(j * GRID + i) * 2 + 1] = p[1];
+			}
+
+		for(int v = 0; v < sizeof(variants)/sizeof(*variants); v++)
+			for(int ndim = 2; ndim <= 3; ndim++) {
+				const struct variant *var = &variants[v];
+				const struct fractal *f = ndim == 3 ? frac : frac2;
+				const float *pts = ndim == 3 ? grid : flat;
+
+				for(int i = 0; i < GRID * GRID; i++)
+					scalar[i] = (*var->scalar)(f, &pts[i * ndim], octaves);
+				(*var->batch)(f, pts, GRID * GRID, octaves, out);
+				if (memcmp(scalar, out, sizeof(scalar)) != 0) {
+					printf("%s differs from the scalar function "
+					       "in %d dimensions at level %d\n",
+					       var->name, ndim, level);
+					mismatched++;
+				}
+			}
+
+		for(int reuse = 0; reuse < 2; reuse++) {
+			fractal_reuse_lattice(frac, reuse);
+
+			samples = 0;
+			start = now();
+			do {
+				fractal_fBm_batch(frac, grid, GRID * GRID, octaves, out);
+				sink = out[0];
+				samples += GRID * GRID;
+				elapsed = now() - start;
+			} while(elapsed < MINTIME);
+			rate[reuse] = samples / elapsed;
+		}
+
+		snprintf(name, sizeof(name), "level %d", level);
+		printf("%-16s %14.0f %14.0f %7.2fx\n",
+		       name, rate[0], rate[1], rate[1] / rate[0]);
+	}
+
+	if (mismatched == 0)
+		printf("lattice reuse matches the scalar functions\n");
+
+	free(frac2);
+	free(frac);
+
+	return mismatched != 0;
+}
@@ -0,0 +1,746 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "noisegraph.h"
+#include "simd.h"
+
+#define BLOCK	64		/* points evaluated per pass over the program */
+
+enum ng_op {
+	NG_POINT,		/* point: the input point */
+	NG_WARP,		/* point: a + k[0] * (b, c, d) */
+	NG_CONST,		/* k[0] */
+	NG_FRACTAL,		/* fractal of point a */
+	NG_SUM,			/* a + b */
+	NG_MUL,			/* a * b */
+	NG_SCALE,		/* a * k[0] + k[1] */
+	NG_CLAMP,		/* a clamped to [k[0], k[1]] */
+	NG_ABS,			/* |a| */
+	NG_SELECT,		/* b or c, selected by a */
+	NG_CURVE,		/* a through curve */
+};
+
+struct ng_node {
+	enum ng_op op;
+	int a, b, c, d;		/* operands */
+	float k[4];
+
+	const struct fractal *frac;
+	enum noisegraph_fractal type;
+
+	int ncurve;
+	float (*curve)[2];
+};
+
+struct noisegraph {
+	int nnodes;
+	int size;
+	struct ng_node *nodes;
+};
+
+/* Operands are register numbers, in the point or scalar register file
+   depending on the op. */
+struct ng_insn {
+	enum ng_op op;
+	int dst;
+	int a, b, c, d;
+	float k[4];
+
+	const struct fractal *frac;
+	enum noisegraph_fractal type;
+
+	int ncurve;
+	const float (*curve)[2];
+};
+
+struct noiseprog {
+	int nregs;		/* scalar registers */
+	int npregs;		/* point registers */
+	int out;		/* register holding the result */
+
+	int ninsns;
+	struct ng_insn *insns;
+
+	float (*curves)[2];	/* storage for all the curves */
+};
+
+static int is_point(enum ng_op op)
+{
+	return op == NG_POINT || op == NG_WARP;
+}
+
+struct noisegraph *noisegraph_create(void)
+{
+	struct noisegraph *g = malloc(sizeof(*g));
+
+	if (g == NULL)
+		return NULL;
+
+	g->nnodes = 0;
+	g->size = 0;
+	g->nodes = NULL;
+
+	return g;
+}
+
+void noisegraph_free(struct noisegraph *g)
+{
+	if (g == NULL)
+		return;
+
+	for(int i = 0; i < g->nnodes; i++)
+		free(g->nodes[i].curve);
+	free(g->nodes);
+	free(g);
+}
+
+/* Add a node with the given operands, which must already exist and be
+   of the right kind (point or scalar). */
+static noisenode_t add_node(struct noisegraph *g, enum ng_op op,
+			    int a, int b, int c, int d)
+{
+	int ops[4] = { a, b, c, d };
+
+	for(int i = 0; i < 4; i++) {
+		if (ops[i] == -1)
+			return -1;
+		assert(ops[i] < g->nnodes);
+	}
+
+	if (g->nnodes == g->size) {
+		int size = g->size ? g->size * 2 : 16;
+		struct ng_node *nodes = realloc(g->nodes, sizeof(*nodes) * size);
+
+		if (nodes == NULL)
+			return -1;
+		g->nodes = nodes;
+		g->size = size;
+	}
+
+	struct ng_node *n = &g->nodes[g->nnodes];
+
+	memset(n, 0, sizeof(*n));
+	n->op = op;
+	n->a = a;
+	n->b = b;
+	n->c = c;
+	n->d = d;
+
+	return g->nnodes++;
+}
+
+/* -2 marks an unused operand */
+#define NONE	-2
+
+static int check_scalar(const struct noisegraph *g, noisenode_t n)
+{
+	return n < 0 || !is_point(g->nodes[n].op);
+}
+
+noisenode_t noisegraph_point(struct noisegraph *g)
+{
+	return add_node(g, NG_POINT, NONE, NONE, NONE, NONE);
+}
+
+noisenode_t noisegraph_warp(struct noisegraph *g, noisenode_t p,
+			    noisenode_t dx, noisenode_t dy, noisenode_t dz,
+			    float amount)
+{
+	assert(p < 0 || is_point(g->nodes[p].op));
+	assert(check_scalar(g, dx) && check_scalar(g, dy) && check_scalar(g, dz));
+
+	noisenode_t n = add_node(g, NG_WARP, p, dx, dy, dz);
+
+	if (n >= 0)
+		g->nodes[n].k[0] = amount;
+	return n;
+}
+
+noisenode_t noisegraph_const(struct noisegraph *g, float value)
+{
+	noisenode_t n = add_node(g, NG_CONST, NONE, NONE, NONE, NONE);
+
+	if (n >= 0)
+		g->nodes[n].k[0] = value;
+	return n;
+}
+
+noisenode_t noisegraph_fractal(struct noisegraph *g, enum noisegraph_fractal type,
+			       const struct fractal *frac, noisenode_t p,
+			       float scale, float octaves,
+			       float offset, float gain)
+{
+	assert(p < 0 || is_point(g->nodes[p].op));
+
+	noisenode_t n = add_node(g, NG_FRACTAL, p, NONE, NONE, NONE);
+
+	if (n >= 0) {
+		struct ng_node *np = &g->nodes[n];
+
+		np->frac = frac;
+		np->type = type;
+		np->k[0] = scale;
+		np->k[1] = octaves;
+		np->k[2] = offset;
+		np->k[3] = gain;
+	}
+	return n;
+}
+
+noisenode_t noisegraph_sum(struct noisegraph *g, noisenode_t a, noisenode_t b)
+{
+	assert(check_scalar(g, a) && check_scalar(g, b));
+
+	return add_node(g, NG_SUM, a, b, NONE, NONE);
+}
+
+noisenode_t noisegraph_mul(struct noisegraph *g, noisenode_t a, noisenode_t b)
+{
+	assert(check_scalar(g, a) && check_scalar(g, b));
+
+	return add_node(g, NG_MUL, a, b, NONE, NONE);
+}
+
+noisenode_t noisegraph_scale(struct noisegraph *g, noisenode_t a, float scale, float bias)
+{
+	assert(check_scalar(g, a));
+
+	noisenode_t n = add_node(g, NG_SCALE, a, NONE, NONE, NONE);
+
+	if (n >= 0) {
+		g->nodes[n].k[0] = scale;
+		g->nodes[n].k[1] = bias;
+	}
+	return n;
+}
+
+noisenode_t noisegraph_clamp(struct noisegraph *g, noisenode_t a, float min, float max)
+{
+	assert(check_scalar(g, a));
+
+	noisenode_t n = add_node(g, NG_CLAMP, a, NONE, NONE, NONE);
+
+	if (n >= 0) {
+		g->nodes[n].k[0] = min;
+		g->nodes[n].k[1] = max;
+	}
+	return n;
+}
+
+noisenode_t noisegraph_abs(struct noisegraph *g, noisenode_t a)
+{
+	assert(check_scalar(g, a));
+
+	return add_node(g, NG_ABS, a, NONE, NONE, NONE);
+}
+
+noisenode_t noisegraph_select(struct noisegraph *g, noisenode_t control,
+			      noisenode_t a, noisenode_t b,
+			      float threshold, float falloff)
+{
+	assert(check_scalar(g, control) && check_scalar(g, a) && check_scalar(g, b));
+
+	noisenode_t n = add_node(g, NG_SELECT, control, a, b, NONE);
+
+	if (n >= 0) {
+		g->nodes[n].k[0] = threshold;
+		g->nodes[n].k[1] = falloff;
+	}
+	return n;
+}
+
+noisenode_t noisegraph_curve(struct noisegraph *g, noisenode_t a,
+			     const float (*points)[2], int npoints)
+{
+	assert(check_scalar(g, a));
+	assert(npoints > 0);
+
+	float (*curve)[2] = malloc(sizeof(*curve) * npoints);
+
+	if (curve == NULL)
+		return -1;
+
+	noisenode_t n = add_node(g, NG_CURVE, a, NONE, NONE, NONE);
+
+	if (n < 0) {
+		free(curve);
+		return -1;
+	}
+
+	memcpy(curve, points, sizeof(*curve) * npoints);
+	g->nodes[n].curve = curve;
+	g->nodes[n].ncurve = npoints;
+
+	return n;
+}
+
+static float curve_eval(const float (*curve)[2], int ncurve, float x)
+{
+	if (x <= curve[0][0])
+		return curve[0][1];
+
+	for(int i = 1; i < ncurve; i++) {
+		if (x < curve[i][0]) {
+			float t = (x - curve[i-1][0]) / (curve[i][0] - curve[i-1][0]);
+
+			return curve[i-1][1] + t * (curve[i][1] - curve[i-1][1]);
+		}
+	}
+
+	return curve[ncurve-1][1];
+}
+
+static v4sf select_lanes(v4sf control, v4sf a, v4sf b, float threshold, float falloff)
+{
+	if (falloff <= 0)
+		return v4sf_select(control < v4sf_splat(threshold), a, b);
+
+	v4sf t = (control - (threshold - falloff)) / (2 * falloff);
+
+	t = v4sf_clamp(0, 1, t);
+	t = t * t * (3 - 2*t);
+
+	return a + t * (b - a);
+}
+
+/* Evaluate a scalar node whose operands are all constants, using the
+   same arithmetic as the evaluator. */
+static float fold(const struct ng_node *n, const float *k)
+{
+	v4sf a = v4sf_splat(k[0]);
+	v4sf b = v4sf_splat(k[1]);
+	v4sf c = v4sf_splat(k[2]);
+	v4sf r;
+
+	switch(n->op) {
+	case NG_SUM:	r = a + b; break;
+	case NG_MUL:	r = a * b; break;
+	case NG_SCALE:	r = a * n->k[0] + n->k[1]; break;
+	case NG_CLAMP:	r = v4sf_clamp(n->k[0], n->k[1], a); break;
+	case NG_ABS:	r = v4sf_abs(a); break;
+	case NG_SELECT:	r = select_lanes(a, b, c, n->k[0], n->k[1]); break;
+	case NG_CURVE:
+		return curve_eval((const float (*)[2])n->curve, n->ncurve, k[0]);
+
+	default:
+		abort();
+	}
+
+	return r[0];
+}
+
+/* Register allocator: one bit per register, for each file */
+struct regfile {
+	unsigned long used;
+	int count;
+};
+
+static int reg_alloc(struct regfile *rf)
+{
+	for(int i = 0; i < sizeof(rf->used) * 8; i++)
+		if ((rf->used & (1ul << i)) == 0) {
+			rf->used |= 1ul << i;
+			if (i >= rf->count)
+				rf->count = i + 1;
+			return i;
+		}
+	return -1;
+}
+
+static void reg_free(struct regfile *rf, int reg)
+{
+	rf->used &= ~(1ul << reg);
+}
+
+struct noiseprog *noisegraph_compile(const struct noisegraph *g, noisenode_t out)
+{
+	struct noiseprog *prog = NULL;
+	struct ng_node *nodes = NULL;
+	int *uses = NULL, *last = NULL, *reg = NULL;
+	int n = g->nnodes;
+
+	if (out < 0 || out >= n || is_point(g->nodes[out].op))
+		return NULL;
+
+	/* work on a copy, which is rewritten as it's optimised */
+	nodes = malloc(sizeof(*nodes) * n);
+	uses = calloc(n, sizeof(*uses));
+	last = malloc(sizeof(*last) * n);
+	reg = malloc(sizeof(*reg) * n);
+	prog = calloc(1, sizeof(*prog));
+	if (nodes == NULL || uses == NULL || last == NULL || reg == NULL || prog == NULL)
+		goto fail;
+	memcpy(nodes, g->nodes, sizeof(*nodes) * n);
+
+	/* Nodes can only refer to earlier nodes, so the node order is
+	   already a valid evaluation order.  Work forwards folding
+	   constants and simplifying. */
+	for(int i = 0; i < n; i++) {
+		struct ng_node *np = &nodes[i];
+		int ops[3] = { np->a, np->b, np->c };
+		float k[3] = { 0, 0, 0 };
+		int allconst = !is_point(np->op) && np->op != NG_CONST &&
+			np->op != NG_FRACTAL;
+
+		for(int j = 0; j < 3; j++) {
+			if (ops[j] == NONE)
+				continue;
+			if (nodes[ops[j]].op == NG_CONST)
+				k[j] = nodes[ops[j]].k[0];
+			else
+				allconst = 0;
+		}
+
+		if (allconst) {
+			float v = fold(np, k);
+
+			np->op = NG_CONST;
+			np->k[0] = v;
+			np->a = np->b = np->c = np->d = NONE;
+			continue;
+		}
+
+		/* sums and products with a constant are affine */
+		if ((np->op == NG_SUM || np->op == NG_MUL) &&
+		    (nodes[np->a].op == NG_CONST || nodes[np->b].op == NG_CONST)) {
+			int var = nodes[np->a].op == NG_CONST ? np->b : np->a;
+			float kv = nodes[np->a].op == NG_CONST ? k[0] : k[1];
+
+			if (np->op == NG_SUM) {
+				np->k[0] = 1;
+				np->k[1] = kv;
+			} else {
+				np->k[0] = kv;
+				np->k[1] = 0;
+			}
+			np->op = NG_SCALE;
+			np->a = var;
+			np->b = NONE;
+		}
+	}
+
+	/* Count the uses of each node reachable from out */
+	uses[out] = 1;
+	for(int i = out; i >= 0; i--) {
+		const struct ng_node *np = &nodes[i];
+		int ops[4] = { np->a, np->b, np->c, np->d };
+
+		if (uses[i] == 0)
+			continue;
+		for(int j = 0; j < 4; j++)
+			if (ops[j] >= 0)
+				uses[ops[j]]++;
+	}
+
+	/* Fuse affine chains: a scale whose operand is a scale used
+	   only here absorbs it. */
+	for(int i = 0; i <= out; i++) {
+		struct ng_node *np = &nodes[i];
+
+		if (uses[i] == 0 || np->op != NG_SCALE)
+			continue;
+
+		int a = np->a;
+		const struct ng_node *inner = &nodes[a];
+
+		if (inner->op == NG_SCALE && uses[a] == 1) {
+			np->k[1] = inner->k[1] * np->k[0] + np->k[1];
+			np->k[0] = inner->k[0] * np->k[0];
+			np->a = inner->a;
+			uses[a] = 0;
+		}
+	}
+
+	/* Find the last use of each node, and emit instructions */
+	for(int i = 0; i <= out; i++)
+		last[i] = -1;
+	for(int i = 0; i <= out; i++) {
+		const struct ng_node *np = &nodes[i];
+		int ops[4] = { np->a, np->b, np->c, np->d };
+
+		if (uses[i] == 0)
+			continue;
+		for(int j = 0; j < 4; j++)
+			if (ops[j] >= 0)
+				last[ops[j]] = i;
+		prog->ninsns++;
+	}
+
+	int ncurve = 0;
+	for(int i = 0; i <= out; i++)
+		if (uses[i] && nodes[i].op == NG_CURVE)
+			ncurve += nodes[i].ncurve;
+
+	prog->insns = malloc(sizeof(*prog->insns) * prog->ninsns);
+	prog->curves = malloc(sizeof(*prog->curves) * (ncurve ? ncurve : 1));
+	if (prog->insns == NULL || prog->curves == NULL)
+		goto fail;
+
+	struct regfile scalars = { 0, 0 }, points = { 0, 0 };
+	struct ng_insn *insn = prog->insns;
+
+	ncurve = 0;
+	for(int i = 0; i <= out; i++) {
+		const struct ng_node *np = &nodes[i];
+		int ops[4] = { np->a, np->b, np->c, np->d };
+		int regs[4];
+
+		if (uses[i] == 0)
+			continue;
+
+		/* operands are freed before the result is allocated,
+		   so the result may overwrite an operand; that's fine
+		   since every op works point by point */
+		for(int j = 0; j < 4; j++) {
+			regs[j] = ops[j] >= 0 ? reg[ops[j]] : -1;
+			if (ops[j] >= 0 && last[ops[j]] == i)
+				reg_free(is_point(nodes[ops[j]].op) ? &points : &scalars,
+					 reg[ops[j]]);
+		}
+
+		reg[i] = reg_alloc(is_point(np->op) ? &points : &scalars);
+		if (reg[i] < 0)
+			goto fail;	/* too many live values */
+
+		insn->op = np->op;
+		insn->dst = reg[i];
+		insn->a = regs[0];
+		insn->b = regs[1];
+		insn->c = regs[2];
+		insn->d = regs[3];
+		memcpy(insn->k, np->k, sizeof(insn->k));
+		insn->frac = np->frac;
+		insn->type = np->type;
+		insn->ncurve = 0;
+		insn->curve = NULL;
+
+		if (np->op == NG_CURVE) {
+			memcpy(&prog->curves[ncurve], np->curve,
+			       sizeof(*np->curve) * np->ncurve);
+			insn->curve = (const float (*)[2])&prog->curves[ncurve];
+			insn->ncurve = np->ncurve;
+			ncurve += np->ncurve;
+		}
+
+		insn++;
+	}
+
+	prog->nregs = scalars.count;
+	prog->npregs = points.count;
+	prog->out = reg[out];
+
+	free(nodes);
+	free(uses);
+	free(last);
+	free(reg);
+
+	return prog;
+
+  fail:
+	free(nodes);
+	free(uses);
+	free(last);
+	free(reg);
+	noiseprog_free(prog);
+	return NULL;
+}
+
+void noiseprog_free(struct noiseprog *prog)
+{
+	if (prog == NULL)
+		return;
+
+	free(prog->insns);
+	free(prog->curves);
+	free(prog);
+}
+
+static void eval_fractal(const struct ng_insn *insn, const float *pts,
+			 unsigned n, float spacing, float *out)
+{
+	float tmp[BLOCK * MAX_DIMENSIONS];
+	int ndim = fractal_ndim(insn->frac);
+	float scale = insn->k[0];
+	float octaves = insn->k[1];
+
+	if (spacing > 0)
+		octaves = fractal_octaves(insn->frac, scale, spacing, octaves);
+
+	if (scale != 1 || ndim != 3) {
+		for(unsigned i = 0; i < n; i++)
+			for(int d = 0; d < ndim; d++)
+				tmp[i * ndim + d] = d < 3 ? pts[i * 3 + d] * scale : 0;
+		pts = tmp;
+	}
+
+	switch(insn->type) {
+	case NOISE_FBM:
+		fractal_fBm_batch(insn->frac, pts, n, octaves, out);
+		break;
+	case NOISE_TURBULENCE:
+		fractal_turbulence_batch(insn->frac, pts, n, octaves, out);
+		break;
+	case NOISE_MULTIFRACTAL:
+		fractal_multifractal_batch(insn->frac, pts, n, octaves,
+					   insn->k[2], out);
+		break;
+	case NOISE_HETEROFRACTAL:
+		fractal_heterofractal_batch(insn->frac, pts, n, octaves,
+					    insn->k[2], out);
+		break;
+	case NOISE_HYBRID:
+		fractal_hybrid_multifractal_batch(insn->frac, pts, n, octaves,
+						  insn->k[2], insn->k[3], out);
+		break;
+	case NOISE_RIDGED:
+		fractal_ridged_multifractal_batch(insn->frac, pts, n, octaves,
+						  insn->k[2], insn->k[3], out);
+		break;
+	}
+}
+
+void noiseprog_eval(const struct noiseprog *prog, const float *points,
+		    unsigned npoints, float spacing, float *out)
+{
+	v4sf reg[prog->nregs][BLOCK / LANES];
+	float preg[prog->npregs ? prog->npregs : 1][BLOCK * 3];
+
+	for(unsigned start = 0; start < npoints; start += BLOCK) {
+		unsigned n = npoints - start;
+
+		if (n > BLOCK)
+			n = BLOCK;
+
+		/* round up to whole vectors; the spare lanes are
+		   evaluated at the origin and thrown away */
+		unsigned nvec = (n + LANES - 1) / LANES;
+		unsigned npad = nvec * LANES;
+
+		for(int i = 0; i < prog->ninsns; i++) {
+			const struct ng_insn *insn = &prog->insns[i];
+			v4sf *d = reg[insn->dst];
+
+			switch(insn->op) {
+			case NG_POINT:
+				memcpy(preg[insn->dst], &points[start * 3],
+				       sizeof(float) * n * 3);
+				memset(&preg[insn->dst][n * 3], 0,
+				       sizeof(float) * (npad - n) * 3);
+				break;
+
+			case NG_WARP: {
+				const float *dx = (const float *)reg[insn->b];
+				const float *dy = (const float *)reg[insn->c];
+				const float *dz = (const float *)reg[insn->d];
+				const float *p = preg[insn->a];
+				float *pd = preg[insn->dst];
+
+				for(unsigned j = 0; j < npad; j++) {
+					pd[j*3 + 0] = p[j*3 + 0] + insn->k[0] * dx[j];
+					pd[j*3 + 1] = p[j*3 + 1] + insn->k[0] * dy[j];
+					pd[j*3 + 2] = p[j*3 + 2] + insn->k[0] * dz[j];
+				}
+				break;
+			}
+
+			case NG_CONST:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = v4sf_splat(insn->k[0]);
+				break;
+
+			case NG_FRACTAL:
+				eval_fractal(insn, preg[insn->a], npad, spacing,
+					     (float *)d);
+				break;
+
+			case NG_SUM:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = reg[insn->a][j] + reg[insn->b][j];
+				break;
+
+			case NG_MUL:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = reg[insn->a][j] * reg[insn->b][j];
+				break;
+
+			case NG_SCALE:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = reg[insn->a][j] * insn->k[0] + insn->k[1];
+				break;
+
+			case NG_CLAMP:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = v4sf_clamp(insn->k[0], insn->k[1],
+							  reg[insn->a][j]);
+				break;
+
+			case NG_ABS:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = v4sf_abs(reg[insn->a][j]);
+				break;
+
+			case NG_SELECT:
+				for(unsigned j = 0; j < nvec; j++)
+					d[j] = select_lanes(reg[insn->a][j],
+							    reg[insn->b][j],
+							    reg[insn->c][j],
+							    insn->k[0], insn->k[1]);
+				break;
+
+			case NG_CURVE: {
+				const float *a = (const float *)reg[insn->a];
+				float *fd = (float *)d;
+
+				for(unsigned j = 0; j < npad; j++)
+					fd[j] = curve_eval(insn->curve, insn->ncurve, a[j]);
+				break;
+			}
+			}
+		}
+
+		memcpy(&out[start], reg[prog->out], sizeof(float) * n);
+	}
+}
+
+void noiseprog_generate(void *prog, const struct sample *s, unsigned n,
+			elevation_t *elev, struct vertex **vtx)
+{
+	if (n == 0)
+		return;
+
+	float pts[n * 3];
+	float height[n];
+	unsigned idx[n];
+	unsigned char done[n];
+
+	memset(done, 0, n);
+
+	/* the samples come from one patch, but the ones it shares
+	   with coarser patches have less detail, so they're evaluated
+	   in a batch for each detail */
+	for(unsigned first = 0; first < n; first++) {
+		float detail = s[first].detail;
+		unsigned count = 0;
+
+		if (done[first])
+			continue;
+
+		for(unsigned i = first; i < n; i++) {
+			if (done[i] || s[i].detail != detail)
+				continue;
+
+			pts[count * 3 + 0] = s[i].normal.x;
+			pts[count * 3 + 1] = s[i].normal.y;
+			pts[count * 3 + 2] = s[i].normal.z;
+			idx[count++] = i;
+			done[i] = 1;
+		}
+
+		noiseprog_eval(prog, pts, count, detail, height);
+
+		for(unsigned i = 0; i < count; i++)
+			elev[idx[i]] = height[i];
+	}
+}
@@ -0,0 +1,95 @@
+#ifndef _NOISEGRAPH_H
+#define _NOISEGRAPH_H
+
+#include "noise.h"
+#include "quadtree.h"
+
+/*
+   A noise graph describes a terrain function as a composition of
+   fractals and simple operators, rather than as hand-written C.
+
+   Nodes are created with the noisegraph_*() functions, each of which
+   returns a node number which can be used as the operand of later
+   nodes.  Nodes are either points (noisegraph_point() and
+   noisegraph_warp()) or scalars (everything else).  If a node can't
+   be created the result is -1, and any node built from a -1 operand
+   is also -1, so errors need only be checked for at the end.
+
+   The graph is then compiled into a noiseprog: a flat list of
+   instructions over a small register file, with dead nodes removed,
+   constant subexpressions folded and chains of affine operations
+   fused.  A noiseprog evaluates arrays of points in blocks, with the
+   fractals done by the batch fractal functions and the other
+   operators done across SIMD lanes.  There are no per-node function
+   calls.
+ */
+
+typedef int noisenode_t;
+
+enum noisegraph_fractal {
+	NOISE_FBM,
+	NOISE_TURBULENCE,
+	NOISE_MULTIFRACTAL,	/* uses offset */
+	NOISE_HETEROFRACTAL,	/* uses offset */
+	NOISE_HYBRID,		/* uses offset, gain */
+	NOISE_RIDGED,		/* uses offset, gain (as thresh) */
+};
+
+struct noisegraph;
+struct noiseprog;
+
+struct noisegraph *noisegraph_create(void);
+void noisegraph_free(struct noisegraph *g);
+
+/* The point being evaluated */
+noisenode_t noisegraph_point(struct noisegraph *g);
+/* The point p displaced by amount * (dx, dy, dz) */
+noisenode_t noisegraph_warp(struct noisegraph *g, noisenode_t p,
+			    noisenode_t dx, noisenode_t dy, noisenode_t dz,
+			    float amount);
+
+noisenode_t noisegraph_const(struct noisegraph *g, float value);
+
+/* A fractal of point p * scale.  octaves is the maximum number of
+   octaves; if the program is evaluated with a sample spacing, the
+   octaves too fine for it are dropped as fractal_octaves() does. */
+noisenode_t noisegraph_fractal(struct noisegraph *g, enum noisegraph_fractal type,
+			       const struct fractal *frac, noisenode_t p,
+			       float scale, float octaves,
+			       float offset, float gain);
+
+noisenode_t noisegraph_sum(struct noisegraph *g, noisenode_t a, noisenode_t b);
+noisenode_t noisegraph_mul(struct noisegraph *g, noisenode_t a, noisenode_t b);
+/* a * scale + bias */
+noisenode_t noisegraph_scale(struct noisegraph *g, noisenode_t a, float scale, float bias);
+noisenode_t noisegraph_clamp(struct noisegraph *g, noisenode_t a, float min, float max);
+noisenode_t noisegraph_abs(struct noisegraph *g, noisenode_t a);
+
+/* a where control is below threshold, b where it is above; within
+   falloff of the threshold the two are blended with a cubic. */
+noisenode_t noisegraph_select(struct noisegraph *g, noisenode_t control,
+			      noisenode_t a, noisenode_t b,
+			      float threshold, float falloff);
+
+/* Remap a through a piecewise linear curve of npoints (x, y) control
+   points, sorted by x.  Values outside the curve are clamped to the
+   end points. */
+noisenode_t noisegraph_curve(struct noisegraph *g, noisenode_t a,
+			     const float (*points)[2], int npoints);
+
+struct noiseprog *noisegraph_compile(const struct noisegraph *g, noisenode_t out);
+void noiseprog_free(struct noiseprog *prog);
+
+/* Evaluate prog at npoints points of 3 floats each.  spacing is the
+   distance between neighbouring points, used to choose the number of
+   octaves of each fractal; 0 means always use the maximum. */
+void noiseprog_eval(const struct noiseprog *prog, const float *points,
+		    unsigned npoints, float spacing, float *out);
+
+/* A batch_generator_t for quadtree_create_batch(), with a noiseprog
+   as its argument.  The program's output is used directly as the
+   elevation; vertex colours are left alone. */
+void noiseprog_generate(void *prog, const struct sample *s, unsigned n,
+			elevation_t *elev, struct vertex **vtx);
+
+#endif	/* _NOISEGRAPH_H */
@@ -4,50 +4,51 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "geom.h"
 
-#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
-#include <GL/glext.h>
-#include <GL/glu.h>
 
 #include "quadtree.h"
 #include "quadtree_priv.h"
+#include "render.h"
+#include "texcomp.h"
 
 #define DEBUG		0
-#define ANNOTATE	1
 
 #define TARGETSIZE (1.f / 100.f)		/* target size as fraction of screen area */
 static const float MARGIN  = TARGETSIZE;	/* size of error needed before updating */
 static const float MAXSIZE =  3*TARGETSIZE;	/* error threshold for splitting */
 static const float MINSIZE = -3*TARGETSIZE;	/* error threshold for merging */
 
+static int patch_merge(struct quadtree *qt, struct patch *p,
+		       int (*maymerge)(const struct patch *));
 
-static int have_vbo = -1;
-static int have_cva = -1;
-
-static GLuint index_bufid = 0;
-static const patch_index_t (*patchidx)[9][INDICES_PER_PATCH] = &patch_indices;
-
-#define GLERROR()							\
-do {									\
-	GLenum err = glGetError();					\
-	if (err != GL_NO_ERROR) {					\
-		printf("GL error at %s:%d: %s\n",			\
-		       __FILE__, __LINE__, gluErrorString(err));	\
-	}								\
-} while(0)
-
-struct vertex {
-	texcoord_t s,t;
-	GLubyte col[4];
-	GLbyte nx, ny, nz;	/* needed? */
-	GLfloat x,y,z;		/* short? */
+/* Tiles to be made for a patch (see quadtree_normal_maps() and
+   quadtree_colour_tiles()).  The worker only looks at extent, a copy
+   of the patch as it was when the job was queued, since the patch
+   itself may be swapped to another slot or recycled meanwhile.  p is
+   the patch wanting the normal map; it follows the patch, or is set
+   to NULL if the normal map is no longer wanted (or never was).
+   page is the atlas page for the colour tile, or -1 for none; the
+   tile is still wanted if the patch goes, since the page table can
+   find it again. */
+struct tile_job {
+	struct patch *p;
+	struct patch extent;
+	int page;
+	unsigned generation;		/* of the atlas page is in */
+	struct tile_job *next;
+	unsigned key;			/* queue order, nearest first */
+	patch_tile_t normals, colour;
+	unsigned char blocks[PATCH_TILE * PATCH_TILE / 2];	/* colour, BC1 coded */
 };
 
-static int patch_merge(struct quadtree *qt, struct patch *p,
-		       int (*maymerge)(const struct patch *));
+static void swap_tiles(struct quadtree *qt, struct patch *a, struct patch *b);
+static void cancel_tile(struct quadtree *qt, struct patch *p);
+static unsigned distance_key(const struct patch *p, const vec3_t *pos);
 
 static inline int clamp(int x, int lower, int upper)
 {
@@ -67,6 +68,20 @@ static int patch_flip(const vec3_t *face)
 	return s == -1.f;
 }
 
+/* The edge sample above skirt vertex k; see genpatchidx.c */
+void skirt_edge(int k, int *i, int *j)
+{
+	int side = k / PATCH_SAMPLES;
+	int n = k % PATCH_SAMPLES;
+
+	switch(side) {
+	case 0:	*i = n;			*j = 0;			break;	/* bottom */
+	case 1:	*i = PATCH_SAMPLES;	*j = n;			break;	/* right */
+	case 2:	*i = PATCH_SAMPLES - n;	*j = PATCH_SAMPLES;	break;	/* top */
+	default: *i = 0;		*j = PATCH_SAMPLES - n;	break;	/* left */
+	}
+}
+
 static void patch_sample_normal(const struct quadtree *qt, const struct patch *p,
 				int si, int sj, vec3_t *v)
 {
@@ -105,8 +120,46 @@ static void patch_sample_normal(const struct quadtree *qt, const struct patch *p
 	vec3_normalize(v);
 }
 
-static void patch_corner_normals(const struct quadtree *qt, const struct patch *p,
-				 vec3_t v[4])
+/* As patch_sample_normal(), for any point of the patch, in units of
+   its sample spacing */
+static void patch_point_normal(const struct quadtree *qt, const struct patch *p,
+			       float si, float sj, vec3_t *v)
+{
+	vec3_t iv, jv, rv;
+	double i, j, radius;
+
+	radius = qt->radius;
+	rv = *p->face;
+
+	if (patch_flip(p->face)) {
+		float t = si;
+		si = sj;
+		sj = t;
+
+		vec3_abs(&rv);
+		radius = -radius;
+	}
+
+	i = p->i0 + (double)(p->i1 - p->i0) * si / PATCH_SAMPLES;
+	j = p->j0 + (double)(p->j1 - p->j0) * sj / PATCH_SAMPLES;
+
+	iv = VEC3(rv.z, rv.x, rv.y);
+	vec3_scale(&iv, i);
+
+	jv = VEC3(rv.y, rv.z, rv.x);
+	vec3_scale(&jv, j);
+
+	vec3_scale(&rv, radius);
+
+	*v = rv;
+	vec3_add(v, v, &iv);
+	vec3_add(v, v, &jv);
+
+	vec3_normalize(v);
+}
+
+void patch_corner_normals(const struct quadtree *qt, const struct patch *p,
+			  vec3_t v[4])
 {
 	patch_sample_normal(qt, p, 0, 0, &v[0]);
 	patch_sample_normal(qt, p, PATCH_SAMPLES, 0, &v[1]);
@@ -176,6 +229,11 @@ unsigned long patch_id(const struct patch *p)
 	return p->id;
 }
 
+int patch_face(const struct patch *p)
+{
+	return p->id >> (p->level * 2);
+}
+
 static void emitdotpatch(FILE *f, const struct patch *p)
 {
 	static const char *dirname[] = {
@@ -257,6 +315,26 @@ static enum patch_sibling siblingid(const struct patch *p)
 	return p->id % 4;
 }
 
+/* Deepest level a Morton key can tell apart */
+#define MORTON_LEVELS	29
+
+/* p's position along a Z-order curve over the cube: its face, then
+   its i/j bits interleaved down to MORTON_LEVELS.  The sibling ids
+   go round the parent (DL, DR, UR, UL), so UR and UL are exchanged to
+   make them Z-order.  Siblings are adjacent on the curve, and active
+   patches, which never overlap, all have different keys. */
+static unsigned long long patch_morton(const struct patch *p)
+{
+	unsigned long long id = p->id;
+	unsigned long long digits = (1ULL << (2 * p->level)) - 1;
+
+	assert(p->level <= MORTON_LEVELS);
+
+	id ^= (id >> 1) & digits & 0x5555555555555555ULL;
+
+	return id << (2 * (MORTON_LEVELS - p->level));
+}
+
 /* Find neighbour 'n' of patch 'p', and find the appropriate backwards
    direction by looking for 'oldp', which is presumably a reference we
    want to replace.  Always returns an even direction. */
@@ -351,7 +429,9 @@ static int check_neighbour_levels(const struct patch *p)
 }
 
 /* Once a patch has been linked to all its neighbours, then fix up all
-   the neighbour's backlinks */
+   the neighbour's backlinks.  A side with only one neighbour has it in
+   both pointers; it's only visited once, since a second visit would
+   find the same links already fixed. */
 static void backlink_neighbours(struct patch *p, struct patch *oldp)
 {
 	enum patch_sibling sib = siblingid(p);
@@ -359,9 +439,13 @@ static void backlink_neighbours(struct patch *p, struct patch *oldp)
 	assert(check_neighbour_levels(p));
 
 	for(enum patch_neighbour dir = 0; dir < 8; dir++) {
-		enum patch_neighbour opp = neigh_opposite(p, dir, oldp);
 		struct patch *n = p->neigh[dir];
 
+		if ((dir & 1) && n == p->neigh[dir ^ 1])
+			continue;
+
+		enum patch_neighbour opp = neigh_opposite(p, dir, oldp);
+
 		n->flags |= PF_STITCH_GEOM;
 
 		if (opp == PN_BADDIR)
@@ -519,8 +603,8 @@ static struct patch *find_lowest(struct quadtree *qt)
 	return ret;
 }
 
-static void patch_init(struct patch *p, int level, unsigned id,
-		       const vec3_t *face)
+static void patch_init(struct quadtree *qt, struct patch *p,
+		       int level, unsigned id, const vec3_t *face)
 {
 	assert((p->flags & PF_ACTIVE) == 0);
 
@@ -554,7 +638,7 @@ static void patch_init(struct patch *p, int level, unsigned id,
 	}
 
 	for(int i = 0; i < 4; i++)
-		p->col[i] = rand();
+		p->col[i] = random_next(&qt->rng);
 
 	for(int i = 0; i < 4; i++)
 		p->kids[i] = NULL;
@@ -562,6 +646,10 @@ static void patch_init(struct patch *p, int level, unsigned id,
 	for(int i = 0; i < 8; i++)
 		p->neigh[i] = NULL;
 
+	/* it's somewhere else now, so any tile being made is wrong */
+	if (p->tile_job)
+		cancel_tile(qt, p);
+
 	p->flags = PF_UPDATE_GEOM | PF_STITCH_GEOM;
 	p->parent = NULL;
 	p->level = level;
@@ -578,11 +666,43 @@ static int mergeculledonly(const struct patch *p)
 	return (p->flags & PF_CULLED) != 0;
 }
 
+/* Free slots this far either side of the one asked for are used in
+   preference to the freelist's LRU order */
+#define ALLOC_WINDOW	32
+
+/* Find the free slot nearest near in the pool, preferring one which
+   has never been used (so no cached patch is thrown away) */
+static struct patch *alloc_near(struct quadtree *qt, const struct patch *near)
+{
+	int idx = near - qt->patches;
+	struct patch *ret = NULL;
+
+	for(int d = 1; d <= ALLOC_WINDOW; d++)
+		for(int s = -1; s <= 1; s += 2) {
+			int i = idx + d * s;
+
+			if (i < 0 || i >= qt->npatches)
+				continue;
+
+			struct patch *p = &qt->patches[i];
+
+			if ((p->flags & PF_FREE) == 0)
+				continue;
+			if (p->flags & PF_UNUSED)
+				return p;
+			if (ret == NULL)
+				ret = p;
+		}
+
+	return ret;
+}
+
 /* Allocate a patch from the freelist.  Caller should call
    patch_init() on it.  Also checks to see how much space is left on
    the freelist, and does some merging to free up patches if it gets
-   too small. */
-static struct patch *patch_alloc(struct quadtree *qt)
+   too small.  If near is non-NULL, a free slot close to it in the
+   pool is used if there is one, so related patches stay together. */
+static struct patch *patch_alloc(struct quadtree *qt, const struct patch *near)
 {
 	static const unsigned MINLIST = 10;
 
@@ -613,14 +733,18 @@ static struct patch *patch_alloc(struct quadtree *qt)
 		return NULL;
 	}
 
-	struct list_head *pp = qt->freelist.next;
-	list_del(pp);
+	struct patch *p = near ? alloc_near(qt, near) : NULL;
+
+	if (p == NULL)
+		p = list_entry(qt->freelist.next, struct patch, list);
+
+	assert(p->flags & PF_FREE);
+	list_del(&p->list);
+	p->flags &= ~PF_FREE;
 
 	assert(qt->nfree > 0);
 	qt->nfree--;
 
-	struct patch *p = list_entry(pp, struct patch, list);
-
 	//printf("allocated %p\n", p);
 
 	return p;
@@ -639,6 +763,7 @@ static void patch_free(struct quadtree *qt, struct patch *p)
 	assert(p->pinned == 0);
 
 	list_add_tail(&p->list, &qt->freelist);
+	p->flags |= PF_FREE;
 	qt->nfree++;
 	assert(qt->nfree <= qt->npatches);
 }
@@ -649,6 +774,7 @@ static void patch_remove_freelist(struct quadtree *qt, struct patch *p)
 	assert(on_freelist(qt, p));
 
 	list_del(&p->list);
+	p->flags &= ~PF_FREE;
 	assert(qt->nfree > 0);
 	qt->nfree--;
 }
@@ -809,7 +935,7 @@ static int patch_merge(struct quadtree *qt, struct patch *p,
 		int level = p->level - 1;
 
 		/* allocate a new parent */
-		parent = patch_alloc(qt);
+		parent = patch_alloc(qt, sib[0]);
 
 		if (parent == NULL)
 			goto out_fail;
@@ -817,7 +943,7 @@ static int patch_merge(struct quadtree *qt, struct patch *p,
 		assert(parent != NULL);
 		assert(!on_freelist(qt, parent));
 
-		patch_init(parent, level, id, p->face);
+		patch_init(qt, parent, level, id, p->face);
 		
 		parent->i0 = sib[0]->i0;
 		parent->j0 = sib[0]->j0;
@@ -881,6 +1007,8 @@ static int patch_merge(struct quadtree *qt, struct patch *p,
 
 	assert(check_neighbour_levels(parent));
 
+	qt->draws_dirty = 1;
+
 	return 1;
 
   out_fail:
@@ -943,10 +1071,10 @@ static int patch_split(struct quadtree *qt, struct patch *parent)
 
 		assert(parent->flags & PF_ACTIVE);
 		if (k[i] == NULL) {
-			k[i] = patch_alloc(qt);
+			k[i] = patch_alloc(qt, parent);
 			if (k[i] == NULL)
 				goto out_fail;
-			patch_init(k[i], parent->level + 1,
+			patch_init(qt, k[i], parent->level + 1,
 				   childid(parent->id, i), parent->face);
 
 			k[i]->parent = parent;
@@ -1050,6 +1178,8 @@ static int patch_split(struct quadtree *qt, struct patch *parent)
 	parent->pinned--;
 	patch_free(qt, parent);
 
+	qt->draws_dirty = 1;
+
 	return 1;
 
   out_fail:
@@ -1060,13 +1190,156 @@ static int patch_split(struct quadtree *qt, struct patch *parent)
 			assert(k[i]->pinned > 0);
 			k[i]->pinned--;
 			k[i]->flags = PF_UNUSED;
-			patch_init(k[i], -1, 0, NULL);
+			patch_init(qt, k[i], -1, 0, NULL);
 			patch_free(qt, k[i]);
 		}
 	return 0;
 }
 
-struct quadtree *quadtree_create(int num_patches, long radius, generator_t *generator)
+/* Redirect any link to a to b, and any to b to a */
+static inline void swap_link(struct patch **link, struct patch *a, struct patch *b)
+{
+	if (*link == a)
+		*link = b;
+	else if (*link == b)
+		*link = a;
+}
+
+/* Exchange the patches in slots a and b of the pool, along with their
+   vertices, octave cache entries and places in whatever lists they're
+   on.  Neither may be pinned, and nothing outside the pool may hold
+   pointers to them.  Returns 0, doing nothing, if the backend can't
+   swap the vertices yet. */
+static int swap_slots(struct quadtree *qt, struct patch *a, struct patch *b)
+{
+	assert(a->pinned == 0 && b->pinned == 0);
+
+	if (!qt->render->backend->swap(qt->render, a->vertex_offset, b->vertex_offset))
+		return 0;
+
+	/* the links are symmetric for active patches, but patches on
+	   the freelist may still be pointed to by other free ones, so
+	   look everywhere */
+	for(int i = 0; i < qt->npatches; i++) {
+		struct patch *p = &qt->patches[i];
+
+		swap_link(&p->parent, a, b);
+		for(int k = 0; k < 4; k++)
+			swap_link(&p->kids[k], a, b);
+		for(int k = 0; k < 8; k++)
+			swap_link(&p->neigh[k], a, b);
+	}
+
+	/* hold their places in their lists while they're exchanged */
+	struct list_head ta, tb;
+
+	list_add(&ta, &a->list);
+	list_del(&a->list);
+	list_add(&tb, &b->list);
+	list_del(&b->list);
+
+	struct patch tmp = *a;
+	unsigned aoff = a->vertex_offset;
+	unsigned boff = b->vertex_offset;
+
+	*a = *b;
+	*b = tmp;
+	a->vertex_offset = aoff;
+	b->vertex_offset = boff;
+
+	list_add(&a->list, &tb);
+	list_del(&tb);
+	list_add(&b->list, &ta);
+	list_del(&ta);
+
+	if (qt->coarse) {
+		float c[MESH_SAMPLES * MESH_SAMPLES];
+		int ai = a - qt->patches, bi = b - qt->patches;
+
+		memcpy(c, qt->coarse[ai], sizeof(c));
+		memcpy(qt->coarse[ai], qt->coarse[bi], sizeof(c));
+		memcpy(qt->coarse[bi], c, sizeof(c));
+	}
+
+	if (qt->workers)
+		swap_tiles(qt, a, b);
+
+	return 1;
+}
+
+/* Slot swaps compact_pool() may do per update */
+#define COMPACT_MOVES	16
+
+struct morton_slot {
+	unsigned long long key;
+	struct patch *p;
+};
+
+static int morton_cmp(const void *a, const void *b)
+{
+	const struct morton_slot *ma = a, *mb = b;
+
+	return (ma->key > mb->key) - (ma->key < mb->key);
+}
+
+/* Move the active patches a little way towards filling the start of
+   the pool in Z-order.  Each update puts the first few which are out
+   of place where they belong, swapping out whatever was there, so
+   splits and merges are gradually tidied up without any one frame
+   paying for a full sort of the pool. */
+static void compact_pool(struct quadtree *qt)
+{
+	struct morton_slot *order = qt->compact_order;
+	struct list_head *pp;
+	unsigned n = 0;
+
+	qt->compact_moves = 0;
+
+	if (!qt->render->can_swap)
+		return;
+
+	list_for_each(pp, &qt->visible) {
+		struct patch *p = list_entry(pp, struct patch, list);
+
+		order[n].key = patch_morton(p);
+		order[n++].p = p;
+	}
+	list_for_each(pp, &qt->culled) {
+		struct patch *p = list_entry(pp, struct patch, list);
+
+		order[n].key = patch_morton(p);
+		order[n++].p = p;
+	}
+	assert(n == qt->nactive);
+
+	qsort(order, n, sizeof(*order), morton_cmp);
+
+	for(unsigned k = 0; k < n && qt->compact_moves < COMPACT_MOVES; k++) {
+		struct patch *slot = &qt->patches[k];
+		struct patch *p = order[k].p;
+
+		/* a move the backend can't make yet is left for a
+		   later update */
+		if (p == slot || !swap_slots(qt, p, slot))
+			continue;
+
+		/* whatever is in slot, if it's active, is later in
+		   the order, so its entry needs to follow it */
+		for(unsigned j = k + 1; j < n; j++)
+			if (order[j].p == slot) {
+				order[j].p = p;
+				break;
+			}
+
+		qt->compact_moves++;
+		qt->draws_dirty = 1;
+	}
+}
+
+struct quadtree *quadtree_create_backend(int num_patches, long radius,
+					 generator_t *generator,
+					 batch_generator_t *batch_generator, void *batch_arg,
+					 const struct render_backend *backend)
 {
 	struct quadtree *qt = NULL;
 
@@ -1079,10 +1352,13 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 		goto out;
 
 	qt->generator = generator;
+	qt->batch_generator = batch_generator;
+	qt->batch_arg = batch_arg;
 	qt->radius = radius;
 
 	qt->patches = malloc(sizeof(struct patch) * num_patches);
-	if (qt->patches == NULL)
+	qt->compact_order = malloc(sizeof(*qt->compact_order) * num_patches);
+	if (qt->patches == NULL || qt->compact_order == NULL)
 		goto out;
 	qt->npatches = num_patches;
 
@@ -1095,6 +1371,43 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 	qt->nvisible = 0;
 
 	qt->phase = 0;
+	random_init(&qt->rng, 0);
+	qt->coarse = NULL;
+	qt->workers = NULL;
+	qt->normal_tiles = NULL;
+	qt->atlas = NULL;
+	qt->tiles_made = qt->tiles_pending = qt->tiles_cancelled = 0;
+	qt->pages_reused = 0;
+	qt->render = NULL;
+
+	qt->compact_moves = 0;
+	qt->ndraws = 0;
+	qt->draw_runs = 0;
+	qt->draw_frames = 0;
+	qt->draws_dirty = 1;
+	qt->draw_patch = malloc(sizeof(*qt->draw_patch) * num_patches);
+	qt->draw_count = malloc(sizeof(*qt->draw_count) * num_patches);
+	qt->draw_indices = malloc(sizeof(*qt->draw_indices) * num_patches);
+	qt->draw_base = malloc(sizeof(*qt->draw_base) * num_patches);
+	qt->draw_frame = malloc(sizeof(*qt->draw_frame) * num_patches);
+	qt->frame_size = 1u << (32 - __builtin_clz(num_patches * 2 - 1));
+	qt->frame_slot = malloc(sizeof(*qt->frame_slot) * qt->frame_size);
+	qt->frame_num = malloc(sizeof(*qt->frame_num) * qt->frame_size);
+	qt->front_to_back = 0;
+	qt->draw_sorts = 0;
+	qt->sort_key = malloc(sizeof(*qt->sort_key) * num_patches * 2);
+	qt->sort_tmp = malloc(sizeof(*qt->sort_tmp) * num_patches);
+	qt->state_fn = NULL;
+	qt->state_arg = NULL;
+	qt->ngroups = 0;
+	qt->group_start = malloc(sizeof(*qt->group_start) * (num_patches + 1));
+	qt->group_state = malloc(sizeof(*qt->group_state) * num_patches);
+	if (qt->draw_patch == NULL || qt->draw_count == NULL ||
+	    qt->draw_indices == NULL || qt->draw_base == NULL ||
+	    qt->draw_frame == NULL || qt->frame_slot == NULL || qt->frame_num == NULL ||
+	    qt->sort_key == NULL || qt->sort_tmp == NULL ||
+	    qt->group_start == NULL || qt->group_state == NULL)
+		goto out;
 
 	/* add patches to freelist */
 	for(int i = 0; i < num_patches; i++) {
@@ -1103,58 +1416,15 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 		p->flags = PF_UNUSED; /* has never been used */
 		p->pinned = 0;
 		p->vertex_offset = i * VERTICES_PER_PATCH;
+		p->tile_job = NULL;
 		INIT_LIST_HEAD(&p->list);
 
 		patch_free(qt, p);
 	}
 
-	if (DEBUG) {
-		printf("vendor: %s\n", glGetString(GL_VENDOR));
-		printf("renderer: %s\n", glGetString(GL_RENDERER));
-		printf("version: %s\n", glGetString(GL_VERSION));
-	}
-
-	const GLubyte *extensions = glGetString(GL_EXTENSIONS);
-
-	if (have_vbo == -1) {
-		if (strncmp("1.5", (char *)glGetString(GL_VERSION), 3) == 0)
-			have_vbo = 1;
-		else
-			have_vbo = gluCheckExtension((GLubyte *)"GL_ARB_vertex_buffer_object",
-						     extensions);
-	}
-
-	if (have_cva == -1)
-		have_cva = gluCheckExtension((GLubyte *)"GL_EXT_compiled_vertex_array",
-					     extensions);
-
-	if (DEBUG)
-		printf("vbo: %d  cva:%d\n", have_vbo, have_cva);
-
-	if (have_vbo) {
-		glGenBuffers(1, &qt->vtxbufid);
-		GLERROR();
-		glBindBuffer(GL_ARRAY_BUFFER, qt->vtxbufid);
-		glBufferData(GL_ARRAY_BUFFER,
-			     sizeof(struct vertex) * VERTICES_PER_PATCH * num_patches,
-			     NULL, GL_DYNAMIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		GLERROR();
-		qt->varray = NULL;
-
-		if (index_bufid == 0) {
-			glGenBuffers(1, &index_bufid);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_bufid);
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(patch_indices), patch_indices,
-				     GL_STATIC_DRAW);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-			patchidx = NULL;
-		}
-	} else {
-		qt->varray = malloc(sizeof(struct vertex) * VERTICES_PER_PATCH * num_patches);
-		qt->vtxbufid = 0;
-	}
+	qt->render = backend->create(num_patches);
+	if (qt->render == NULL)
+		goto out;
 
 	/* face normals for the cube */
 	static const vec3_t *cube[6] = {
@@ -1170,7 +1440,7 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 	struct patch *faces[6];
 
 	for(int i = 0; i < 6; i++) {
-		struct patch *p = patch_alloc(qt);
+		struct patch *p = patch_alloc(qt, NULL);
 
 		if (p == NULL)
 			goto out;
@@ -1180,7 +1450,7 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 		p->i0 = p->j0 = -radius;
 		p->i1 = p->j1 =  radius;
 
-		patch_init(p, 0, i, cube[i]);
+		patch_init(qt, p, 0, i, cube[i]);
 
 		compute_bbox(qt, p);
 	}
@@ -1191,10 +1461,18 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 		struct patch *f = faces[i];
 		vec3_t sides[4];
 
-		patch_sample_normal(qt, f, PATCH_SAMPLES+1, PATCH_SAMPLES/2, &sides[0]); /* right */
-		patch_sample_normal(qt, f, PATCH_SAMPLES/2, PATCH_SAMPLES+1, &sides[1]); /* up */
-		patch_sample_normal(qt, f, -1, PATCH_SAMPLES/2, &sides[2]); /* left */
-		patch_sample_normal(qt, f, PATCH_SAMPLES/2, -1, &sides[3]); /* down */
+		/* the directions are of i and j on the face, which
+		   patch_sample_normal() transposes for -ve faces */
+		int t = patch_flip(f->face);
+
+		patch_sample_normal(qt, f, t ? PATCH_SAMPLES/2 : PATCH_SAMPLES+1,
+				    t ? PATCH_SAMPLES+1 : PATCH_SAMPLES/2, &sides[0]); /* right */
+		patch_sample_normal(qt, f, t ? PATCH_SAMPLES+1 : PATCH_SAMPLES/2,
+				    t ? PATCH_SAMPLES/2 : PATCH_SAMPLES+1, &sides[1]); /* up */
+		patch_sample_normal(qt, f, t ? PATCH_SAMPLES/2 : -1,
+				    t ? -1 : PATCH_SAMPLES/2, &sides[2]); /* left */
+		patch_sample_normal(qt, f, t ? -1 : PATCH_SAMPLES/2,
+				    t ? PATCH_SAMPLES/2 : -1, &sides[3]); /* down */
 
 		for(int i = 0; i < 4; i++) {
 			vec3_majoraxis(&sides[i], &sides[i]);
@@ -1228,114 +1506,22 @@ struct quadtree *quadtree_create(int num_patches, long radius, generator_t *gene
 	return NULL;
 }
 
-static void patch_bbox(const struct patch *p)
+struct quadtree *quadtree_create(int num_patches, long radius, generator_t *generator)
 {
-	const box_t *b = &p->bbox;
-
-	glBegin(GL_LINES);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z + b->extent.z);
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-
-	glVertex3f(b->centre.x - b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y + b->extent.y,
-		   b->centre.z - b->extent.z);
-	glVertex3f(b->centre.x + b->extent.x,
-		   b->centre.y - b->extent.y,
-		   b->centre.z - b->extent.z);
-
-	glEnd();
-
-}
-
-static void patch_outline(const struct quadtree *qt, const struct patch *p)
-{
-	vec3_t sph[4];
-	int radius = qt->radius;
+	return quadtree_create_backend(num_patches, radius, generator, NULL, NULL,
+				       &render_gl);
+}
 
-	patch_corner_normals(qt, p, sph);
-	for(int i = 0; i < 4; i++)
-		vec3_scale(&sph[i], radius);
+struct quadtree *quadtree_create_batch(int num_patches, long radius,
+				       batch_generator_t *generator, void *arg)
+{
+	return quadtree_create_backend(num_patches, radius, NULL, generator, arg,
+				       &render_gl);
+}
 
-	glBegin(GL_LINE_LOOP);
-	for(int i = 0; i < 4; i++)
-		glVertex3fv(sph[i].v);
-	glEnd();
+struct render *quadtree_render_backend(const struct quadtree *qt)
+{
+	return qt->render;
 }
 
 static float projected_quad_area(const struct quadtree *qt, const struct patch *p,
@@ -1430,7 +1616,9 @@ static void update_prio(const struct quadtree *qt,
 	}
 }
 
-static void generate_geom(const struct quadtree *qt);
+static void generate_geom(struct quadtree *qt);
+static void update_tiles(struct quadtree *qt, const vec3_t *camerapos);
+static void build_draws(struct quadtree *qt, const vec3_t *camerapos);
 
 static int mergesmall(const struct patch *p)
 {
@@ -1480,7 +1668,7 @@ void quadtree_update_view(struct quadtree *qt, const matrix_t *mat,
 			  const vec3_t *camerapos)
 {
 	char buf[40];
-	plane_t cullplanes[7];	/* 6 frustum and 1 horizon */
+	plane_t *cullplanes = qt->cullplanes;
 
 	/* remove all active patches into a local list */
 	struct list_head local, *pp, *pnext;
@@ -1492,43 +1680,6 @@ void quadtree_update_view(struct quadtree *qt, const matrix_t *mat,
 
 	compute_cull_planes(qt, mat, camerapos, cullplanes);
 
-	if (ANNOTATE) {
-		/* display cull planes */
-		static const float col[] = {
-			0,0,1,	/* blue - left */
-			0,1,0,	/* green - right */
-			1,0,0,	/* red - top */
-			1,0,1,	/* magenta - bottom */
-			1,1,0,	/* yellow - near */
-			1,1,1,	/* white - far */
-			0,1,1,	/* cyan - horizion */
-		};
-
-		glPushAttrib(GL_ENABLE_BIT);
-		glDisable(GL_LIGHTING);
-		glDisable(GL_TEXTURE_2D);
-
-		glBegin(GL_LINES);
-		for(int i = 0; i < 7; i++) {
-			vec3_t v = cullplanes[i].normal;
-
-			/* scale and flip to be vector from origin
-			   rather than normal vector */
-			vec3_scale(&v, -cullplanes[i].dist);
-
-			glColor3fv(&col[i * 3]);
-
-			glVertex3fv(v.v);
-
-			/* draw partial length so that all sides have
-			   some chance of being seen */
-			vec3_scale(&v, .75);
-			glVertex3fv(v.v);
-		}
-		glEnd();
-		glPopAttrib();
-	}
-
 	qt->phase++;
 
 	/* For each patch, check if it is culled or not.  In either
@@ -1539,10 +1690,15 @@ void quadtree_update_view(struct quadtree *qt, const matrix_t *mat,
 
 		list_del(pp);	/* remove from local list */
 
+		unsigned culled = p->flags & PF_CULLED;
+
 		p->flags &= ~(PF_CULLED | PF_ACTIVE | PF_LATECULL);
 
 		update_prio(qt, p, mat, cullplanes, camerapos);
 
+		if ((p->flags & PF_CULLED) != culled)
+			qt->draws_dirty = 1;
+
 		patch_insert_active(qt, p);
 	}
 	assert(list_empty(&local));
@@ -1619,12 +1775,26 @@ void quadtree_update_view(struct quadtree *qt, const matrix_t *mat,
 				patch_remove_active(qt, p);
 				p->flags |= PF_CULLED | PF_LATECULL;
 				patch_insert_active(qt, p);
+				qt->draws_dirty = 1;
 				goto restart_recull_list;
 			}
 		}
 	}
 
+	struct render *r = qt->render;
+
+	r->upload_bytes = 0;
+	r->upload_transfers = 0;
+	r->upload_stalled = 0;
+	r->upload_busy = 0;
+	r->upload_deferred = 0;
+	r->swaps_refused = 0;
+
+	compact_pool(qt);
 	generate_geom(qt);
+	if (qt->workers)
+		update_tiles(qt, camerapos);
+	build_draws(qt, camerapos);
 }
 
 
@@ -1639,129 +1809,1339 @@ void vertex_set_texcoord(struct vertex *vtx, texcoord_t s, texcoord_t t)
 	vtx->t = t;
 }
 
-static void compute_vertex(const struct quadtree *qt, const struct patch *p,
-			   int i, int j, struct vertex *vtx)
+/* Distance between samples of p on the unit sphere.  The cube face
+   spans -radius to radius in i and j, so this is exact at the face
+   centre and an overestimate towards the corners. */
+static float patch_spacing(const struct quadtree *qt, const struct patch *p)
 {
-	vec3_t sv;
-	elevation_t elev;
+	return (float)(p->i1 - p->i0) / (PATCH_SAMPLES * qt->radius);
+}
 
-	vtx->s = i;
-	vtx->t = PATCH_SAMPLES - j;
+void quadtree_octave_cache(struct quadtree *qt, int enable)
+{
+	for(int i = 0; i < qt->npatches; i++)
+		qt->patches[i].flags &= ~PF_COARSE;
 
-	vtx->col[0] = 255;
-	vtx->col[1] = 255;
-	vtx->col[2] = 255;
-	vtx->col[3] = 255;
+	free(qt->coarse);
+	qt->coarse = NULL;
+
+	if (enable)
+		qt->coarse = malloc(sizeof(*qt->coarse) * qt->npatches);
+}
 
-	patch_sample_normal(qt, p, i, j, &sv);
+/*
+   Normal map and colour tiles.  Visible patches without the tiles
+   they need are queued, and the worker threads make them from a
+   snapshot of the patch, sampling the generator on a grid one texel
+   bigger all round than the tile so every texel's normal can be
+   taken from the positions either side of it.  Finished tiles are
+   collected by the next update, which copies normal maps into their
+   patch's slot, and hands both kinds to the backend.
+ */
+#define MAX_TILE_THREADS	64
+
+struct tile_workers {
+	const struct quadtree *qt;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct tile_job *queue, **queue_tail;	/* to be made */
+	struct tile_job *done;		/* made, to be collected */
+	struct tile_job *spare;		/* unused jobs */
+	unsigned pending;		/* queued or being made */
+	unsigned generation;		/* of the colour atlas */
+	int quit;
+
+	int nthreads;
+	pthread_t threads[MAX_TILE_THREADS];
+};
 
-	elev = (*qt->generator)(&sv, vtx);
-	vec3_scale(&sv, qt->radius + elev);
+/*
+   The colour atlas.  A page is free, waiting for its tile to be
+   made, or holding the tile for the part of the terrain its key
+   names.  Free and full pages are on an LRU list, most recently
+   drawn first, and stamped with the last update they were drawn in;
+   waiting pages are on no list, so they can't be reused before
+   they're filled, and are stamped with the last update a visible
+   patch wanted them in, so they can be freed if none does.  The
+   page table hashes keys to pages, chained through the pages.
+ */
+enum page_state { PAGE_FREE, PAGE_WAITING, PAGE_FULL };
+
+struct atlas_page {
+	unsigned long key;
+	enum page_state state;
+	unsigned drawn;			/* update it was last drawn in, or 0 */
+	int next;			/* in the hash chain, or -1 */
+	struct list_head lru;
+};
 
-	vtx->x = sv.x;
-	vtx->y = sv.y;
-	vtx->z = sv.z;
-}
+struct colour_atlas {
+	unsigned npages;
+	unsigned update;		/* current update's stamp */
+	struct list_head lru;
+	unsigned hash_mask;
+	int *hash;			/* first page in each chain, or -1 */
+	struct atlas_page pages[];
+};
 
+#define TILE_GRID	(PATCH_TILE + 2)
 
-static void generate_geom(const struct quadtree *qt)
+/* Make job's normal map if normals is set, and its colour tile if
+   it has a page */
+static void make_tile(const struct quadtree *qt, struct tile_job *job, int normals)
 {
-	struct list_head *pp;
+	const struct patch *p = &job->extent;
+	float scale = (float)PATCH_SAMPLES / (PATCH_TILE - 1);
+	float spacing = (float)(p->i1 - p->i0) / (PATCH_SAMPLES * qt->radius) * scale;
+	vec3_t (*grid)[TILE_GRID] = malloc(sizeof(*grid) * TILE_GRID);
+
+	if (grid == NULL) {
+		memset(job->normals, 0, sizeof(job->normals));
+		memset(job->colour, 0, sizeof(job->colour));
+		return;
+	}
 
-	if (have_vbo)
-		glBindBuffer(GL_ARRAY_BUFFER, qt->vtxbufid);
+	/* a row at a time, so a batch generator gets them together */
+	for(int j = 0; j < TILE_GRID; j++) {
+		struct sample s[TILE_GRID];
+		struct vertex v[TILE_GRID], *vp[TILE_GRID];
+		elevation_t elev[TILE_GRID];
+
+		for(int i = 0; i < TILE_GRID; i++) {
+			patch_point_normal(qt, p, (i - 1) * scale, (j - 1) * scale,
+					   &s[i].normal);
+			s[i].spacing = spacing;
+			s[i].detail = spacing;
+			s[i].level = p->level;
+			s[i].coarse = NAN;
+			s[i].coarse_out = NULL;
+			memset(v[i].col, 255, sizeof(v[i].col));
+			vp[i] = &v[i];
+		}
 
-	list_for_each(pp, &qt->visible) {
-		struct patch *p = list_entry(pp, struct patch, list);
+		if (qt->batch_generator)
+			(*qt->batch_generator)(qt->batch_arg, s, TILE_GRID, elev, vp);
+		else
+			for(int i = 0; i < TILE_GRID; i++)
+				elev[i] = (*qt->generator)(&s[i], vp[i]);
 
-		if (USE_INDEX) {
-			/* with indexed drawing, stitching happens at
-			   render time */
-			p->flags &= ~PF_STITCH_GEOM;
+		for(int i = 0; i < TILE_GRID; i++) {
+			grid[j][i] = s[i].normal;
+			vec3_scale(&grid[j][i], qt->radius + elev[i]);
 		}
 
-		if ((p->flags & (PF_UPDATE_GEOM|PF_STITCH_GEOM)) == 0)
-			continue;
+		if (job->page >= 0 && j >= 1 && j <= PATCH_TILE)
+			for(int i = 0; i < PATCH_TILE; i++)
+				memcpy(job->colour[(j - 1) * PATCH_TILE + i], v[i + 1].col,
+				       sizeof(job->colour[0]));
+	}
 
-		p->flags &= ~(PF_UPDATE_GEOM|PF_STITCH_GEOM);
+	for(int j = 0; normals && j < PATCH_TILE; j++)
+		for(int i = 0; i < PATCH_TILE; i++) {
+			const vec3_t *c = &grid[j + 1][i + 1];
+			vec3_t di, dj, n;
 
-		struct vertex samples[MESH_SAMPLES * MESH_SAMPLES];
+			vec3_sub(&di, &grid[j + 1][i + 2], &grid[j + 1][i]);
+			vec3_sub(&dj, &grid[j + 2][i + 1], &grid[j][i + 1]);
+			vec3_cross(&n, &di, &dj);
+			vec3_normalize(&n);
 
-		for(int j = 0; j < MESH_SAMPLES; j++) {
-			for(int i = 0; i < MESH_SAMPLES; i++) {
-				struct vertex *v = &samples[j * MESH_SAMPLES + i];
+			/* the transposed faces wind the other way */
+			if (vec3_dot(&n, c) < 0)
+				vec3_scale(&n, -1);
 
-				compute_vertex(qt, p, i, j, v);
+			unsigned char *t = job->normals[j * PATCH_TILE + i];
 
-				if (ANNOTATE) {
-					if (i == 0) { /* left - red*/
-						v->col[0] = 255;
-						v->col[1] = 0;
-						v->col[2] = 0;
-						v->col[3] = 0;
-					} else if (i == MESH_SAMPLES-1) { /* right - green */
-						v->col[0] = 0;
-						v->col[1] = 255;
-						v->col[2] = 0;
-						v->col[3] = 0;
-					} else if (j == MESH_SAMPLES-1) { /* top - cyan */
-						v->col[0] = 0;
-						v->col[1] = 255;
-						v->col[2] = 255;
-						v->col[3] = 0;
-					} else if (j == 0) { /* bottom - yellow */
-						v->col[0] = 255;
-						v->col[1] = 255;
-						v->col[2] = 0;
-						v->col[3] = 0;
-					}
-				}
-			}
+			for(int k = 0; k < 3; k++)
+				t[k] = lrintf(n.v[k] * 127.5f + 127.5f);
+			t[3] = 255;
 		}
 
-		/* quick and dirty normals */
-		for(int j = 0; j < MESH_SAMPLES; j++) {
-			for(int i = 0; i < MESH_SAMPLES; i++) {
-				struct vertex *v = &samples[j * MESH_SAMPLES + i];
-				struct vertex *vn[4]; /* vertex neighbours */
-				struct vertex a, b;
-
-				if (i == 0) {
-					vn[0] = &a;
-					compute_vertex(qt, p, i-1, j, vn[0]);
-				} else
-					vn[0] = &samples[j * MESH_SAMPLES + (i - 1)];
+	free(grid);
+}
 
-				if (i == MESH_SAMPLES-1) {
-					vn[2] = &a;
-					compute_vertex(qt, p, i+1, j, vn[2]);
-				} else
-					vn[2] = &samples[j * MESH_SAMPLES + (i + 1)];
+static void *tile_worker(void *arg)
+{
+	struct tile_workers *w = arg;
 
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		while(!w->quit && w->queue == NULL)
+			pthread_cond_wait(&w->work, &w->lock);
+		if (w->quit)
+			break;
 
-				if (j == 0) {
-					vn[1] = &b;
-					compute_vertex(qt, p, i, j-1, vn[1]);
-				} else
-					vn[1] = &samples[(j - 1) * MESH_SAMPLES + i];
+		struct tile_job *job = w->queue;
+		int normals = job->p != NULL;
+
+		w->queue = job->next;
+		if (w->queue == NULL)
+			w->queue_tail = &w->queue;
+
+		/* skip normal maps cancelled while they were queued */
+		if (normals || job->page >= 0) {
+			pthread_mutex_unlock(&w->lock);
+			make_tile(w->qt, job, normals);
+			if (job->page >= 0 && w->qt->render->colour_blocks)
+				texcomp_encode(TEXCOMP_BC1, job->blocks, job->colour[0],
+					       PATCH_TILE, PATCH_TILE, 4, 1);
+			pthread_mutex_lock(&w->lock);
+		}
 
-				if (j == MESH_SAMPLES-1) {
-					vn[3] = &b;
-					compute_vertex(qt, p, i, j+1, vn[3]);
-				} else
-					vn[3] = &samples[(j + 1) * MESH_SAMPLES + i];
+		job->next = w->done;
+		w->done = job;
+	}
+	pthread_mutex_unlock(&w->lock);
 
-				vec3_t norm = VEC3(0,0,0);
+	return NULL;
+}
 
-				for(unsigned x = 0; x < 3; x++) {
-					int nx = (x + 1) % 4;
-					vec3_t v1 = VEC3(vn[x]->x - v->x, 
-							 vn[x]->y - v->y, 
-							 vn[x]->z - v->z);
-					vec3_t v2 = VEC3(vn[nx]->x - v->x, 
-							 vn[nx]->y - v->y, 
-							 vn[nx]->z - v->z);
-					vec3_t cross;
+static void free_jobs(struct tile_job *job)
+{
+	while(job) {
+		struct tile_job *next = job->next;
+
+		free(job);
+		job = next;
+	}
+}
+
+static void stop_workers(struct quadtree *qt)
+{
+	struct tile_workers *w = qt->workers;
+
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+
+	for(int i = 0; i < w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	free_jobs(w->queue);
+	free_jobs(w->done);
+	free_jobs(w->spare);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work);
+	free(w);
+
+	for(int i = 0; i < qt->npatches; i++)
+		qt->patches[i].tile_job = NULL;
+
+	qt->workers = NULL;
+	qt->tiles_pending = 0;
+}
+
+static int start_workers(struct quadtree *qt, int threads)
+{
+	if (qt->workers)
+		return 1;
+
+	struct tile_workers *w = malloc(sizeof(*w));
+
+	if (w == NULL)
+		return 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_TILE_THREADS)
+		threads = MAX_TILE_THREADS;
+
+	w->qt = qt;
+	w->queue = NULL;
+	w->queue_tail = &w->queue;
+	w->done = NULL;
+	w->spare = NULL;
+	w->pending = 0;
+	w->generation = 0;
+	w->quit = 0;
+	w->nthreads = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+
+	qt->workers = w;
+
+	for(int i = 0; i < threads; i++) {
+		if (pthread_create(&w->threads[i], NULL, tile_worker, w) != 0) {
+			stop_workers(qt);
+			return 0;
+		}
+		w->nthreads++;
+	}
+
+	return 1;
+}
+
+/* The workers look at job->p when they take a job, so it's only
+   changed with the lock held */
+static void cancel_tile(struct quadtree *qt, struct patch *p)
+{
+	pthread_mutex_lock(&qt->workers->lock);
+	p->tile_job->p = NULL;
+	pthread_mutex_unlock(&qt->workers->lock);
+
+	p->tile_job = NULL;
+}
+
+int quadtree_normal_maps(struct quadtree *qt, int enable, int threads)
+{
+	if (qt->normal_tiles) {
+		for(int i = 0; i < qt->npatches; i++) {
+			struct patch *p = &qt->patches[i];
+
+			p->flags &= ~PF_NORMALS;
+			if (p->tile_job)
+				cancel_tile(qt, p);
+		}
+
+		free(qt->normal_tiles);
+		qt->normal_tiles = NULL;
+	}
+
+	int ok = 1;
+
+	if (enable) {
+		qt->normal_tiles = malloc(sizeof(*qt->normal_tiles) * qt->npatches);
+		if (qt->normal_tiles == NULL || !start_workers(qt, threads)) {
+			free(qt->normal_tiles);
+			qt->normal_tiles = NULL;
+			ok = 0;
+		}
+	}
+
+	if (qt->workers && qt->normal_tiles == NULL && qt->atlas == NULL)
+		stop_workers(qt);
+
+	return ok;
+}
+
+int quadtree_colour_tiles(struct quadtree *qt, int pages, int threads)
+{
+	struct colour_atlas *at = qt->atlas;
+
+	if (at) {
+		for(int i = 0; i < qt->npatches; i++)
+			qt->patches[i].flags &= ~PF_COLOUR;
+
+		/* tiles still being made are for this atlas */
+		pthread_mutex_lock(&qt->workers->lock);
+		qt->workers->generation++;
+		pthread_mutex_unlock(&qt->workers->lock);
+
+		free(at->hash);
+		free(at);
+		qt->atlas = NULL;
+	}
+
+	int ok = 1;
+
+	if (pages > 0) {
+		unsigned hsize = 1;
+
+		while(hsize < (unsigned)pages)
+			hsize *= 2;
+
+		at = malloc(sizeof(*at) + sizeof(at->pages[0]) * pages);
+		if (at)
+			at->hash = malloc(sizeof(*at->hash) * hsize);
+
+		if (at == NULL || at->hash == NULL || !start_workers(qt, threads)) {
+			if (at)
+				free(at->hash);
+			free(at);
+			ok = 0;
+		} else {
+			at->npages = pages;
+			at->update = 0;
+			at->hash_mask = hsize - 1;
+			INIT_LIST_HEAD(&at->lru);
+
+			for(unsigned i = 0; i < hsize; i++)
+				at->hash[i] = -1;
+
+			for(int i = 0; i < pages; i++) {
+				struct atlas_page *pg = &at->pages[i];
+
+				pg->state = PAGE_FREE;
+				pg->drawn = 0;
+				list_add_tail(&pg->lru, &at->lru);
+			}
+
+			qt->atlas = at;
+		}
+	}
+
+	if (qt->workers && qt->normal_tiles == NULL && qt->atlas == NULL)
+		stop_workers(qt);
+
+	return ok;
+}
+
+/* A page key for the part of the terrain p covers */
+static inline unsigned long page_key(const struct patch *p)
+{
+	return (unsigned long)p->id << 5 | p->level;
+}
+
+static inline unsigned page_hash(const struct colour_atlas *at, unsigned long key)
+{
+	return (key * 0x9e3779b97f4a7c15ull >> 32) & at->hash_mask;
+}
+
+static int find_page(const struct colour_atlas *at, unsigned long key)
+{
+	int i;
+
+	for(i = at->hash[page_hash(at, key)]; i != -1; i = at->pages[i].next)
+		if (at->pages[i].key == key)
+			break;
+
+	return i;
+}
+
+static void unhash_page(struct colour_atlas *at, int page)
+{
+	int *link = &at->hash[page_hash(at, at->pages[page].key)];
+
+	while(*link != page)
+		link = &at->pages[*link].next;
+	*link = at->pages[page].next;
+}
+
+static void draw_page(struct colour_atlas *at, int page)
+{
+	struct atlas_page *pg = &at->pages[page];
+
+	pg->drawn = at->update;
+	list_move(&pg->lru, &at->lru);
+}
+
+/* Give visible patch p its colour tile, if it's been made */
+static void find_colour(struct quadtree *qt, struct patch *p)
+{
+	struct colour_atlas *at = qt->atlas;
+	int page = find_page(at, page_key(p));
+
+	if (page == -1)
+		return;
+
+	/* still wanted */
+	if (at->pages[page].state == PAGE_WAITING) {
+		at->pages[page].drawn = at->update;
+		return;
+	}
+
+	/* it's been drawn before by a patch now gone */
+	if (at->pages[page].drawn)
+		qt->pages_reused++;
+	p->page = page;
+	p->flags |= PF_COLOUR;
+	draw_page(at, page);
+}
+
+/*
+   Take the least recently drawn page for visible patch p, which has
+   no colour tile, and return it so the caller can have the tile
+   made.  Returns -1 if it's already being made, or if every page
+   has been drawn this update.
+ */
+static int colour_page(struct quadtree *qt, struct patch *p)
+{
+	struct colour_atlas *at = qt->atlas;
+	unsigned long key = page_key(p);
+	int page;
+
+	if (find_page(at, key) != -1)
+		return -1;
+
+	struct atlas_page *pg = list_entry(at->lru.prev, struct atlas_page, lru);
+
+	/* everything's in use */
+	if (list_empty(&at->lru) || pg->drawn == at->update)
+		return -1;
+
+	page = pg - at->pages;
+	if (pg->state == PAGE_FULL)
+		unhash_page(at, page);
+
+	pg->key = key;
+	pg->state = PAGE_WAITING;
+	pg->next = at->hash[page_hash(at, key)];
+	at->hash[page_hash(at, key)] = page;
+	list_del(&pg->lru);
+
+	return page;
+}
+
+static void swap_tiles(struct quadtree *qt, struct patch *a, struct patch *b)
+{
+	patch_tile_t *tiles = qt->normal_tiles;
+	int ai = a - qt->patches, bi = b - qt->patches;
+	patch_tile_t tmp;
+	struct render *r = qt->render;
+
+	if (a->tile_job || b->tile_job) {
+		pthread_mutex_lock(&qt->workers->lock);
+		if (a->tile_job)
+			a->tile_job->p = a;
+		if (b->tile_job)
+			b->tile_job->p = b;
+		pthread_mutex_unlock(&qt->workers->lock);
+	}
+
+	if (tiles == NULL)
+		return;
+
+	memcpy(tmp, tiles[ai], sizeof(tmp));
+	memcpy(tiles[ai], tiles[bi], sizeof(tmp));
+	memcpy(tiles[bi], tmp, sizeof(tmp));
+
+	if (r->backend->normals == NULL)
+		return;
+
+	if (a->flags & PF_NORMALS)
+		r->backend->normals(r, a->vertex_offset, tiles[ai]);
+	if (b->flags & PF_NORMALS)
+		r->backend->normals(r, b->vertex_offset, tiles[bi]);
+}
+
+/* Hand the finished tiles to their patches and pages */
+static unsigned collect_tiles(struct quadtree *qt)
+{
+	struct tile_workers *w = qt->workers;
+	struct colour_atlas *at = qt->atlas;
+	struct render *r = qt->render;
+	struct tile_job *done;
+	unsigned generation, made = 0;
+
+	pthread_mutex_lock(&w->lock);
+	done = w->done;
+	w->done = NULL;
+	generation = w->generation;
+	pthread_mutex_unlock(&w->lock);
+
+	while(done) {
+		struct tile_job *job = done;
+		struct patch *p = job->p;
+
+		done = job->next;
+		w->pending--;
+
+		if (p && qt->normal_tiles) {
+			int slot = p - qt->patches;
+
+			memcpy(qt->normal_tiles[slot], job->normals, sizeof(job->normals));
+			p->flags |= PF_NORMALS;
+			p->tile_job = NULL;
+			if (r->backend->normals)
+				r->backend->normals(r, p->vertex_offset, qt->normal_tiles[slot]);
+			made++;
+		}
+
+		if (job->page >= 0 && job->generation == generation && at) {
+			struct atlas_page *pg = &at->pages[job->page];
+
+			pg->state = PAGE_FULL;
+			pg->drawn = 0;
+			list_add(&pg->lru, &at->lru);
+			if (r->backend->colour)
+				r->backend->colour(r, job->page, at->npages,
+						   r->colour_blocks ? (void *)job->blocks : job->colour);
+			made++;
+		}
+
+		job->next = w->spare;
+		w->spare = job;
+	}
+
+	return made;
+}
+
+static int tile_job_cmp(const void *a, const void *b)
+{
+	const struct tile_job *ja = *(const struct tile_job **)a;
+	const struct tile_job *jb = *(const struct tile_job **)b;
+
+	return (ja->key > jb->key) - (ja->key < jb->key);
+}
+
+/* Take back the jobs no worker has started.  Normal maps for patches
+   which are no longer visible are dropped, as are colour tiles no
+   visible patch wanted this update, whose pages go back on the LRU
+   list to be taken first.  Jobs with nothing left to make go back to
+   the spare list, and the rest are given their distance from pos, to
+   be queued again with the new ones nearest first.  Returns the
+   number kept, appending them to *tail. */
+static unsigned requeue_tiles(struct quadtree *qt, const vec3_t *pos,
+			      struct tile_job ***tail)
+{
+	struct tile_workers *w = qt->workers;
+	struct colour_atlas *at = qt->atlas;
+	struct tile_job *job, *next;
+	unsigned kept = 0;
+
+	pthread_mutex_lock(&w->lock);
+	job = w->queue;
+	w->queue = NULL;
+	w->queue_tail = &w->queue;
+
+	for(; job; job = next) {
+		next = job->next;
+
+		if (job->p && (job->p->flags & PF_CULLED)) {
+			job->p->tile_job = NULL;
+			job->p = NULL;
+			qt->tiles_cancelled++;
+		}
+
+		/* the page is for an atlas since replaced */
+		if (job->page >= 0 && job->generation != w->generation)
+			job->page = -1;
+
+		if (job->page >= 0 && at->pages[job->page].drawn != at->update) {
+			struct atlas_page *pg = &at->pages[job->page];
+
+			unhash_page(at, job->page);
+			pg->state = PAGE_FREE;
+			pg->drawn = 0;
+			list_add_tail(&pg->lru, &at->lru);
+			job->page = -1;
+			qt->tiles_cancelled++;
+		}
+
+		if (job->p == NULL && job->page < 0) {
+			job->next = w->spare;
+			w->spare = job;
+			w->pending--;
+			continue;
+		}
+
+		job->key = distance_key(&job->extent, pos);
+		job->next = NULL;
+		**tail = job;
+		*tail = &job->next;
+		kept++;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return kept;
+}
+
+/* Collect the finished tiles, and queue tiles for the visible
+   patches which need them, nearest to camerapos first */
+static void update_tiles(struct quadtree *qt, const vec3_t *camerapos)
+{
+	struct tile_workers *w = qt->workers;
+	struct colour_atlas *at = qt->atlas;
+	struct tile_job *queue = NULL, **tail = &queue;
+	unsigned queued = 0;
+	struct list_head *pp;
+
+	qt->tiles_made = collect_tiles(qt);
+	qt->tiles_cancelled = 0;
+	qt->pages_reused = 0;
+
+	/* Mark the pages visible patches have as drawn first, so
+	   none of them is taken for another patch below */
+	if (at) {
+		at->update++;
+
+		list_for_each(pp, &qt->visible) {
+			struct patch *p = list_entry(pp, struct patch, list);
+
+			if (p->flags & PF_COLOUR) {
+				const struct atlas_page *pg = &at->pages[p->page];
+
+				/* the page may have been reused while p
+				   wasn't visible */
+				if (pg->state == PAGE_FULL && pg->key == page_key(p)) {
+					draw_page(at, p->page);
+					continue;
+				}
+				p->flags &= ~PF_COLOUR;
+			}
+			find_colour(qt, p);
+		}
+	}
+
+	unsigned kept = requeue_tiles(qt, camerapos, &tail);
+
+	list_for_each(pp, &qt->visible) {
+		struct patch *p = list_entry(pp, struct patch, list);
+		int normals = qt->normal_tiles && !(p->flags & PF_NORMALS) && !p->tile_job;
+		int page = -1;
+		struct tile_job *job;
+
+		if (at && !(p->flags & PF_COLOUR))
+			page = colour_page(qt, p);
+
+		if (!normals && page < 0)
+			continue;
+
+		job = w->spare;
+		if (job)
+			w->spare = job->next;
+		else if ((job = malloc(sizeof(*job))) == NULL) {
+			/* let it be taken again */
+			if (page >= 0) {
+				unhash_page(at, page);
+				at->pages[page].state = PAGE_FREE;
+				list_add_tail(&at->pages[page].lru, &at->lru);
+			}
+			break;
+		}
+
+		job->p = normals ? p : NULL;
+		job->extent = *p;
+		job->page = page;
+		job->generation = w->generation;
+		job->key = distance_key(p, camerapos);
+		job->next = NULL;
+		if (normals)
+			p->tile_job = job;
+
+		*tail = job;
+		tail = &job->next;
+		queued++;
+	}
+
+	w->pending += queued;
+
+	if (queue) {
+		unsigned n = kept + queued;
+		struct tile_job **order = malloc(sizeof(*order) * n);
+
+		/* without room to sort, they go in as they are */
+		if (order) {
+			struct tile_job *job = queue;
+
+			for(unsigned k = 0; k < n; k++, job = job->next)
+				order[k] = job;
+			qsort(order, n, sizeof(*order), tile_job_cmp);
+
+			tail = &queue;
+			for(unsigned k = 0; k < n; k++) {
+				*tail = order[k];
+				tail = &order[k]->next;
+			}
+			*tail = NULL;
+			free(order);
+		}
+
+		/* a worker may have finished its job and found the
+		   queue empty meanwhile, but none can have added to it */
+		pthread_mutex_lock(&w->lock);
+		*tail = w->queue;
+		w->queue = queue;
+		if (*tail == NULL)
+			w->queue_tail = tail;
+		pthread_cond_broadcast(&w->work);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	qt->tiles_pending = w->pending;
+}
+
+/*
+   Edge detail.  A generator which drops detail by sample spacing
+   would give a sample shared by patches of different levels a
+   different height in each, opening a crack between them.  So a
+   sample on p's edge gets the spacing of the coarsest patch sharing
+   it: along an edge that's the neighbour across it if that's
+   coarser, and at a corner it may be a patch which only meets p
+   there, up to two levels coarser.  edge_detail() sums this up as
+   p's neighbour_class(), which says which edges have a coarser
+   neighbour, and 2 bits per corner of how many levels coarser it is.
+ */
+
+/* p's corner samples, anticlockwise from (0,0) */
+static const signed char corner_samples[4][2] = {
+	{ 0, 0 },
+	{ PATCH_SAMPLES, 0 },
+	{ PATCH_SAMPLES, PATCH_SAMPLES },
+	{ 0, PATCH_SAMPLES },
+};
+
+/* The point of the cube at sample i,j of p, before
+   patch_sample_normal() projects it onto the sphere.  It's exact,
+   so patches can compare their samples. */
+static void patch_cube_point(const struct quadtree *qt, const struct patch *p,
+			     int si, int sj, long c[3])
+{
+	int a[3] = { p->face->x, p->face->y, p->face->z };
+	long radius = qt->radius;
+
+	if (patch_flip(p->face)) {
+		int t = si;
+		si = sj;
+		sj = t;
+
+		for(int k = 0; k < 3; k++)
+			a[k] = abs(a[k]);
+		radius = -radius;
+	}
+
+	long i = p->i0 + (p->i1 - p->i0) * si / PATCH_SAMPLES;
+	long j = p->j0 + (p->j1 - p->j0) * sj / PATCH_SAMPLES;
+
+	/* i runs along a's components rotated to (z, x, y), and j
+	   along (y, z, x) */
+	for(int k = 0; k < 3; k++)
+		c[k] = a[k] * radius + a[(k + 2) % 3] * i + a[(k + 1) % 3] * j;
+}
+
+/* Whether cube point c is on q.  If it's one of q's samples, *si and
+   *sj are set to it, otherwise to -1. */
+static int patch_touches(const struct quadtree *qt, const struct patch *q,
+			 const long c[3], int *si, int *sj)
+{
+	int a[3] = { q->face->x, q->face->y, q->face->z };
+	long radius = qt->radius;
+	int flip = patch_flip(q->face);
+
+	if (flip) {
+		for(int k = 0; k < 3; k++)
+			a[k] = abs(a[k]);
+		radius = -radius;
+	}
+
+	long f = 0, i = 0, j = 0;
+
+	for(int k = 0; k < 3; k++) {
+		f += c[k] * a[k];
+		i += c[k] * a[(k + 2) % 3];
+		j += c[k] * a[(k + 1) % 3];
+	}
+
+	if (f != radius || i < q->i0 || i > q->i1 || j < q->j0 || j > q->j1)
+		return 0;
+
+	long di = (i - q->i0) * PATCH_SAMPLES;
+	long dj = (j - q->j0) * PATCH_SAMPLES;
+
+	*si = *sj = -1;
+	if (di % (q->i1 - q->i0) == 0 && dj % (q->j1 - q->j0) == 0) {
+		*si = di / (q->i1 - q->i0);
+		*sj = dj / (q->j1 - q->j0);
+
+		if (flip) {
+			int t = *si;
+			*si = *sj;
+			*sj = t;
+		}
+	}
+
+	return 1;
+}
+
+/* The most patches edge_patches() can find */
+#define MAX_EDGE_PATCHES	(8 + 8 * 8)
+
+/* The patches other than p which might share its edge samples, or
+   only those coarser than p if coarser is set: its neighbours and
+   theirs, which include any meeting p only at a corner */
+static unsigned edge_patches(const struct patch *p, int coarser,
+			     const struct patch *out[MAX_EDGE_PATCHES])
+{
+	unsigned n = 0;
+
+	for(int d = 0; d < 8; d++) {
+		const struct patch *np = p->neigh[d];
+
+		if (np == NULL)
+			continue;
+
+		for(int e = -1; e < 8; e++) {
+			const struct patch *q = e < 0 ? np : np->neigh[e];
+			unsigned k;
+
+			if (q == NULL || q == p || (coarser && q->level >= p->level))
+				continue;
+
+			for(k = 0; k < n && out[k] != q; k++)
+				;
+			if (k == n)
+				out[n++] = q;
+		}
+	}
+
+	return n;
+}
+
+/* The edge detail p's samples should be generated with */
+static unsigned edge_detail(const struct quadtree *qt, const struct patch *p)
+{
+	const struct patch *q[MAX_EDGE_PATCHES];
+	unsigned n = edge_patches(p, 1, q);
+
+	if (n == 0)
+		return 0;
+
+	unsigned edges = neighbour_class(p);
+
+	for(int k = 0; k < 4; k++) {
+		int coarsest = p->level;
+		long c[3];
+
+		patch_cube_point(qt, p, corner_samples[k][0], corner_samples[k][1], c);
+
+		for(unsigned m = 0; m < n; m++) {
+			int si, sj;
+
+			if (q[m]->level < coarsest && patch_touches(qt, q[m], c, &si, &sj))
+				coarsest = q[m]->level;
+		}
+
+		assert(p->level - coarsest <= 2);
+		edges |= (p->level - coarsest) << (4 + 2 * k);
+	}
+
+	return edges;
+}
+
+/* How many levels coarser than p the patch whose spacing sample i,j
+   gets is, according to p->edges */
+static int sample_coarser(const struct patch *p, int i, int j)
+{
+	unsigned lr = (p->edges & 15) % 3;
+	unsigned ud = (p->edges & 15) / 3;
+
+	if (i < 0 || i > PATCH_SAMPLES || j < 0 || j > PATCH_SAMPLES)
+		return 0;
+
+	for(int k = 0; k < 4; k++)
+		if (i == corner_samples[k][0] && j == corner_samples[k][1])
+			return (p->edges >> (4 + 2 * k)) & 3;
+
+	/* see genpatchidx.c for the neighbour_class() bits */
+	return (i == 0 && (lr & 2)) || (i == PATCH_SAMPLES && (lr & 1)) ||
+		(j == 0 && (ud & 1)) || (j == PATCH_SAMPLES && (ud & 2));
+}
+
+/* Interpolate the parent's cached value for sample i,j of p; NAN if
+   the parent has no valid cache entry.  Children are generated at
+   twice the parent's resolution, so each child sample either lands
+   on a parent sample or midway between 2 or 4 of them. */
+static float coarse_sample(const struct quadtree *qt, const struct patch *p,
+			   int i, int j)
+{
+	const struct patch *parent = p->parent;
+
+	if (parent == NULL || (parent->flags & PF_COARSE) == 0 ||
+	    i < 0 || i >= MESH_SAMPLES || j < 0 || j >= MESH_SAMPLES)
+		return NAN;
+
+	const float *c = qt->coarse[parent - qt->patches];
+	enum patch_sibling sib = siblingid(p);
+	int ox = siblings[sib].sx;
+	int oy = siblings[sib].sy;
+
+	if (patch_flip(p->face)) {
+		/* patch_sample_normal() transposes i&j for -ve faces */
+		int t = ox;
+		ox = oy;
+		oy = t;
+	}
+
+	int x = ox * PATCH_SAMPLES + i;
+	int y = oy * PATCH_SAMPLES + j;
+	int x0 = x / 2, x1 = (x + 1) / 2;
+	int y0 = y / 2, y1 = (y + 1) / 2;
+
+	return (c[y0 * MESH_SAMPLES + x0] + c[y0 * MESH_SAMPLES + x1] +
+		c[y1 * MESH_SAMPLES + x0] + c[y1 * MESH_SAMPLES + x1]) * .25f;
+}
+
+/* Set up sample i,j of p, apart from its octave cache output */
+static void prepare_sample(const struct quadtree *qt, const struct patch *p,
+			   int i, int j, struct sample *s)
+{
+	patch_sample_normal(qt, p, i, j, &s->normal);
+	s->spacing = patch_spacing(qt, p);
+	s->detail = ldexpf(s->spacing, sample_coarser(p, i, j));
+	s->level = p->level;
+
+	/* p's edge samples are shared with other patches, whose
+	   parents would interpolate them differently, so they have to
+	   be generated in full */
+	s->coarse = NAN;
+	s->coarse_out = NULL;
+	if (qt->coarse && i > 0 && i < PATCH_SAMPLES && j > 0 && j < PATCH_SAMPLES)
+		s->coarse = coarse_sample(qt, p, i, j);
+}
+
+/* Set up sample i,j of p, and the parts of its vertex which don't
+   depend on elevation */
+static void prepare_vertex(const struct quadtree *qt, const struct patch *p,
+			   int i, int j, struct sample *s, struct vertex *vtx)
+{
+	vtx->s = i;
+	vtx->t = PATCH_SAMPLES - j;
+
+	vtx->col[0] = 255;
+	vtx->col[1] = 255;
+	vtx->col[2] = 255;
+	vtx->col[3] = 255;
+
+	prepare_sample(qt, p, i, j, s);
+
+	if (qt->coarse && i >= 0 && i < MESH_SAMPLES && j >= 0 && j < MESH_SAMPLES) {
+		s->coarse_out = &qt->coarse[p - qt->patches][j * MESH_SAMPLES + i];
+
+		/* so a generator which doesn't store one leaves the
+		   children with none, rather than garbage */
+		*s->coarse_out = NAN;
+	}
+}
+
+/* Generate the n samples of p at ij[], into vtx[] */
+static void compute_vertices(const struct quadtree *qt, const struct patch *p,
+			     const signed char (*ij)[2], unsigned n,
+			     struct vertex **vtx)
+{
+	struct sample s[n];
+	elevation_t elev[n];
+
+	for(unsigned k = 0; k < n; k++)
+		prepare_vertex(qt, p, ij[k][0], ij[k][1], &s[k], vtx[k]);
+
+	if (qt->batch_generator)
+		(*qt->batch_generator)(qt->batch_arg, s, n, elev, vtx);
+	else
+		for(unsigned k = 0; k < n; k++)
+			elev[k] = (*qt->generator)(&s[k], vtx[k]);
+
+	for(unsigned k = 0; k < n; k++) {
+		vec3_t sv = s[k].normal;
+
+		vec3_scale(&sv, qt->radius + elev[k]);
+
+		vtx[k]->x = sv.x;
+		vtx[k]->y = sv.y;
+		vtx[k]->z = sv.z;
+	}
+}
+
+/* Samples just outside each edge of the mesh, needed for normals */
+enum border {
+	BORDER_LEFT,
+	BORDER_RIGHT,
+	BORDER_DOWN,
+	BORDER_UP,
+};
+
+#define BORDER_SAMPLES	(4 * MESH_SAMPLES)
+#define GEN_SAMPLES	(MESH_SAMPLES * MESH_SAMPLES + BORDER_SAMPLES)
+
+/* Hang p's skirt below its edge samples.  The skirt has to reach
+   down past any crack against a coarser neighbour, which only has
+   every other one of our edge samples, so it's made twice as deep as
+   the largest difference between an edge sample and the midpoint of
+   its neighbours.  A tenth of the sample spacing is added for the
+   curvature of the sphere between samples. */
+static void make_skirt(const struct quadtree *qt, const struct patch *p,
+		       struct vertex *samples)
+{
+	struct vertex *skirt = &samples[MESH_SAMPLES * MESH_SAMPLES];
+	float r[SKIRT_SAMPLES];
+	float depth = 0;
+
+	for(int k = 0; k < SKIRT_SAMPLES; k++) {
+		int i, j;
+
+		skirt_edge(k, &i, &j);
+		skirt[k] = samples[j * MESH_SAMPLES + i];
+
+		vec3_t pos = VEC3(skirt[k].x, skirt[k].y, skirt[k].z);
+		r[k] = vec3_magnitude(&pos);
+	}
+
+	for(int k = 0; k < SKIRT_SAMPLES; k++) {
+		float mid = (r[(k + SKIRT_SAMPLES - 1) % SKIRT_SAMPLES] +
+			     r[(k + 1) % SKIRT_SAMPLES]) * .5f;
+
+		if (fabsf(r[k] - mid) > depth)
+			depth = fabsf(r[k] - mid);
+	}
+
+	depth = depth * 2 + patch_spacing(qt, p) * qt->radius * .1f;
+
+	for(int k = 0; k < SKIRT_SAMPLES; k++) {
+		float f = (r[k] - depth) / r[k];
+
+		skirt[k].x *= f;
+		skirt[k].y *= f;
+		skirt[k].z *= f;
+	}
+}
+
+/* Convert p's mesh into the form it's rendered from.  Compact
+   vertices are quantised to 16 bits on a grid whose step is a power
+   of two set by the patch's level, 8192 to 16384 steps across the
+   patch.  Patches sharing a vertex must put it in exactly the same
+   place, so each vertex is rounded to the grid of the coarsest patch
+   sharing it (see sample_coarser()), whose points are also points of
+   the finer grids.  p's origin and scale undo the quantisation.
+
+   The origin is the nearest point to p of a lattice 2^15 steps
+   apart, which a float holds exactly, so nearby patches of a level
+   share an origin and scale, their frame, and are drawn with one
+   transform (see frame_draws()).  A patch is at most 2^14 steps
+   across, which leaves about as much again for relief. */
+static void pack_vertices(struct quadtree *qt, struct patch *p,
+			  const struct vertex *v, struct glvertex *out)
+{
+#if COMPACT_VERTEX
+	vec3_t min = VEC3(v[0].x, v[0].y, v[0].z);
+	vec3_t max = min;
+
+	for(int k = 1; k < MESH_VERTICES; k++) {
+		const GLfloat *pos = &v[k].x;
+
+		for(int a = 0; a < 3; a++) {
+			if (pos[a] < min.v[a])
+				min.v[a] = pos[a];
+			if (pos[a] > max.v[a])
+				max.v[a] = pos[a];
+		}
+	}
+
+	int mag = ilogb(2. * qt->radius);
+	int e = mag - p->level - 13;
+	int fits;
+
+	do {
+		double step = ldexp(1, e);
+		/* below this a float can't hold every lattice point */
+		double unit = fmax(ldexp(step, 15), ldexp(1, mag - 23));
+		double origin[3];
+
+		for(int a = 0; a < 3; a++)
+			origin[a] = rint((min.v[a] + max.v[a]) * .5 / unit) * unit;
+
+		fits = 1;
+		for(int k = 0; k < MESH_VERTICES && fits; k++) {
+			int d = 0;
+
+			if (k < MESH_SAMPLES * MESH_SAMPLES)
+				d = sample_coarser(p, k % MESH_SAMPLES, k / MESH_SAMPLES);
+
+			double grid = ldexp(step, d);
+			const GLfloat *pos = &v[k].x;
+			GLshort *q = &out[k].x;
+
+			for(int a = 0; a < 3; a++) {
+				double g = (rint(pos[a] / grid) * grid - origin[a]) / step;
+
+				if (fabs(g) > 32767)
+					fits = 0;
+				else
+					q[a] = g;
+			}
+		}
+
+		/* A patch with too much relief for its level gets a
+		   coarser grid, and may not quite meet its
+		   neighbours */
+		if (!fits)
+			e++;
+
+		vec3_t o = VEC3(origin[0], origin[1], origin[2]);
+
+		/* the draw list's frames have changed */
+		if (fits && (p->scale != step || memcmp(&p->origin, &o, sizeof(o)) != 0))
+			qt->draws_dirty = 1;
+
+		p->origin = o;
+		p->scale = step;
+	} while(!fits);
+
+	for(int k = 0; k < MESH_VERTICES; k++) {
+		out[k].nx = v[k].nx;
+		out[k].ny = v[k].ny;
+		out[k].nz = v[k].nz;
+		memcpy(out[k].col, v[k].col, sizeof(out[k].col));
+	}
+#else
+	p->origin = VEC3(0, 0, 0);
+	p->scale = 1;
+	memcpy(out, v, sizeof(*out) * MESH_VERTICES);
+#endif
+}
+
+static int vertex_offset_cmp(const void *a, const void *b)
+{
+	const struct patch *pa = *(const struct patch **)a;
+	const struct patch *pb = *(const struct patch **)b;
+
+	return (pa->vertex_offset > pb->vertex_offset) - (pa->vertex_offset < pb->vertex_offset);
+}
+
+static void generate_geom(struct quadtree *qt)
+{
+	struct list_head *pp;
+	struct patch *dirty[qt->npatches];
+	unsigned ndirty = 0;
+	struct render *r = qt->render;
+
+	list_for_each(pp, &qt->visible) {
+		struct patch *p = list_entry(pp, struct patch, list);
+
+		if (USE_INDEX) {
+			/* with indexed drawing, stitching happens at
+			   render time */
+			p->flags &= ~PF_STITCH_GEOM;
+		}
+
+		/* the levels of the patches around p decide the detail
+		   of its edges, so it's regenerated when they change;
+		   one meeting it only at a corner doesn't mark it for
+		   stitching */
+		unsigned edges = edge_detail(qt, p);
+
+		if (edges != p->edges) {
+			p->edges = edges;
+			p->flags |= PF_UPDATE_GEOM;
+		}
+
+		if ((p->flags & (PF_UPDATE_GEOM|PF_STITCH_GEOM)) == 0)
+			continue;
+
+		dirty[ndirty++] = p;
+	}
+
+	if (ndirty == 0)
+		return;
+
+	/* in vertex buffer order, so patches which are next to each
+	   other there can be uploaded together */
+	qsort(dirty, ndirty, sizeof(*dirty), vertex_offset_cmp);
+
+	r->backend->upload_begin(r);
+
+	for(unsigned d = 0; d < ndirty; d++) {
+		struct patch *p = dirty[d];
+
+		/* a patch with vertices to draw meanwhile can wait for
+		   the backend, staying dirty until it's taken */
+		struct glvertex *out = r->backend->upload(r, p->vertex_offset,
+							  (p->flags & PF_UPLOADED) != 0);
+
+		if (out == NULL)
+			continue;
+
+		p->flags &= ~(PF_UPDATE_GEOM|PF_STITCH_GEOM|PF_COARSE);
+		p->flags |= PF_UPLOADED;
+
+		struct vertex samples[MESH_VERTICES];
+		struct vertex border[4][MESH_SAMPLES];
+		signed char ij[GEN_SAMPLES][2];
+		struct vertex *vtx[GEN_SAMPLES];
+		unsigned n = 0;
+
+		/* the whole mesh plus its border is generated in one
+		   go, so a batch generator gets a patch at a time */
+		for(int j = 0; j < MESH_SAMPLES; j++)
+			for(int i = 0; i < MESH_SAMPLES; i++) {
+				ij[n][0] = i;
+				ij[n][1] = j;
+				vtx[n++] = &samples[j * MESH_SAMPLES + i];
+			}
+
+		for(int k = 0; k < MESH_SAMPLES; k++) {
+			ij[n][0] = -1;
+			ij[n][1] = k;
+			vtx[n++] = &border[BORDER_LEFT][k];
+
+			ij[n][0] = MESH_SAMPLES;
+			ij[n][1] = k;
+			vtx[n++] = &border[BORDER_RIGHT][k];
+
+			ij[n][0] = k;
+			ij[n][1] = -1;
+			vtx[n++] = &border[BORDER_DOWN][k];
+
+			ij[n][0] = k;
+			ij[n][1] = MESH_SAMPLES;
+			vtx[n++] = &border[BORDER_UP][k];
+		}
+		assert(n == GEN_SAMPLES);
+
+		compute_vertices(qt, p, (const signed char (*)[2])ij, n, vtx);
+
+		if (qt->coarse)
+			p->flags |= PF_COARSE;
+
+		if (ANNOTATE) {
+			for(int j = 0; j < MESH_SAMPLES; j++) {
+				for(int i = 0; i < MESH_SAMPLES; i++) {
+					struct vertex *v = &samples[j * MESH_SAMPLES + i];
+
+					if (i == 0) { /* left - red*/
+						v->col[0] = 255;
+						v->col[1] = 0;
+						v->col[2] = 0;
+						v->col[3] = 0;
+					} else if (i == MESH_SAMPLES-1) { /* right - green */
+						v->col[0] = 0;
+						v->col[1] = 255;
+						v->col[2] = 0;
+						v->col[3] = 0;
+					} else if (j == MESH_SAMPLES-1) { /* top - cyan */
+						v->col[0] = 0;
+						v->col[1] = 255;
+						v->col[2] = 255;
+						v->col[3] = 0;
+					} else if (j == 0) { /* bottom - yellow */
+						v->col[0] = 255;
+						v->col[1] = 255;
+						v->col[2] = 0;
+						v->col[3] = 0;
+					}
+				}
+			}
+		}
+
+		/* quick and dirty normals */
+		for(int j = 0; j < MESH_SAMPLES; j++) {
+			for(int i = 0; i < MESH_SAMPLES; i++) {
+				struct vertex *v = &samples[j * MESH_SAMPLES + i];
+				struct vertex *vn[4]; /* vertex neighbours */
+
+				if (i == 0)
+					vn[0] = &border[BORDER_LEFT][j];
+				else
+					vn[0] = &samples[j * MESH_SAMPLES + (i - 1)];
+
+				if (i == MESH_SAMPLES-1)
+					vn[2] = &border[BORDER_RIGHT][j];
+				else
+					vn[2] = &samples[j * MESH_SAMPLES + (i + 1)];
+
+				if (j == 0)
+					vn[1] = &border[BORDER_DOWN][i];
+				else
+					vn[1] = &samples[(j - 1) * MESH_SAMPLES + i];
+
+				if (j == MESH_SAMPLES-1)
+					vn[3] = &border[BORDER_UP][i];
+				else
+					vn[3] = &samples[(j + 1) * MESH_SAMPLES + i];
+
+				vec3_t norm = VEC3(0,0,0);
+
+				for(unsigned x = 0; x < 3; x++) {
+					int nx = (x + 1) % 4;
+					vec3_t v1 = VEC3(vn[x]->x - v->x, 
+							 vn[x]->y - v->y, 
+							 vn[x]->z - v->z);
+					vec3_t v2 = VEC3(vn[nx]->x - v->x, 
+							 vn[nx]->y - v->y, 
+							 vn[nx]->z - v->z);
+					vec3_t cross;
 
 					vec3_cross(&cross, &v1, &v2);
 					vec3_normalize(&cross);
@@ -1777,150 +3157,377 @@ static void generate_geom(const struct quadtree *qt)
 			}
 		}
 
-		if (USE_INDEX) {
-			if (have_vbo)
-				glBufferSubData(GL_ARRAY_BUFFER,
-						p->vertex_offset * sizeof(struct vertex),
-						sizeof(samples), samples);
-			else
-				memcpy(&qt->varray[p->vertex_offset],
-				       samples, sizeof(samples));
-		} else {
-			struct vertex strip[VERTICES_PER_PATCH];
+		if (USE_SKIRTS)
+			make_skirt(qt, p, samples);
+
+		if (USE_INDEX)
+			pack_vertices(qt, p, samples, out);
+		else {
 			unsigned nclass = neighbour_class(p);
 
+			p->origin = VEC3(0, 0, 0);
+			p->scale = 1;
+
 			for(int idx = 0; idx < INDICES_PER_PATCH; idx++)
-				strip[idx] = samples[patch_indices[nclass][idx]];
-			
-			if (have_vbo) {
-				glBufferSubData(GL_ARRAY_BUFFER,
-						p->vertex_offset * sizeof(struct vertex),
-						sizeof(strip), strip);
-			} else {
-				memcpy(&qt->varray[p->vertex_offset],
-				       strip, sizeof(strip));
+				memcpy(&out[idx], &samples[patch_indices[nclass][idx]],
+				       sizeof(*out));
+		}
+	}
+
+	r->backend->upload_end(r);
+}
+
+/* The elevation the generator gives sample i,j of p, leaving the
+   octave cache alone */
+static elevation_t sample_elevation(const struct quadtree *qt, const struct patch *p,
+				    int i, int j)
+{
+	struct sample s;
+	struct vertex v, *vp = &v;
+	elevation_t elev;
+	float coarse_out;
+
+	prepare_sample(qt, p, i, j, &s);
+	if (qt->coarse)
+		s.coarse_out = &coarse_out;	/* as generate_geom() would */
+
+	if (qt->batch_generator)
+		(*qt->batch_generator)(qt->batch_arg, &s, 1, &elev, &vp);
+	else
+		elev = (*qt->generator)(&s, vp);
+
+	return elev;
+}
+
+unsigned quadtree_check_edges(const struct quadtree *qt)
+{
+	struct list_head *pp;
+	unsigned bad = 0;
+
+	list_for_each(pp, &qt->visible) {
+		const struct patch *p = list_entry(pp, struct patch, list);
+		const struct patch *q[MAX_EDGE_PATCHES];
+		unsigned n = edge_patches(p, 0, q);
+
+		for(int k = 0; k < 4 * PATCH_SAMPLES; k++) {
+			elevation_t elev = 0;
+			int i, j, have = 0;
+			long c[3];
+
+			skirt_edge(k, &i, &j);
+			patch_cube_point(qt, p, i, j, c);
+
+			for(unsigned m = 0; m < n; m++) {
+				int si, sj;
+
+				/* each visible pair once */
+				if ((q[m]->flags & PF_CULLED) || q[m] > p ||
+				    !patch_touches(qt, q[m], c, &si, &sj) || si < 0)
+					continue;
+
+				if (!have) {
+					elev = sample_elevation(qt, p, i, j);
+					have = 1;
+				}
+				if (sample_elevation(qt, q[m], si, sj) != elev)
+					bad++;
 			}
 		}
 	}
 
-	if (have_vbo)
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return bad;
+}
+
+void quadtree_upload_stats(const struct quadtree *qt, unsigned long *bytes,
+			   unsigned *transfers, float *stalled)
+{
+	*bytes = qt->render->upload_bytes;
+	*transfers = qt->render->upload_transfers;
+	*stalled = qt->render->upload_stalled;
+}
+
+/* The index list to draw p with, and its length */
+static const void *patch_draw_indices(const struct quadtree *qt, const struct patch *p,
+				      GLsizei *count)
+{
+	if (USE_SKIRTS) {
+		*count = SKIRT_INDICES;
+		return qt->render->indices[9];
+	}
+
+	unsigned nclass = neighbour_class(p);
 
+	*count = patch_index_count[nclass];
+	return qt->render->indices[nclass];
 }
 
-/* set up vertex array pointers, starting at vertex offset "offset" */
-static void set_array_pointers(const struct quadtree *qt, unsigned offset)
+/* How far, as a fraction of its height above the surface, the
+   camera may move before the draw list is re-sorted */
+#define SORT_SLACK	(1.f / 8)
+
+void quadtree_front_to_back(struct quadtree *qt, int enable)
 {
-	glVertexPointer(3, GL_FLOAT, sizeof(struct vertex),
-			(char *)&qt->varray[offset] + offsetof(struct vertex, x));
-	glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(struct vertex),
-		       (char *)&qt->varray[offset] + offsetof(struct vertex, col));
-	glTexCoordPointer(2, GL_SHORT, sizeof(struct vertex),
-			  (char *)&qt->varray[offset] + offsetof(struct vertex, s));
-	glNormalPointer(GL_BYTE, sizeof(struct vertex), 
-			(char *)&qt->varray[offset] + offsetof(struct vertex, nx));
+	qt->front_to_back = enable;
+	qt->draws_dirty = 1;
 }
 
-void quadtree_render(const struct quadtree *qt, void (*prerender)(const struct patch *p))
+/* A sort key for the distance from pos to the nearest point of p's
+   bounding box.  A positive float's bits sort the same way as its
+   value, and the top 16 keep its exponent and 7 bits of mantissa,
+   so the key is good to within 1% however near or far p is. */
+static unsigned distance_key(const struct patch *p, const vec3_t *pos)
 {
-	assert(have_vbo != -1);
-	assert(have_cva != -1);
+	const box_t *b = &p->bbox;
+	float d2 = 0;
+
+	for(int a = 0; a < 3; a++) {
+		float d = fabsf(pos->v[a] - b->centre.v[a]) - b->extent.v[a];
 
-	if (have_vbo) {
-		glBindBuffer(GL_ARRAY_BUFFER, qt->vtxbufid);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_bufid);
-		GLERROR();
+		if (d > 0)
+			d2 += d * d;
 	}
 
-	glEnableClientState(GL_VERTEX_ARRAY);
-	glEnableClientState(GL_COLOR_ARRAY);
-	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-	glEnableClientState(GL_NORMAL_ARRAY);
+	union { float f; unsigned u; } bits = { .f = d2 };
 
-	if (!USE_INDEX)
-		set_array_pointers(qt, 0);
+	return bits.u >> 16;
+}
 
-	struct list_head *pp;
-	list_for_each(pp, &qt->visible) {
-		const struct patch *p = list_entry(pp, struct patch, list);
+/* Sort the first n entries of draw_patch[] by the low bits of their
+   sort_key[]s: a radix sort, a byte at a time, which leaves equal
+   keys in the order they were in.  A byte which is the same in
+   every key is skipped. */
+static void radix_sort(struct quadtree *qt, unsigned n, int bits)
+{
+	unsigned *key = qt->sort_key, *outkey = key + qt->npatches;
+	const struct patch **in = qt->draw_patch, **out = qt->sort_tmp;
 
-		assert((p->flags & (PF_ACTIVE|PF_CULLED|PF_UPDATE_GEOM|PF_STITCH_GEOM)) == PF_ACTIVE);
+	for(int shift = 0; shift < bits; shift += 8) {
+		unsigned count[256 + 1] = { 0 };
 
-		if (prerender)
-			(*prerender)(p);
+		for(unsigned k = 0; k < n; k++)
+			count[((key[k] >> shift) & 0xff) + 1]++;
+		if (n == 0 || count[((key[0] >> shift) & 0xff) + 1] == n)
+			continue;
+		for(int b = 0; b < 256; b++)
+			count[b + 1] += count[b];
 
-		if (USE_INDEX) {
-			unsigned nclass = neighbour_class(p);
-			
-			set_array_pointers(qt, p->vertex_offset);
-			
-			glDrawRangeElements(GL_TRIANGLE_STRIP,
-					    0, VERTICES_PER_PATCH, 
-					    INDICES_PER_PATCH,
-					    PATCH_INDEX_TYPE, (*patchidx)[nclass]);
-		} else
-			glDrawArrays(GL_TRIANGLE_STRIP, p->vertex_offset, 
-				     VERTICES_PER_PATCH);
-
-		if (ANNOTATE && !have_vbo) {
-			struct vertex *va = &qt->varray[p->vertex_offset];
-
-			glPushAttrib(GL_ENABLE_BIT);
-			glDisable(GL_LIGHTING);
-			glDisable(GL_TEXTURE_2D);
-
-			glBegin(GL_LINES);
-			for(int i = 0; i < MESH_SAMPLES * MESH_SAMPLES; i++) {
-				struct vertex *v = &va[i];
-
-				glColor4ubv(v->col);
-				glVertex3fv(&v->x);
-				glVertex3f(v->x + v->nx, v->y + v->ny, v->z + v->nz);
+		/* the keys move with their patches, for the next
+		   pass */
+		for(unsigned k = 0; k < n; k++) {
+			unsigned dst = count[(key[k] >> shift) & 0xff]++;
+
+			out[dst] = in[k];
+			outkey[dst] = key[k];
+		}
+
+		memcpy(key, outkey, sizeof(*key) * n);
+		memcpy(in, out, sizeof(*in) * n);
+	}
+}
+
+/* Sort draw_patch[] nearest first from pos */
+static void sort_draws(struct quadtree *qt, unsigned n, const vec3_t *pos)
+{
+	for(unsigned k = 0; k < n; k++)
+		qt->sort_key[k] = distance_key(qt->draw_patch[k], pos);
+
+	radix_sort(qt, n, 16);
+
+	qt->sort_pos = *pos;
+	qt->draw_sorts++;
+}
+
+void quadtree_state_keys(struct quadtree *qt, patch_state_t *state, void *arg)
+{
+	qt->state_fn = state;
+	qt->state_arg = arg;
+	quadtree_state_invalidate(qt);
+}
+
+void quadtree_state_invalidate(struct quadtree *qt)
+{
+	for(int i = 0; i < qt->npatches; i++)
+		qt->patches[i].flags &= ~PF_STATE;
+	qt->draws_dirty = 1;
+}
+
+unsigned quadtree_state_groups(const struct quadtree *qt)
+{
+	return qt->ngroups;
+}
+
+/* Sort draw_patch[] by frame (see pack_vertices()), numbering the
+   frames in the order their first draws come, so each frame's draws
+   are together and the order is otherwise kept frame by frame.  The
+   draws then only need a transform per frame.  Frames are found
+   through a hash table of each one's first patch. */
+static void frame_draws(struct quadtree *qt, unsigned n)
+{
+	unsigned *key = qt->sort_key;
+	unsigned mask = qt->frame_size - 1;
+	unsigned frames = 0;
+
+	memset(qt->frame_slot, 0, sizeof(*qt->frame_slot) * qt->frame_size);
+
+	for(unsigned k = 0; k < n; k++) {
+		struct patch *p = &qt->patches[qt->draw_patch[k] - qt->patches];
+		union { float f; unsigned u; } bits[4] = {
+			{ .f = p->origin.x }, { .f = p->origin.y },
+			{ .f = p->origin.z }, { .f = p->scale },
+		};
+		unsigned h = ((bits[0].u * 73856093u) ^ (bits[1].u * 19349663u) ^
+			      (bits[2].u * 83492791u) ^ bits[3].u) & mask;
+		const struct patch *f;
+
+		while((f = qt->frame_slot[h]) != NULL &&
+		      (f->scale != p->scale || memcmp(&f->origin, &p->origin, sizeof(p->origin)) != 0))
+			h = (h + 1) & mask;
+
+		if (f == NULL) {
+			qt->frame_slot[h] = p;
+			qt->frame_num[h] = frames++;
+		}
+		p->frame = key[k] = qt->frame_num[h];
+	}
+
+	radix_sort(qt, n, 32);
+}
+
+/* Group draw_patch[] by state key, keeping the existing order
+   within each group, and fill in the group arrays.  A sorted list's
+   groups are numbered in the order their first draws come, like
+   frames, rather than by key, so they're drawn nearest first as well
+   as each group's draws; otherwise a state for every patch would
+   undo the sort entirely. */
+static void group_draws(struct quadtree *qt, unsigned n)
+{
+	unsigned *key = qt->sort_key;
+	unsigned mask = qt->frame_size - 1;
+	unsigned g = 0, groups = 0;
+	int ranked = qt->front_to_back && qt->state_fn;
+
+	if (ranked)
+		memset(qt->frame_slot, 0, sizeof(*qt->frame_slot) * qt->frame_size);
+
+	for(unsigned k = 0; k < n; k++) {
+		struct patch *p = &qt->patches[qt->draw_patch[k] - qt->patches];
+
+		if (qt->state_fn && !(p->flags & PF_STATE)) {
+			p->state = (*qt->state_fn)(qt->state_arg, p);
+			p->flags |= PF_STATE;
+		}
+		key[k] = qt->state_fn ? p->state : 0;
+
+		if (ranked) {
+			unsigned h = (p->state * 0x9e3779b9u) & mask;
+			const struct patch *f;
+
+			while((f = qt->frame_slot[h]) != NULL && f->state != p->state)
+				h = (h + 1) & mask;
+
+			if (f == NULL) {
+				qt->frame_slot[h] = p;
+				qt->frame_num[h] = groups++;
 			}
-			glEnd();
+			key[k] = qt->frame_num[h];
+		}
+	}
+
+	radix_sort(qt, n, 32);
 
-			glPopAttrib();
+	for(unsigned k = 0; k < n; k++)
+		if (k == 0 || key[k] != key[k - 1]) {
+			qt->group_start[g] = k;
+			qt->group_state[g] = qt->state_fn ? qt->draw_patch[k]->state : 0;
+			g++;
 		}
+	qt->group_start[g] = n;
+	qt->ngroups = g;
+}
+
+/* Rebuild the draw list from the visible patches, in pool order or
+   nearest first, then gathered by frame and grouped by state key;
+   sorted, each group's draws of each frame stay nearest first, and
+   the groups and frames come in the order of their nearest draws.
+   An entry depends only on its patch's slot, neighbour class and
+   frame, so the list only needs rebuilding when a split, merge,
+   change of culling, slot swap or new frame has changed the visible
+   set or its layout, or when a sorted list's camera has moved. */
+static void build_draws(struct quadtree *qt, const vec3_t *camerapos)
+{
+	unsigned n = 0, runs = 0, frames = 0;
+	int resort = 0;
+
+	qt->draw_sorts = 0;
 
-		GLERROR();
+	if (qt->front_to_back && !qt->draws_dirty) {
+		vec3_t moved;
+		float alt = vec3_magnitude(camerapos) - qt->radius;
+
+		if (alt < qt->radius * 1e-3f)
+			alt = qt->radius * 1e-3f;
+
+		vec3_sub(&moved, camerapos, &qt->sort_pos);
+		resort = vec3_magnitude(&moved) > alt * SORT_SLACK;
 	}
 
-	if (1 || ANNOTATE) {
-		glPushAttrib(GL_ENABLE_BIT);
-		glDisable(GL_LIGHTING);
-		glDisable(GL_TEXTURE_2D);
+	if (!qt->draws_dirty && !resort)
+		return;
 
-		list_for_each(pp, &qt->culled) {
-			const struct patch *p = list_entry(pp, struct patch, list);
-			const box_t *b = &p->bbox;
+	if (qt->draws_dirty) {
+		for(int i = 0; i < qt->npatches; i++) {
+			const struct patch *p = &qt->patches[i];
 
-			glColor3f(1,1,0);
-			glBegin(GL_POINTS);
-			glVertex3fv(b->centre.v);
-			glEnd();
+			if ((p->flags & (PF_ACTIVE|PF_CULLED)) != PF_ACTIVE)
+				continue;
 
-			if (p->flags & PF_LATECULL)
-				glColor3f(p->priority, 0, p->priority);
-			else if (p->phase == qt->phase) 
-				glColor3f(p->priority, p->priority, 0);
-			else
-				glColor3f(p->priority, p->priority, p->priority);
-			patch_outline(qt, p);
+			assert((p->flags & (PF_UPDATE_GEOM|PF_STITCH_GEOM)) == 0 ||
+			       (p->flags & PF_UPLOADED));
 
-			glColor3f(.75,0,0);
-			//patch_bbox(p);
+			qt->draw_patch[n++] = p;
 		}
-		glPopAttrib();
+		assert(n == qt->nvisible);
+		qt->ndraws = n;
 	}
 
-	if (have_vbo) {
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	if (qt->front_to_back)
+		sort_draws(qt, qt->ndraws, camerapos);
+	if (COMPACT_VERTEX)
+		frame_draws(qt, qt->ndraws);
+	group_draws(qt, qt->ndraws);
+
+	for(n = 0; n < qt->ndraws; n++) {
+		const struct patch *p = qt->draw_patch[n];
+
+		qt->draw_indices[n] = patch_draw_indices(qt, p, &qt->draw_count[n]);
+		qt->draw_base[n] = p->vertex_offset;
+		qt->draw_frame[n] = COMPACT_VERTEX ? p->frame : 0;
+
+		if (n == 0 || qt->draw_base[n] != qt->draw_base[n - 1] + VERTICES_PER_PATCH)
+			runs++;
+		if (n == 0 || qt->draw_frame[n] != qt->draw_frame[n - 1] ||
+		    (qt->state_fn && p->state != qt->draw_patch[n - 1]->state))
+			frames++;
 	}
 
-	glDisableClientState(GL_VERTEX_ARRAY);
-	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-	glDisableClientState(GL_NORMAL_ARRAY);
-	glDisableClientState(GL_COLOR_ARRAY);
-	GLERROR();
+	qt->draw_runs = runs;
+	qt->draw_frames = frames;
+	qt->draws_dirty = 0;
+}
+
+const struct patch *const *quadtree_visible(const struct quadtree *qt, unsigned *count)
+{
+	*count = qt->ndraws;
+	return qt->draw_patch;
+}
+
+void quadtree_render(const struct quadtree *qt, void (*prerender)(const struct patch *p))
+{
+	qt->render->backend->draw(qt->render, qt, prerender, NULL, NULL);
+}
+
+void quadtree_render_batched(const struct quadtree *qt,
+			     void (*bind)(void *arg, unsigned state))
+{
+	qt->render->backend->draw(qt->render, qt, NULL, bind, qt->state_arg);
 }
@@ -53,22 +53,174 @@ struct patch;
 struct vertex;
 
 typedef long elevation_t;	/* basic sample type of a heightfield */
-typedef elevation_t (generator_t)(const vec3_t *normal, struct vertex *vtx);
+
+/* A sample point passed to the generator */
+struct sample {
+	vec3_t normal;		/* unit vector to the sample point */
+
+	/* Distance between adjacent samples of the patch being
+	   generated, measured on the unit sphere.  Detail finer than
+	   about twice this can't be represented. */
+	float spacing;
+
+	/* The spacing the generator should drop detail by.  It's
+	   spacing, except for samples on an edge or corner shared with
+	   a coarser patch, where it's the coarsest such patch's; so
+	   every patch sharing a sample gives it the same height, and
+	   no cracks open between levels. */
+	float detail;
+	int level;		/* quadtree level of the patch */
+
+	/* Octave cache (see quadtree_octave_cache()).  coarse is the
+	   value the parent patch stored for this point, bilinearly
+	   interpolated from the parent's samples (which were spacing*2
+	   apart), or NAN if there is none.  Samples on the patch's
+	   edge never have one, since they must come out the same in
+	   every patch sharing them.  If coarse_out is non-NULL the
+	   generator should store its own coarse value there for this
+	   patch's children to use; it starts out NAN, which is what
+	   the children get if the generator leaves it. */
+	float coarse;
+	float *coarse_out;
+};
+
+typedef elevation_t (generator_t)(const struct sample *s, struct vertex *vtx);
+
+/* Generate n samples at once; elev[i] and vtx[i] are for s[i].  All
+   the samples in one call come from the same patch.  arg is the
+   pointer passed to quadtree_create_batch(). */
+typedef void (batch_generator_t)(void *arg, const struct sample *s, unsigned n,
+				 elevation_t *elev, struct vertex **vtx);
 
 typedef short texcoord_t;
 
 struct quadtree *quadtree_create(int num_patches, long radius,
 				 generator_t *generator);
+struct quadtree *quadtree_create_batch(int num_patches, long radius,
+				       batch_generator_t *generator, void *arg);
+
+/* Either of the above (one of generator and batch_generator is
+   NULL), drawing through backend rather than OpenGL; see render.h */
+struct render_backend;
+struct quadtree *quadtree_create_backend(int num_patches, long radius,
+					 generator_t *generator,
+					 batch_generator_t *batch_generator, void *arg,
+					 const struct render_backend *backend);
+struct render *quadtree_render_backend(const struct quadtree *qt);
 
 void quadtree_update_view(struct quadtree *qt, const matrix_t *mat,
 			  const vec3_t *camerapos);
 void quadtree_render(const struct quadtree *qt, void (*prerender)(const struct patch *p));
 
+/*
+   Batched drawing.  A state function gives each visible patch a
+   state key, such as the texture or material it's drawn with; the
+   draw list is then grouped by key, and quadtree_render_batched()
+   calls bind once per group before drawing its patches, rather than
+   calling a prerender function for every patch.  Within a group the
+   patches stay in the order they'd otherwise be drawn in.
+
+   A patch's key is kept with it, so the state function is only
+   called when a patch becomes visible for a part of the terrain it
+   doesn't already have a key for; quadtree_state_invalidate() asks
+   for them all again.  It's called from quadtree_update_view().
+   Passing a NULL state function puts every patch in one group.
+ */
+typedef unsigned (patch_state_t)(void *arg, const struct patch *p);
+
+void quadtree_state_keys(struct quadtree *qt, patch_state_t *state, void *arg);
+void quadtree_state_invalidate(struct quadtree *qt);
+void quadtree_render_batched(const struct quadtree *qt,
+			     void (*bind)(void *arg, unsigned state));
+
+/* The number of state groups in the last update's draw list */
+unsigned quadtree_state_groups(const struct quadtree *qt);
+
+/* The visible patches, in the order quadtree_render() draws them.
+   *count patches are returned; the array is valid until the next
+   quadtree_update_view(). */
+const struct patch *const *quadtree_visible(const struct quadtree *qt, unsigned *count);
+
+/* 
+   Enable or disable the octave cache.  When enabled, each patch keeps
+   a value per sample which the generator computes from the low
+   octaves of its function, and passes it down to the patch's children
+   via struct sample.  The children can then evaluate only the octaves
+   which are too fine to interpolate from their parent.  The generator
+   decides which octaves are cached; if it caches only octaves with at
+   least R parent samples per feature, the bilinear interpolation error
+   is at most about 0.75/R^2 of their summed amplitude.
+ */
+void quadtree_octave_cache(struct quadtree *qt, int enable);
+
+/*
+   Normal map tiles.  When enabled, each visible patch gets a tile of
+   normals (PATCH_TILE texels square; see quadtree_priv.h) sampled
+   from the generator at several times the vertex density, so shading
+   can show detail much finer than the mesh without splitting more
+   patches.  The tiles are made by threads worker threads (0 for one
+   per CPU; if colour tiles already have threads, they're shared
+   and threads is ignored), so the generator must be safe to call
+   from several threads at once; a patch is drawn with its vertex
+   normals until its tile arrives.  Each tile belongs to the patch's
+   pool slot, and is handed to the render backend as it's made.
+   Returns 0 if the threads or tiles can't be set up.
+ */
+int quadtree_normal_maps(struct quadtree *qt, int enable, int threads);
+
+/*
+   Colour tiles, a virtual texture of the generator's colours.  When
+   enabled, each visible patch gets a tile (the same size and layout
+   as a normal map) of the colours the generator gives with
+   vertex_set_colour() at the tile's texels, so the colour has the
+   same detail relative to the patch at every level, rather than
+   only at the vertices.  They're made by the same worker threads as
+   normal maps, and when both are enabled a patch's tiles are made
+   from the same generator calls.
+
+   The tiles are kept in an atlas of pages pages (0 disables them),
+   found through a page table by the part of the terrain they're
+   for, so a patch which is merged away and later split back gets
+   its tile again without remaking it.  When the atlas is full, the
+   least recently drawn page is reused; if every page is in use by
+   a visible patch, further patches are drawn with their vertex
+   colours.  So texture memory stays at pages tiles however deep
+   the view goes.  Each page is handed to the render backend as
+   it's made, BC1 coded by the worker if the backend wants it that
+   way, which is an eighth of the memory and upload.  Returns 0 if
+   the threads or atlas can't be set up.
+ */
+int quadtree_colour_tiles(struct quadtree *qt, int pages, int threads);
+
+/* Draw the visible patches nearest first rather than in memory
+   order, so more of what's hidden fails the depth test before it's
+   shaded.  The order is by distance from the camera, so it only
+   needs re-sorting when the camera moves, not when it turns. */
+void quadtree_front_to_back(struct quadtree *qt, int enable);
+
+/* Check that the visible patches agree on the heights of the samples
+   they share, by generating each shared sample again as each of its
+   patches.  Returns the number of pairs which differ.  This is for
+   testing; it costs a few generator calls per patch. */
+unsigned quadtree_check_edges(const struct quadtree *qt);
+
+/* Vertex uploads done by the last quadtree_update_view(): the bytes
+   uploaded, the number of transfers they were done in, and the time
+   in seconds spent waiting for the GPU to release staging memory. */
+void quadtree_upload_stats(const struct quadtree *qt, unsigned long *bytes,
+			   unsigned *transfers, float *stalled);
+
 int patch_level(const struct patch *p);
 unsigned long patch_id(const struct patch *p);
+int patch_face(const struct patch *p);	/* root patch it's part of */
 char *patch_name(const struct patch *p, char buf[16 * 2 + 1]);
 
 void vertex_set_colour(struct vertex *vtx, const unsigned char rgba[4]);
+/* With compact vertices (the default) the texcoords are always the
+   sample's position in the patch, (i, PATCH_SAMPLES-j), and this has
+   no effect; a generator can look its texture up itself and give the
+   result with vertex_set_colour(), which colour tiles (see
+   quadtree_colour_tiles()) keep at more than vertex density. */
 void vertex_set_texcoord(struct vertex *vtx, texcoord_t s, texcoord_t t);
 
 #endif	/* QUADTREE_H */
@@ -2,18 +2,67 @@
 #define _QUADTREE_PRIV_H
 
 #include "quadtree.h"
+#include "noise.h"
 
 #define MESH_SAMPLES	(PATCH_SAMPLES+1)
 
+/* Draw patches with triangle lists ordered for the vertex cache,
+   rather than triangle strips; see genpatchidx -s to compare them */
+#ifndef PATCH_LISTS
+#define PATCH_LISTS	0
+#endif
+
+#if PATCH_LISTS
+#define PATCH_PRIMITIVE		GL_TRIANGLES
+
+/* Number of indices in the largest triangle list covering a patch
+   mesh; stitched lists are shorter (see patch_index_count[]) */
+#define INDICES_PER_PATCH	(PATCH_SAMPLES * PATCH_SAMPLES * 2 * 3)
+#else
+#define PATCH_PRIMITIVE		GL_TRIANGLE_STRIP
+
 /* Number of indicies needed to construct a triangle strip to cover a
    whole patch mesh, including the overhead to stitch the strip
    together. */
 #define INDICES_PER_PATCH	((2*MESH_SAMPLES) * (MESH_SAMPLES-1) + (2*(MESH_SAMPLES-2)))
+#endif
 
 #define USE_INDEX	1	
 
+/* Instead of stitching patches to coarser neighbours, hang a skirt
+   of vertices below the edge of each patch to hide the cracks.  Every
+   patch then uses the same index list, patch_skirt_indices. */
+#ifndef USE_SKIRTS
+#define USE_SKIRTS	0
+#endif
+
+#if (USE_SKIRTS || PATCH_LISTS) && !USE_INDEX
+#error "USE_SKIRTS and PATCH_LISTS need USE_INDEX"
+#endif
+
+/* The skirt has a vertex below each edge sample, going anticlockwise
+   round the patch from (0,0) */
+#define SKIRT_SAMPLES	(4 * PATCH_SAMPLES)
+
+/* The mesh, then the skirt.  Which side of a skirt shows through a
+   crack depends on where it's seen from, so it's two-sided.  As
+   strips, 3 indices join the mesh to a strip round the skirt and
+   back without changing the skirt's winding. */
+#if PATCH_LISTS
+#define SKIRT_INDICES	(INDICES_PER_PATCH + SKIRT_SAMPLES * 2 * 2 * 3)
+#else
+#define SKIRT_INDICES	(INDICES_PER_PATCH + 3 + 2 * (SKIRT_SAMPLES + 1) + 2 * SKIRT_SAMPLES)
+#endif
+
+/* Vertices generated for a patch mesh */
+#if USE_SKIRTS
+#define MESH_VERTICES	(MESH_SAMPLES * MESH_SAMPLES + SKIRT_SAMPLES)
+#else
+#define MESH_VERTICES	(MESH_SAMPLES * MESH_SAMPLES)
+#endif
+
 #if USE_INDEX
-#define VERTICES_PER_PATCH	(MESH_SAMPLES * MESH_SAMPLES)
+#define VERTICES_PER_PATCH	MESH_VERTICES
 #else  /* !USE_INDEX */
 #define VERTICES_PER_PATCH	INDICES_PER_PATCH
 #endif	/* USE_INDEX */
@@ -26,7 +75,60 @@ typedef GLshort patch_index_t;
 #define PATCH_INDEX_TYPE	GL_UNSIGNED_SHORT
 #endif
 
+/* Store vertices for rendering in a compact quantised form */
+#define COMPACT_VERTEX	1
+
+#if COMPACT_VERTEX && !USE_INDEX
+#error "COMPACT_VERTEX needs USE_INDEX"
+#endif
+
+/* Normal map and colour tiles (see quadtree_normal_maps() and
+   quadtree_colour_tiles()) are PATCH_TILE texels square.  Texel
+   (i,j) is centred on the point which would be sample
+   (i,j) * PATCH_SAMPLES/(PATCH_TILE-1) of the patch, so the corner
+   texels sit on the corner samples and neighbouring tiles agree
+   along their shared edge.  Each texel is RGBA: for a normal map the
+   object space unit normal mapped from -1..1 to 0..255 in RGB, and
+   for a colour tile the colour the generator gave the point with
+   vertex_set_colour(). */
+#define PATCH_TILE	64
+
+typedef unsigned char patch_tile_t[PATCH_TILE * PATCH_TILE][4];
+
+/* Colour patch edges and draw normals and culling */
+#define ANNOTATE	1
+
+/* A vertex as generated */
+struct vertex {
+	texcoord_t s,t;
+	GLubyte col[4];
+	GLbyte nx, ny, nz;
+	GLfloat x,y,z;
+};
+
+#if COMPACT_VERTEX
+/* A vertex as stored for rendering, 12 bytes rather than 24.  The
+   position is relative to the patch's origin, in units of its scale
+   (see pack_vertices()).  Every patch has the same texcoords, so
+   they're kept once by the backend rather than per vertex. */
+struct glvertex {
+	GLshort x,y,z;
+	GLbyte nx, ny, nz;
+	GLubyte col[3];
+};
+#else
+/* The same as struct vertex */
+struct glvertex {
+	texcoord_t s,t;
+	GLubyte col[4];
+	GLbyte nx, ny, nz;
+	GLfloat x,y,z;
+};
+#endif
+
 extern const patch_index_t patch_indices[9][INDICES_PER_PATCH];
+extern const unsigned short patch_index_count[9];
+extern const patch_index_t patch_skirt_indices[SKIRT_INDICES];
 
 
 /*
@@ -95,6 +197,12 @@ struct patch {
 #define PF_STITCH_GEOM	(1<<4)	/* geometry needs stitching */
 
 #define PF_LATECULL	(1<<5)
+#define PF_COARSE	(1<<6)	/* octave cache entry valid */
+#define PF_FREE		(1<<7)	/* on the freelist */
+#define PF_STATE	(1<<8)	/* state key valid */
+#define PF_NORMALS	(1<<9)	/* normal map tile delivered */
+#define PF_COLOUR	(1<<10)	/* page is the colour tile's */
+#define PF_UPLOADED	(1<<11)	/* slot has vertices for it, if old ones */
 
 	int phase;
 
@@ -113,10 +221,25 @@ struct patch {
 	struct list_head list;	/* list pointers for whatever list we're on */
 
 	/* Offset into the vertex array, in units of
-	   VERTICES_PER_PATCH */
+	   VERTICES_PER_PATCH.  This belongs to the patch's slot in
+	   the pool, and stays put when slots are swapped. */
 	unsigned vertex_offset;
 
+	/* The detail its edge samples were generated with; see
+	   edge_detail() */
+	unsigned edges;
+
+	/* Vertex positions are origin + stored position * scale */
+	vec3_t origin;
+	float scale;
+	unsigned frame;		/* number of its origin and scale in the draw list */
+
 	unsigned char col[4];
+
+	unsigned state;		/* state key, if PF_STATE */
+
+	struct tile_job *tile_job; /* normal map being made, or NULL */
+	unsigned page;		/* colour tile's atlas page, if PF_COLOUR */
 };
 
 struct quadtree {
@@ -146,22 +269,117 @@ struct quadtree {
 	int reclaim;		/* currently reclaiming patches */
 
 	/* Array of patch structures.  All patches are allocated out
-	   of this pool.  It is fixed size. */
+	   of this pool.  It is fixed size.  Each slot has its own
+	   range of the vertex array; the active patches are kept
+	   drifting towards the start of the pool in Z-order (see
+	   compact_pool()), so patches which are near each other on
+	   the terrain are near each other in memory and in the vertex
+	   buffer.  There's one more slot's worth of vertex storage
+	   than patches, used as scratch for swapping slots.
+	   compact_order[] is compact_pool()'s room to sort the
+	   active patches in. */
 	int npatches;
 	struct patch *patches;
+	struct morton_slot *compact_order;
+	unsigned compact_moves;	/* slot swaps done by the last update */
 
-	GLuint vtxbufid;	/* ID of vertex buffer object (0 if not used) */
-	struct vertex *varray;	/* vertex array (NULL if using a VBO) */
+	/* Backend which holds the vertices and draws them (see
+	   render.h) */
+	struct render *render;
+
+	/* The last update's culling planes: 6 frustum and 1 horizon */
+	plane_t cullplanes[7];
 
 	int phase;		/* used for marking patches */
 
+	/* Draw list of the visible patches, built by
+	   quadtree_update_view() in the form
+	   glMultiDrawElementsBaseVertex() takes: entry k draws
+	   draw_patch[k], using its neighbour class's index range
+	   rebased to its vertices.  The list is in pool order, so
+	   it walks the vertex buffer forwards, unless front_to_back
+	   is set, when it's in order of distance from sort_pos;
+	   either way it's then gathered by frame and grouped by
+	   state key.
+	   It's only rebuilt when draws_dirty is set, or the camera
+	   has moved far enough from sort_pos to need re-sorting.
+	   The indices come from the backend's indices[] table.  Each
+	   array has npatches entries. */
+	int draws_dirty;
+	unsigned ndraws;
+	unsigned draw_runs;	/* runs of draws adjacent in the vertex buffer */
+	unsigned draw_frames;	/* runs of draws with the same frame and state */
+	const struct patch **draw_patch;
+	GLsizei *draw_count;
+	const GLvoid **draw_indices;
+	GLint *draw_base;
+
+	/* With compact vertices, draws with the same origin and scale
+	   (see pack_vertices()) have the same draw_frame[], and are
+	   together within each state group, so a backend can set
+	   each frame's transform once.  Without, it's always 0.
+	   frame_slot[] and frame_num[] are frame_draws()'s hash
+	   table, frame_size entries, which group_draws() also uses
+	   for state keys. */
+	unsigned *draw_frame;
+	unsigned frame_size;
+	const struct patch **frame_slot;
+	unsigned *frame_num;
+
+	int front_to_back;
+	vec3_t sort_pos;	/* camera position the list was sorted for */
+	unsigned draw_sorts;	/* sorts done by the last update */
+	unsigned *sort_key;	/* per draw_patch[] entry, twice over */
+	const struct patch **sort_tmp;
+
+	/* The draw list grouped by state key (see
+	   quadtree_state_keys()): group g is entries group_start[g]
+	   up to group_start[g+1], all with key group_state[g].
+	   Without a state function there's one group, with key 0. */
+	patch_state_t *state_fn;
+	void *state_arg;
+	unsigned ngroups;
+	unsigned *group_start;	/* npatches+1 entries */
+	unsigned *group_state;
+
+	struct random rng;	/* for debug colours */
+
+	/* Octave cache, one entry per patch (indexed the same as
+	   patches[]), or NULL if disabled. */
+	float (*coarse)[MESH_SAMPLES * MESH_SAMPLES];
+
+	/* The threads making normal map and colour tiles, or NULL if
+	   neither is enabled.  normal_tiles are indexed the same as
+	   patches[], or NULL without normal maps; atlas holds the
+	   colour tiles' pages, or is NULL without them.  tiles_made is
+	   the tiles delivered by the last update, and tiles_pending
+	   those still queued or being made; tiles_cancelled is the
+	   queued tiles it dropped because their patches were no
+	   longer visible, and pages_reused the patches which found
+	   their colour tile already made. */
+	struct tile_workers *workers;
+	patch_tile_t *normal_tiles;
+	struct colour_atlas *atlas;
+	unsigned pages_reused;
+	unsigned tiles_made, tiles_pending, tiles_cancelled;
+
 	/* Radius of the terrain sphere, and the function used to
 	   generate elevation for a particular point on its
 	   surface. */
 	long radius;
 
-	/* Function which gives us altitude for a vector */
+	/* Function which gives us altitude for a vector; either
+	   one at a time, or a patch's worth at once */
 	generator_t *generator;
+	batch_generator_t *batch_generator;
+	void *batch_arg;
 };
 
+/* The edge sample above skirt vertex k */
+void skirt_edge(int k, int *i, int *j);
+
+/* Unit vectors to p's corners, anticlockwise from (i0,j0) */
+void patch_corner_normals(const struct quadtree *qt, const struct patch *p,
+			  vec3_t v[4]);
+
 #endif	/* _QUADTREE_PRIV_H */
@@ -0,0 +1,155 @@
+#ifndef _RENDER_H
+#define _RENDER_H
+
+/*
+   A quadtree draws through a render backend.  The backend owns the
+   vertex storage for the patch pool, takes the vertices of patches
+   as they're generated, and turns the quadtree's draw list into
+   drawing; quadtree.c itself makes no graphics calls.
+
+   render_gl draws with OpenGL, and is what quadtree_create() uses.
+   render_null draws nothing and needs no display; it keeps the
+   vertices in memory and records what it was asked to do, so the
+   LOD and generation work can be run and measured headless.
+   render_soft rasterises on the CPU into its own image, which can be
+   written to a PPM.
+ */
+
+#include "geom.h"
+
+struct quadtree;
+struct patch;
+struct glvertex;
+
+/* Backend instance; each backend's own state follows this */
+struct render {
+	const struct render_backend *backend;
+
+	/* Index data for each neighbour class, then the skirted
+	   mesh, in the form the draw list passes back to draw() */
+	const void *indices[10];
+
+	/* swap() can be used */
+	int can_swap;
+
+	/* Uploads done by the last upload_begin()/upload_end() */
+	unsigned long upload_bytes;
+	unsigned upload_transfers;
+	float upload_stalled;	/* seconds spent waiting for the GPU */
+	unsigned upload_busy;	/* writes to vertices the GPU may be using */
+	unsigned upload_deferred; /* uploads put off by upload() */
+	unsigned swaps_refused;	/* swaps put off by swap() */
+
+	/* colour() takes its tiles BC1 coded (see texcomp.h), which
+	   the tile workers do.  render_gl sets it if GL can take
+	   them; render_null and render_soft leave it to the caller,
+	   and render_soft decodes them again. */
+	int colour_blocks;
+};
+
+struct render_backend {
+	const char *name;
+
+	/* Storage for npatches patches' vertices, plus one more
+	   patch's worth for scratch */
+	struct render *(*create)(int npatches);
+	void (*destroy)(struct render *r);
+
+	/* A frame's vertex uploads.  upload() returns where to write
+	   the VERTICES_PER_PATCH vertices which belong at vertex
+	   offset offset; they're only guaranteed to have arrived
+	   after upload_end().  Uploads come in increasing offset
+	   order.  If defer is set the offset's old vertices are still
+	   worth drawing, and if they can't be replaced yet without
+	   the GPU waiting, upload() returns NULL instead; they're
+	   drawn as they are, and the caller tries again later. */
+	void (*upload_begin)(struct render *r);
+	struct glvertex *(*upload)(struct render *r, unsigned offset, int defer);
+	void (*upload_end)(struct render *r);
+
+	/* Exchange the vertices at two vertex offsets.  Returns 0,
+	   leaving them be, if it can't be done yet without the GPU
+	   waiting. */
+	int (*swap)(struct render *r, unsigned a, unsigned b);
+
+	/* The normal map tile (see quadtree_normal_maps()) for the
+	   slot whose vertices are at vertex offset offset.  It's
+	   copied; a patch should only be drawn with it if it has
+	   PF_NORMALS set.  NULL if the backend has no use for them. */
+	void (*normals)(struct render *r, unsigned offset, const unsigned char (*tile)[4]);
+
+	/* The colour tile (see quadtree_colour_tiles()) for page page
+	   of the colour atlas, which has npages pages: PATCH_TILE^2
+	   RGBA texels, or their BC1 blocks if r->colour_blocks is
+	   set.  It's copied; a patch with PF_COLOUR set is drawn with
+	   page p->page in place of its vertex colours.  NULL if the
+	   backend can't. */
+	void (*colour)(struct render *r, unsigned page, unsigned npages,
+		       const void *tile);
+
+	/* Draw qt's draw list a state group at a time, calling bind
+	   (if not NULL) with arg and the group's state key before
+	   each group, and prerender (if not NULL) before each patch.
+	   They're for setting GL state, so render_null records the
+	   binds rather than calling them, and render_soft ignores
+	   them. */
+	void (*draw)(struct render *r, const struct quadtree *qt,
+		     void (*prerender)(const struct patch *p),
+		     void (*bind)(void *arg, unsigned state), void *arg);
+};
+
+extern const struct render_backend render_gl;
+extern const struct render_backend render_null;
+extern const struct render_backend render_soft;
+
+/* Keep regions copies of each patch's vertices (1 to 4; normally
+   1), so a patch which is regenerated or moved is written into a
+   copy which isn't in use, and drawing switches to it when the
+   writes are done.  It needs vertex buffer objects and
+   GL_ARB_sync.  Call it before the first quadtree_update_view();
+   returns 0 if it can't be done. */
+int render_gl_configure(struct render *r, int regions);
+
+/* The GL_TEXTURE_2D_ARRAY holding the normal map tiles, or 0 if
+   there are none (or no GL_EXT_texture_array).  A patch's tile is in
+   the layer for its slot, which for entry k of the draw list is
+   draw_base[k] / VERTICES_PER_PATCH. */
+unsigned render_gl_normal_maps(const struct render *r);
+
+/* What render_null has been asked to do */
+struct render_cmd {
+	enum render_op {
+		RENDER_UPLOAD,		/* offset */
+		RENDER_SWAP,		/* offset, other */
+		RENDER_BIND,		/* other is the state key */
+		RENDER_NORMALS,		/* offset */
+		RENDER_COLOUR,		/* offset is the page, other the number of pages */
+		RENDER_DRAW,		/* offset, count, nclass, patch */
+		RENDER_FRAME,		/* end of a draw(); count is the draws */
+	} op;
+	unsigned offset;
+	unsigned other;
+	unsigned count;
+	unsigned char nclass;
+	const struct patch *patch;
+};
+
+/* The commands recorded since the last render_null_clear(), and the
+   vertex storage itself (indexed by vertex offset) */
+const struct render_cmd *render_null_commands(const struct render *r, unsigned *count);
+void render_null_clear(struct render *r);
+const struct glvertex *render_null_vertices(const struct render *r);
+
+/* Set render_soft's image size, and the number of threads to draw
+   with (0 for one per CPU).  It starts out 256x256.  Returns 0 if the
+   buffers can't be allocated. */
+int render_soft_configure(struct render *r, int width, int height, int threads);
+
+/* The object-to-clip-space matrix to draw with, as passed to
+   quadtree_update_view(), and the direction towards the light */
+void render_soft_view(struct render *r, const matrix_t *mat, const vec3_t *light);
+
+void render_soft_clear(struct render *r, const unsigned char rgb[3]);
+int render_soft_write_ppm(const struct render *r, const char *path);
+
+#endif	/* _RENDER_H */
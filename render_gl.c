@@ -0,0 +1,1322 @@
+/*
+   OpenGL render backend.  The vertices live in a vertex buffer object
+   if there is one, or a vertex array in memory if not; uploads go
+   through a staging ring if the extensions for it are there.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "geom.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GL/glu.h>
+
+#include "quadtree.h"
+#include "quadtree_priv.h"
+#include "render.h"
+#include "texcomp.h"
+
+#define DEBUG		0
+
+static int have_vbo = -1;
+static int have_cva = -1;
+static int have_basevertex = -1;	/* GL_ARB_draw_elements_base_vertex */
+static int have_staging = -1;		/* copy_buffer, map_buffer_range and sync */
+static int have_persistent = -1;	/* GL_ARB_buffer_storage */
+static int have_sync = -1;		/* GL_ARB_sync */
+static int have_texarray = -1;		/* GL_EXT_texture_array */
+static int have_multitexture = -1;	/* GL_ARB_multitexture */
+static int have_s3tc = -1;		/* GL_EXT_texture_compression_s3tc */
+
+static GLuint index_bufid = 0;
+
+#if COMPACT_VERTEX
+static texcoord_t mesh_texcoords[MESH_VERTICES][2];
+static GLuint texcoord_bufid = 0;
+#endif
+
+#define GLERROR()							\
+do {									\
+	GLenum err = glGetError();					\
+	if (err != GL_NO_ERROR) {					\
+		printf("GL error at %s:%d: %s\n",			\
+		       __FILE__, __LINE__, gluErrorString(err));	\
+	}								\
+} while(0)
+
+struct staging;
+
+/* Most vertex regions per slot, and frames in flight tracked */
+#define MAX_REGIONS	4
+#define FRAME_FENCES	8
+
+struct render_gl {
+	struct render r;
+
+	int npatches;
+	GLuint vtxbufid;	/* ID of vertex buffer object (0 if not used) */
+	struct glvertex *varray; /* vertex array (NULL if using a VBO) */
+	struct staging *staging; /* upload staging ring (NULL if not used) */
+	GLuint normal_tex;	/* normal map tiles, a layer per slot (0 if none yet) */
+	GLuint colour_tex;	/* colour tile atlas (0 if none yet) */
+	unsigned colour_pages, colour_cols, colour_rows;
+
+	/* Without staging, each upload is written here and sent with
+	   glBufferSubData() by the next upload() or upload_end() */
+	struct glvertex local[VERTICES_PER_PATCH];
+	int pending;		/* local[]'s vertex offset, or -1 */
+
+	/* Vertex regions (see render_gl_configure()).  Each slot's
+	   vertices are in region[slot]; an upload goes to another
+	   region, next[slot], which takes over at upload_end().
+	   drawn[] is the frame each slot's regions were last drawn
+	   in, and completed the last frame the GPU is known to have
+	   finished.  bases[] is the draw list's draw_base[] pointing
+	   into the regions. */
+	int nregions;
+	unsigned char *region, *next;
+	unsigned *switched, nswitched;	/* slots to move to next[] */
+	unsigned *drawn;
+	GLint *bases;
+	unsigned frame, completed;
+	struct frame_fence {
+		GLsync sync;
+		unsigned frame;
+	} fence[FRAME_FENCES];
+};
+
+static inline struct render_gl *to_gl(struct render *r)
+{
+	return (struct render_gl *)r;
+}
+
+/*
+   Staging ring for vertex uploads.  The ring is split into
+   STAGING_SEGMENTS segments, one per frame; each frame's dirty patches
+   are packed into its segment and copied into the vertex buffer with
+   glCopyBufferSubData(), one copy per run of patches which are
+   adjacent in the vertex buffer.  A fence after the copies tells us
+   when the segment can be reused, which is normally long before it
+   comes round again, so the CPU doesn't wait for the GPU and the
+   driver never has to synchronise on the vertex buffer itself.
+
+   With GL_ARB_buffer_storage the ring is mapped persistently;
+   otherwise each frame's segment is mapped unsynchronised (the fence
+   has already done the synchronisation).
+ */
+#define STAGING_SEGMENTS	3
+
+struct staging {
+	GLuint bufid;
+	size_t segsize;		/* bytes per segment */
+	char *map;		/* persistent mapping, or NULL */
+
+	int seg;		/* current segment */
+	GLsync fence[STAGING_SEGMENTS];
+
+	char *base;		/* current segment's mapping */
+	size_t used;		/* bytes of it used */
+
+	/* copies for the current segment */
+	unsigned ncopies;
+	struct staging_copy {
+		GLintptr src, dst;
+		GLsizeiptr len;
+	} *copies;
+};
+
+static struct staging *staging_create(int num_patches)
+{
+	struct staging *st = malloc(sizeof(*st));
+
+	if (st == NULL)
+		return NULL;
+
+	st->segsize = sizeof(struct glvertex) * VERTICES_PER_PATCH * num_patches;
+	st->copies = malloc(sizeof(*st->copies) * num_patches);
+	if (st->copies == NULL) {
+		free(st);
+		return NULL;
+	}
+
+	st->seg = 0;
+	for(int i = 0; i < STAGING_SEGMENTS; i++)
+		st->fence[i] = 0;
+	st->base = NULL;
+	st->used = 0;
+	st->ncopies = 0;
+
+	size_t size = st->segsize * STAGING_SEGMENTS;
+
+	glGenBuffers(1, &st->bufid);
+	glBindBuffer(GL_COPY_READ_BUFFER, st->bufid);
+
+	if (have_persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glBufferStorage(GL_COPY_READ_BUFFER, size, NULL, flags);
+		st->map = glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags);
+	} else {
+		glBufferData(GL_COPY_READ_BUFFER, size, NULL, GL_STREAM_DRAW);
+		st->map = NULL;
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	GLERROR();
+
+	return st;
+}
+
+static void staging_destroy(struct staging *st)
+{
+	for(int i = 0; i < STAGING_SEGMENTS; i++)
+		if (st->fence[i])
+			glDeleteSync(st->fence[i]);
+	glDeleteBuffers(1, &st->bufid);
+	free(st->copies);
+	free(st);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Start a frame's uploads in the next segment, once the GPU has
+   finished with it */
+static void staging_begin(struct render_gl *gl)
+{
+	struct staging *st = gl->staging;
+
+	st->seg = (st->seg + 1) % STAGING_SEGMENTS;
+
+	GLsync fence = st->fence[st->seg];
+
+	if (fence) {
+		if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+			double start = now();
+
+			while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+					       1000000000) == GL_TIMEOUT_EXPIRED)
+				;
+			gl->r.upload_stalled += now() - start;
+		}
+		glDeleteSync(fence);
+		st->fence[st->seg] = 0;
+	}
+
+	GLintptr offset = st->seg * st->segsize;
+
+	if (st->map)
+		st->base = st->map + offset;
+	else {
+		glBindBuffer(GL_COPY_READ_BUFFER, st->bufid);
+		st->base = glMapBufferRange(GL_COPY_READ_BUFFER, offset, st->segsize,
+					    GL_MAP_WRITE_BIT |
+					    GL_MAP_INVALIDATE_RANGE_BIT |
+					    GL_MAP_UNSYNCHRONIZED_BIT);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+
+	st->used = 0;
+	st->ncopies = 0;
+}
+
+/* Space for one patch's vertices, to go to dst in the vertex buffer */
+static struct glvertex *staging_alloc(struct staging *st, GLintptr dst)
+{
+	const GLsizeiptr len = sizeof(struct glvertex) * VERTICES_PER_PATCH;
+	GLintptr src = st->seg * st->segsize + st->used;
+	struct staging_copy *prev = st->ncopies ? &st->copies[st->ncopies - 1] : NULL;
+
+	assert(st->used + len <= st->segsize);
+
+	if (prev && prev->src + prev->len == src && prev->dst + prev->len == dst)
+		prev->len += len;
+	else {
+		struct staging_copy *c = &st->copies[st->ncopies++];
+
+		c->src = src;
+		c->dst = dst;
+		c->len = len;
+	}
+
+	struct glvertex *ret = (struct glvertex *)(st->base + st->used);
+	st->used += len;
+
+	return ret;
+}
+
+/* Copy the frame's uploads into the vertex buffer */
+static void staging_end(struct render_gl *gl)
+{
+	struct staging *st = gl->staging;
+
+	glBindBuffer(GL_COPY_READ_BUFFER, st->bufid);
+	if (st->map == NULL)
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+	st->base = NULL;
+
+	if (st->ncopies) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, gl->vtxbufid);
+
+		for(unsigned i = 0; i < st->ncopies; i++)
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+					    st->copies[i].src, st->copies[i].dst,
+					    st->copies[i].len);
+
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		st->fence[st->seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	GLERROR();
+
+	gl->r.upload_bytes += st->used;
+	gl->r.upload_transfers += st->ncopies;
+}
+
+static struct render *gl_create(int num_patches)
+{
+	struct render_gl *gl = malloc(sizeof(*gl));
+
+	if (gl == NULL)
+		return NULL;
+
+	gl->r.backend = &render_gl;
+	gl->r.upload_bytes = 0;
+	gl->r.upload_transfers = 0;
+	gl->r.upload_stalled = 0;
+	gl->r.upload_busy = 0;
+	gl->r.upload_deferred = 0;
+	gl->r.swaps_refused = 0;
+	gl->npatches = num_patches;
+	gl->pending = -1;
+	gl->normal_tex = 0;
+	gl->colour_tex = 0;
+	gl->colour_pages = 0;
+
+	gl->nregions = 1;
+	gl->region = gl->next = NULL;
+	gl->switched = gl->drawn = NULL;
+	gl->nswitched = 0;
+	gl->bases = NULL;
+	gl->frame = 1;
+	gl->completed = 0;
+	for(int i = 0; i < FRAME_FENCES; i++)
+		gl->fence[i].sync = 0;
+
+	if (DEBUG) {
+		printf("vendor: %s\n", glGetString(GL_VENDOR));
+		printf("renderer: %s\n", glGetString(GL_RENDERER));
+		printf("version: %s\n", glGetString(GL_VERSION));
+	}
+
+	const GLubyte *extensions = glGetString(GL_EXTENSIONS);
+
+	if (have_vbo == -1) {
+		if (strncmp("1.5", (char *)glGetString(GL_VERSION), 3) == 0)
+			have_vbo = 1;
+		else
+			have_vbo = gluCheckExtension((GLubyte *)"GL_ARB_vertex_buffer_object",
+						     extensions);
+	}
+
+	if (have_cva == -1)
+		have_cva = gluCheckExtension((GLubyte *)"GL_EXT_compiled_vertex_array",
+					     extensions);
+
+	if (have_basevertex == -1)
+		have_basevertex = gluCheckExtension((GLubyte *)"GL_ARB_draw_elements_base_vertex",
+						    extensions);
+
+	if (have_staging == -1)
+		have_staging =
+			gluCheckExtension((GLubyte *)"GL_ARB_copy_buffer", extensions) &&
+			gluCheckExtension((GLubyte *)"GL_ARB_map_buffer_range", extensions) &&
+			gluCheckExtension((GLubyte *)"GL_ARB_sync", extensions);
+
+	if (have_persistent == -1)
+		have_persistent = gluCheckExtension((GLubyte *)"GL_ARB_buffer_storage",
+						    extensions);
+
+	if (have_sync == -1)
+		have_sync = gluCheckExtension((GLubyte *)"GL_ARB_sync", extensions);
+
+	if (have_texarray == -1)
+		have_texarray = gluCheckExtension((GLubyte *)"GL_EXT_texture_array", extensions);
+
+	if (have_multitexture == -1)
+		have_multitexture = gluCheckExtension((GLubyte *)"GL_ARB_multitexture",
+						      extensions);
+
+	if (have_s3tc == -1)
+		have_s3tc = gluCheckExtension((GLubyte *)"GL_EXT_texture_compression_s3tc",
+					      extensions);
+
+	if (DEBUG)
+		printf("vbo: %d  cva:%d  basevertex:%d  staging:%d  persistent:%d\n",
+		       have_vbo, have_cva, have_basevertex, have_staging, have_persistent);
+
+	if (have_vbo) {
+		glGenBuffers(1, &gl->vtxbufid);
+		GLERROR();
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+		glBufferData(GL_ARRAY_BUFFER,
+			     sizeof(struct glvertex) * VERTICES_PER_PATCH * (num_patches + 1),
+			     NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		GLERROR();
+		gl->varray = NULL;
+
+		gl->staging = have_staging ? staging_create(num_patches) : NULL;
+
+		if (index_bufid == 0) {
+			glGenBuffers(1, &index_bufid);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_bufid);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+				     sizeof(patch_indices) + sizeof(patch_skirt_indices),
+				     NULL, GL_STATIC_DRAW);
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0,
+					sizeof(patch_indices), patch_indices);
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(patch_indices),
+					sizeof(patch_skirt_indices), patch_skirt_indices);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		}
+
+		/* offsets into the index buffer */
+		for(int k = 0; k < 9; k++)
+			gl->r.indices[k] = (const void *)(k * sizeof(patch_indices[0]));
+		gl->r.indices[9] = (const void *)sizeof(patch_indices);
+	} else {
+		gl->varray = malloc(sizeof(struct glvertex) * VERTICES_PER_PATCH * (num_patches + 1));
+		gl->vtxbufid = 0;
+		gl->staging = NULL;
+
+		if (gl->varray == NULL) {
+			free(gl);
+			return NULL;
+		}
+
+		for(int k = 0; k < 9; k++)
+			gl->r.indices[k] = patch_indices[k];
+		gl->r.indices[9] = patch_skirt_indices;
+	}
+
+	/* moving vertices about in the buffer needs copy_buffer */
+	gl->r.can_swap = gl->varray != NULL || have_staging;
+	gl->r.colour_blocks = COMPACT_VERTEX && have_multitexture && have_s3tc;
+
+#if COMPACT_VERTEX
+	for(int j = 0; j < MESH_SAMPLES; j++)
+		for(int i = 0; i < MESH_SAMPLES; i++) {
+			mesh_texcoords[j * MESH_SAMPLES + i][0] = i;
+			mesh_texcoords[j * MESH_SAMPLES + i][1] = PATCH_SAMPLES - j;
+		}
+
+	if (USE_SKIRTS)
+		for(int k = 0; k < SKIRT_SAMPLES; k++) {
+			int i, j;
+
+			skirt_edge(k, &i, &j);
+			mesh_texcoords[MESH_SAMPLES * MESH_SAMPLES + k][0] = i;
+			mesh_texcoords[MESH_SAMPLES * MESH_SAMPLES + k][1] = PATCH_SAMPLES - j;
+		}
+
+	if (have_vbo && texcoord_bufid == 0) {
+		glGenBuffers(1, &texcoord_bufid);
+		glBindBuffer(GL_ARRAY_BUFFER, texcoord_bufid);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(mesh_texcoords), mesh_texcoords,
+			     GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		GLERROR();
+	}
+#endif
+
+	return &gl->r;
+}
+
+static void free_regions(struct render_gl *gl)
+{
+	for(int i = 0; i < FRAME_FENCES; i++)
+		if (gl->fence[i].sync) {
+			glDeleteSync(gl->fence[i].sync);
+			gl->fence[i].sync = 0;
+		}
+
+	free(gl->region);
+	free(gl->next);
+	free(gl->switched);
+	free(gl->drawn);
+	free(gl->bases);
+	gl->region = gl->next = NULL;
+	gl->switched = gl->drawn = NULL;
+	gl->bases = NULL;
+	gl->nregions = 1;
+}
+
+static void gl_destroy(struct render *r)
+{
+	struct render_gl *gl = to_gl(r);
+
+	free_regions(gl);
+	if (gl->normal_tex)
+		glDeleteTextures(1, &gl->normal_tex);
+	if (gl->colour_tex)
+		glDeleteTextures(1, &gl->colour_tex);
+	if (gl->staging)
+		staging_destroy(gl->staging);
+	if (gl->vtxbufid)
+		glDeleteBuffers(1, &gl->vtxbufid);
+	free(gl->varray);
+	free(gl);
+}
+
+/*
+   Vertex regions.  The vertex buffer normally holds one copy of the
+   pool's vertex storage, so a patch which is regenerated is written
+   over vertices which earlier frames, perhaps still being drawn by
+   the GPU, read from; the driver then has to hold the write back
+   until they're done.  With n regions there are n copies, and each
+   slot draws from one of its n regions.  A slot's new vertices go to
+   a region the GPU has finished with, and the slot is only switched
+   to it after the writes have been issued, so the GPU never has to
+   wait for itself and never draws a half-written patch.  A fence at
+   the end of each frame's draws says when it has finished with a
+   frame; fences complete in order, so the latest one to have
+   signalled covers all the frames before it.
+ */
+int render_gl_configure(struct render *r, int regions)
+{
+	struct render_gl *gl = to_gl(r);
+	int n = gl->npatches;
+
+	if (regions < 1 || regions > MAX_REGIONS)
+		return 0;
+	if (regions > 1 && !(have_vbo && have_sync))
+		return 0;
+
+	free_regions(gl);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+	glBufferData(GL_ARRAY_BUFFER,
+		     sizeof(struct glvertex) * VERTICES_PER_PATCH * (n + 1) * regions,
+		     NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	GLERROR();
+
+	if (regions == 1)
+		return 1;
+
+	gl->region = calloc(n, sizeof(*gl->region));
+	gl->next = calloc(n, sizeof(*gl->next));
+	gl->switched = malloc(sizeof(*gl->switched) * n);
+	gl->drawn = calloc(n * regions, sizeof(*gl->drawn));
+	gl->bases = malloc(sizeof(*gl->bases) * n);
+
+	if (gl->region == NULL || gl->next == NULL || gl->switched == NULL ||
+	    gl->drawn == NULL || gl->bases == NULL) {
+		free_regions(gl);
+		return 0;
+	}
+
+	gl->nregions = regions;
+	gl->nswitched = 0;
+
+	return 1;
+}
+
+/* The vertex offset of a slot's region */
+static inline unsigned region_offset(const struct render_gl *gl, unsigned slot, int region)
+{
+	return (region * (gl->npatches + 1) + slot) * VERTICES_PER_PATCH;
+}
+
+/* Catch up with the frames the GPU has finished */
+static void poll_frames(struct render_gl *gl)
+{
+	for(int i = 0; i < FRAME_FENCES; i++) {
+		struct frame_fence *f = &gl->fence[i];
+
+		if (f->sync == 0 ||
+		    glClientWaitSync(f->sync, 0, 0) == GL_TIMEOUT_EXPIRED)
+			continue;
+
+		if (f->frame > gl->completed)
+			gl->completed = f->frame;
+		glDeleteSync(f->sync);
+		f->sync = 0;
+	}
+}
+
+/* A region to write slot's new vertices into: the one drawn from
+   longest ago, other than the one being drawn from now.  If even
+   that may still be in use, -1 if defer is set, so the slot goes on
+   drawing from its current region until a later frame (the caller
+   counts it); otherwise it's written anyway (the GPU will
+   serialise), and counted. */
+static int free_region(struct render_gl *gl, unsigned slot, int defer)
+{
+	const unsigned *drawn = &gl->drawn[slot * gl->nregions];
+	int best = -1;
+
+	for(int k = 0; k < gl->nregions; k++)
+		if (k != gl->region[slot] && (best == -1 || drawn[k] < drawn[best]))
+			best = k;
+
+	if (drawn[best] > gl->completed) {
+		if (defer)
+			return -1;
+		gl->r.upload_busy++;
+	}
+
+	return best;
+}
+
+/* Point the draw list at the slots' current regions, and note that
+   this frame draws from them */
+static const GLint *region_bases(struct render_gl *gl, const struct quadtree *qt)
+{
+	if (gl->nregions == 1)
+		return qt->draw_base;
+
+	for(unsigned k = 0; k < qt->ndraws; k++) {
+		unsigned slot = qt->draw_base[k] / VERTICES_PER_PATCH;
+		int reg = gl->region[slot];
+
+		gl->drawn[slot * gl->nregions + reg] = gl->frame;
+		gl->bases[k] = region_offset(gl, slot, reg);
+	}
+
+	return gl->bases;
+}
+
+/* Fence the end of the frame's draws */
+static void end_frame(struct render_gl *gl)
+{
+	if (gl->nregions == 1)
+		return;
+
+	struct frame_fence *f = &gl->fence[gl->frame % FRAME_FENCES];
+
+	/* if it's still there, a later fence will do instead */
+	if (f->sync)
+		glDeleteSync(f->sync);
+
+	f->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f->frame = gl->frame++;
+}
+
+static void gl_upload_begin(struct render *r)
+{
+	struct render_gl *gl = to_gl(r);
+
+	if (gl->nregions > 1)
+		poll_frames(gl);
+
+	if (gl->staging)
+		staging_begin(gl);
+	else if (have_vbo)
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+}
+
+/* Send local[] on its way */
+static void flush_local(struct render_gl *gl)
+{
+	if (gl->pending == -1)
+		return;
+
+	glBufferSubData(GL_ARRAY_BUFFER, gl->pending * sizeof(struct glvertex),
+			sizeof(gl->local), gl->local);
+	gl->r.upload_bytes += sizeof(gl->local);
+	gl->r.upload_transfers++;
+	gl->pending = -1;
+}
+
+/* Where the vertices go: staging memory, the vertex array itself, or
+   a temporary to upload from */
+static struct glvertex *gl_upload(struct render *r, unsigned offset, int defer)
+{
+	struct render_gl *gl = to_gl(r);
+
+	if (gl->nregions > 1) {
+		unsigned slot = offset / VERTICES_PER_PATCH;
+		int reg = free_region(gl, slot, defer);
+
+		if (reg == -1) {
+			gl->r.upload_deferred++;
+			return NULL;
+		}
+
+		gl->next[slot] = reg;
+		gl->switched[gl->nswitched++] = slot;
+		offset = region_offset(gl, slot, gl->next[slot]);
+	}
+
+	if (gl->staging)
+		return staging_alloc(gl->staging, offset * sizeof(struct glvertex));
+
+	if (gl->varray)
+		return &gl->varray[offset];
+
+	flush_local(gl);
+	gl->pending = offset;
+	return gl->local;
+}
+
+static void gl_upload_end(struct render *r)
+{
+	struct render_gl *gl = to_gl(r);
+
+	if (gl->staging)
+		staging_end(gl);
+	else if (have_vbo) {
+		flush_local(gl);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	/* the writes are in, so later draws can use them */
+	for(unsigned i = 0; i < gl->nswitched; i++) {
+		unsigned slot = gl->switched[i];
+
+		gl->region[slot] = gl->next[slot];
+	}
+	gl->nswitched = 0;
+}
+
+static int gl_swap(struct render *r, unsigned a, unsigned b)
+{
+	struct render_gl *gl = to_gl(r);
+	GLsizeiptr len = sizeof(struct glvertex) * VERTICES_PER_PATCH;
+
+	if (gl->varray) {
+		struct glvertex tmpv[VERTICES_PER_PATCH];
+
+		memcpy(tmpv, &gl->varray[a], len);
+		memcpy(&gl->varray[a], &gl->varray[b], len);
+		memcpy(&gl->varray[b], tmpv, len);
+		return 1;
+	}
+
+	/* each into a free region of the other's slot */
+	if (gl->nregions > 1) {
+		unsigned sa = a / VERTICES_PER_PATCH, sb = b / VERTICES_PER_PATCH;
+		int ra = free_region(gl, sa, 1);
+		int rb = ra == -1 ? -1 : free_region(gl, sb, 1);
+
+		if (rb == -1) {
+			gl->r.swaps_refused++;
+			return 0;
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+		glCopyBufferSubData(GL_ARRAY_BUFFER, GL_ARRAY_BUFFER,
+				    sizeof(struct glvertex) * region_offset(gl, sb, gl->region[sb]),
+				    sizeof(struct glvertex) * region_offset(gl, sa, ra), len);
+		glCopyBufferSubData(GL_ARRAY_BUFFER, GL_ARRAY_BUFFER,
+				    sizeof(struct glvertex) * region_offset(gl, sa, gl->region[sa]),
+				    sizeof(struct glvertex) * region_offset(gl, sb, rb), len);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		gl->region[sa] = ra;
+		gl->region[sb] = rb;
+		return 1;
+	}
+
+	/* via the spare slot at the end of the buffer */
+	glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+	GLintptr spare = sizeof(struct glvertex) * VERTICES_PER_PATCH * gl->npatches;
+
+	glCopyBufferSubData(GL_ARRAY_BUFFER, GL_ARRAY_BUFFER,
+			    sizeof(struct glvertex) * a, spare, len);
+	glCopyBufferSubData(GL_ARRAY_BUFFER, GL_ARRAY_BUFFER,
+			    sizeof(struct glvertex) * b,
+			    sizeof(struct glvertex) * a, len);
+	glCopyBufferSubData(GL_ARRAY_BUFFER, GL_ARRAY_BUFFER,
+			    spare, sizeof(struct glvertex) * b, len);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	return 1;
+}
+
+/* Normal map tiles go into a texture array with a layer per slot,
+   for a shader to light with; the fixed-function drawing here
+   doesn't use them */
+static void gl_normals(struct render *r, unsigned offset, const unsigned char (*tile)[4])
+{
+	struct render_gl *gl = to_gl(r);
+
+	if (!have_texarray)
+		return;
+
+	if (gl->normal_tex == 0) {
+		glGenTextures(1, &gl->normal_tex);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, gl->normal_tex);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, PATCH_TILE, PATCH_TILE,
+			     gl->npatches, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	} else
+		glBindTexture(GL_TEXTURE_2D_ARRAY, gl->normal_tex);
+
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, offset / VERTICES_PER_PATCH,
+			PATCH_TILE, PATCH_TILE, 1, GL_RGBA, GL_UNSIGNED_BYTE, tile);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	GLERROR();
+}
+
+unsigned render_gl_normal_maps(const struct render *r)
+{
+	return ((const struct render_gl *)r)->normal_tex;
+}
+
+/* Colour tiles go into an atlas texture, a page per PATCH_TILE
+   square, which is drawn on texture unit 1 in place of the vertex
+   colours.  The texture matrix picks a patch's page out of the
+   atlas using the compact texcoords, so without them there's no
+   atlas.  It's BC1 coded if GL can take that. */
+static void gl_colour(struct render *r, unsigned page, unsigned npages,
+		      const void *tile)
+{
+	struct render_gl *gl = to_gl(r);
+
+	if (!COMPACT_VERTEX || !have_multitexture)
+		return;
+
+	glActiveTexture(GL_TEXTURE1);
+
+	if (gl->colour_tex == 0 || gl->colour_pages != npages) {
+		unsigned cols = 1, rows;
+		GLint max;
+
+		while(cols * cols < npages)
+			cols++;
+		rows = (npages + cols - 1) / cols;
+
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+		if (cols * PATCH_TILE > (unsigned)max) {
+			glActiveTexture(GL_TEXTURE0);
+			return;
+		}
+
+		if (gl->colour_tex == 0)
+			glGenTextures(1, &gl->colour_tex);
+		glBindTexture(GL_TEXTURE_2D, gl->colour_tex);
+		glTexImage2D(GL_TEXTURE_2D, 0,
+			     r->colour_blocks ? texcomp_gl_format(TEXCOMP_BC1) : GL_RGBA8,
+			     cols * PATCH_TILE, rows * PATCH_TILE,
+			     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		gl->colour_pages = npages;
+		gl->colour_cols = cols;
+		gl->colour_rows = rows;
+	} else
+		glBindTexture(GL_TEXTURE_2D, gl->colour_tex);
+
+	if (r->colour_blocks)
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, 0,
+					  page % gl->colour_cols * PATCH_TILE,
+					  page / gl->colour_cols * PATCH_TILE,
+					  PATCH_TILE, PATCH_TILE, texcomp_gl_format(TEXCOMP_BC1),
+					  texcomp_size(TEXCOMP_BC1, PATCH_TILE, PATCH_TILE), tile);
+	else
+		glTexSubImage2D(GL_TEXTURE_2D, 0,
+				page % gl->colour_cols * PATCH_TILE,
+				page / gl->colour_cols * PATCH_TILE,
+				PATCH_TILE, PATCH_TILE, GL_RGBA, GL_UNSIGNED_BYTE, tile);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	GLERROR();
+}
+
+/* set up vertex array pointers, starting at vertex offset "offset" */
+static void set_array_pointers(const struct render_gl *gl, unsigned offset)
+{
+	glVertexPointer(3, COMPACT_VERTEX ? GL_SHORT : GL_FLOAT, sizeof(struct glvertex),
+			(char *)&gl->varray[offset] + offsetof(struct glvertex, x));
+	glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(struct glvertex),
+		       (char *)&gl->varray[offset] + offsetof(struct glvertex, col));
+#if !COMPACT_VERTEX
+	glTexCoordPointer(2, GL_SHORT, sizeof(struct glvertex),
+			  (char *)&gl->varray[offset] + offsetof(struct glvertex, s));
+#endif
+	glNormalPointer(GL_BYTE, sizeof(struct glvertex),
+			(char *)&gl->varray[offset] + offsetof(struct glvertex, nx));
+}
+
+/* Compact vertices all share one set of texcoords, which index
+   offsets apply to just as they do to the other arrays */
+static void set_texcoord_pointer(const struct render_gl *gl)
+{
+#if COMPACT_VERTEX
+	if (have_vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, texcoord_bufid);
+		glTexCoordPointer(2, GL_SHORT, 0, NULL);
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+	} else
+		glTexCoordPointer(2, GL_SHORT, 0, mesh_texcoords);
+#endif
+}
+
+/* Push a modelview matrix which maps p's compact vertex positions,
+   and those of every patch in its frame, to where they belong */
+static void patch_transform(const struct patch *p)
+{
+	glPushMatrix();
+	glTranslatef(p->origin.x, p->origin.y, p->origin.z);
+	glScalef(p->scale, p->scale, p->scale);
+}
+
+/* Set up texture unit 1 to draw the colour atlas, modulating
+   whatever unit 0 gives, with the compact texcoords */
+static void colour_begin(const struct render_gl *gl)
+{
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, gl->colour_tex);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glClientActiveTexture(GL_TEXTURE1);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	set_texcoord_pointer(gl);
+	glClientActiveTexture(GL_TEXTURE0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/* Draw p with its colour tile, if it has one, rather than its vertex
+   colours; *tiled says whether the last patch did */
+static void patch_colour(const struct render_gl *gl, const struct patch *p, int *tiled)
+{
+	int tile = (p->flags & PF_COLOUR) != 0;
+
+	glActiveTexture(GL_TEXTURE1);
+
+	if (tile) {
+		/* texcoord (i, PATCH_SAMPLES-j) to texel (i,j) of the
+		   tile, as quadtree_priv.h lays it out, in the page */
+		float w = gl->colour_cols * PATCH_TILE;
+		float h = gl->colour_rows * PATCH_TILE;
+		float x = p->page % gl->colour_cols * PATCH_TILE;
+		float y = p->page / gl->colour_cols * PATCH_TILE;
+		float scale = (PATCH_TILE - 1.f) / PATCH_SAMPLES;
+		GLfloat m[16] = {
+			[0] = scale / w,
+			[5] = -scale / h,
+			[10] = 1,
+			[12] = (x + .5f) / w,
+			[13] = (y + PATCH_TILE - .5f) / h,
+			[15] = 1,
+		};
+
+		glMatrixMode(GL_TEXTURE);
+		glLoadMatrixf(m);
+		glMatrixMode(GL_MODELVIEW);
+	}
+
+	if (tile != *tiled) {
+		if (tile) {
+			glEnable(GL_TEXTURE_2D);
+			glDisableClientState(GL_COLOR_ARRAY);
+			glColor4ub(255, 255, 255, 255);
+		} else {
+			glDisable(GL_TEXTURE_2D);
+			glEnableClientState(GL_COLOR_ARRAY);
+		}
+		*tiled = tile;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+}
+
+static void colour_end(void)
+{
+	glActiveTexture(GL_TEXTURE1);
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glDisable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glClientActiveTexture(GL_TEXTURE1);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTexture(GL_TEXTURE0);
+	glActiveTexture(GL_TEXTURE0);
+	glEnableClientState(GL_COLOR_ARRAY);
+}
+
+/* Draw p's vertex normals */
+static void patch_annotate(const struct render_gl *gl, const struct patch *p)
+{
+	const struct glvertex *va = &gl->varray[p->vertex_offset];
+
+	glPushAttrib(GL_ENABLE_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+
+	glBegin(GL_LINES);
+	for(int i = 0; i < MESH_SAMPLES * MESH_SAMPLES; i++) {
+		const struct glvertex *v = &va[i];
+		vec3_t pos = VEC3(p->origin.x + v->x * p->scale,
+				  p->origin.y + v->y * p->scale,
+				  p->origin.z + v->z * p->scale);
+
+		glColor3ubv(v->col);
+		glVertex3fv(pos.v);
+		glVertex3f(pos.x + v->nx, pos.y + v->ny, pos.z + v->nz);
+	}
+	glEnd();
+
+	glPopAttrib();
+}
+
+static void patch_bbox(const struct patch *p)
+{
+	const box_t *b = &p->bbox;
+
+	glBegin(GL_LINES);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z + b->extent.z);
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+
+	glVertex3f(b->centre.x - b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y + b->extent.y,
+		   b->centre.z - b->extent.z);
+	glVertex3f(b->centre.x + b->extent.x,
+		   b->centre.y - b->extent.y,
+		   b->centre.z - b->extent.z);
+
+	glEnd();
+
+}
+
+static void patch_outline(const struct quadtree *qt, const struct patch *p)
+{
+	vec3_t sph[4];
+	int radius = qt->radius;
+
+	patch_corner_normals(qt, p, sph);
+	for(int i = 0; i < 4; i++)
+		vec3_scale(&sph[i], radius);
+
+	glBegin(GL_LINE_LOOP);
+	for(int i = 0; i < 4; i++)
+		glVertex3fv(sph[i].v);
+	glEnd();
+}
+
+/* Display the culling planes of the last update */
+static void draw_cullplanes(const struct quadtree *qt)
+{
+	static const float col[] = {
+		0,0,1,	/* blue - left */
+		0,1,0,	/* green - right */
+		1,0,0,	/* red - top */
+		1,0,1,	/* magenta - bottom */
+		1,1,0,	/* yellow - near */
+		1,1,1,	/* white - far */
+		0,1,1,	/* cyan - horizion */
+	};
+
+	glPushAttrib(GL_ENABLE_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+
+	glBegin(GL_LINES);
+	for(int i = 0; i < 7; i++) {
+		vec3_t v = qt->cullplanes[i].normal;
+
+		/* scale and flip to be vector from origin
+		   rather than normal vector */
+		vec3_scale(&v, -qt->cullplanes[i].dist);
+
+		glColor3fv(&col[i * 3]);
+
+		glVertex3fv(v.v);
+
+		/* draw partial length so that all sides have
+		   some chance of being seen */
+		vec3_scale(&v, .75);
+		glVertex3fv(v.v);
+	}
+	glEnd();
+	glPopAttrib();
+}
+
+/* Draw the visible patches from the draw list.  The array pointers
+   are set once and each draw's base vertex selects its patch.  If
+   there's no per-patch state to set up between draws, the draws of
+   each state group which share a frame (see pack_vertices()) are
+   drawn with one call, under one transform. */
+static void render_draws(const struct render_gl *gl, const struct quadtree *qt,
+			 const GLint *base, void (*prerender)(const struct patch *p),
+			 void (*bind)(void *arg, unsigned state), void *arg)
+{
+	set_array_pointers(gl, 0);
+
+	for(unsigned g = 0; g < qt->ngroups; g++) {
+		unsigned end = qt->group_start[g + 1];
+
+		if (bind)
+			(*bind)(arg, qt->group_state[g]);
+
+		for(unsigned k = qt->group_start[g], next; k < end; k = next) {
+			const struct patch *p = qt->draw_patch[k];
+
+			next = k + 1;
+			if (prerender)
+				(*prerender)(p);
+			else
+				while(next < end && qt->draw_frame[next] == qt->draw_frame[k])
+					next++;
+
+			if (COMPACT_VERTEX)
+				patch_transform(p);
+
+			glMultiDrawElementsBaseVertex(PATCH_PRIMITIVE, qt->draw_count + k,
+						      PATCH_INDEX_TYPE, qt->draw_indices + k,
+						      next - k, base + k);
+
+			if (COMPACT_VERTEX)
+				glPopMatrix();
+		}
+	}
+
+	if (ANNOTATE && !have_vbo)
+		for(unsigned k = 0; k < qt->ndraws; k++)
+			patch_annotate(gl, qt->draw_patch[k]);
+
+	GLERROR();
+}
+
+static void gl_draw(struct render *r, const struct quadtree *qt,
+		    void (*prerender)(const struct patch *p),
+		    void (*bind)(void *arg, unsigned state), void *arg)
+{
+	struct render_gl *gl = to_gl(r);
+
+	assert(have_vbo != -1);
+	assert(have_cva != -1);
+	assert(have_basevertex != -1);
+
+	if (ANNOTATE)
+		draw_cullplanes(qt);
+
+	if (have_vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vtxbufid);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_bufid);
+		GLERROR();
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+
+	if (!USE_INDEX)
+		set_array_pointers(gl, 0);
+
+	set_texcoord_pointer(gl);
+
+	/* the per-patch scale in the modelview matrix scales the
+	   normals too */
+	if (COMPACT_VERTEX)
+		glEnable(GL_RESCALE_NORMAL);
+
+	struct list_head *pp;
+
+	const GLint *base = region_bases(gl, qt);
+	int tiled = 0;
+
+	/* The compact texcoords are only one patch's worth, so a base
+	   vertex would take the atlas texcoords past their end; with
+	   the atlas the array pointers are set for each patch instead */
+	if (gl->colour_tex)
+		colour_begin(gl);
+
+	if (USE_INDEX && have_basevertex && gl->colour_tex == 0)
+		render_draws(gl, qt, base, prerender, bind, arg);
+	else for(unsigned g = 0; g < qt->ngroups; g++) {
+		if (bind)
+			(*bind)(arg, qt->group_state[g]);
+
+		for(unsigned k = qt->group_start[g]; k < qt->group_start[g + 1]; k++) {
+			const struct patch *p = qt->draw_patch[k];
+
+			if (prerender)
+				(*prerender)(p);
+
+			if (gl->colour_tex)
+				patch_colour(gl, p, &tiled);
+
+			if (USE_INDEX) {
+				set_array_pointers(gl, base[k]);
+
+				if (COMPACT_VERTEX)
+					patch_transform(p);
+
+				glDrawRangeElements(PATCH_PRIMITIVE,
+						    0, VERTICES_PER_PATCH,
+						    qt->draw_count[k], PATCH_INDEX_TYPE,
+						    qt->draw_indices[k]);
+
+				if (COMPACT_VERTEX)
+					glPopMatrix();
+			} else
+				glDrawArrays(GL_TRIANGLE_STRIP, base[k],
+					     VERTICES_PER_PATCH);
+
+			if (ANNOTATE && !have_vbo)
+				patch_annotate(gl, p);
+
+			GLERROR();
+		}
+	}
+
+	if (gl->colour_tex)
+		colour_end();
+
+	if (1 || ANNOTATE) {
+		glPushAttrib(GL_ENABLE_BIT);
+		glDisable(GL_LIGHTING);
+		glDisable(GL_TEXTURE_2D);
+
+		list_for_each(pp, &qt->culled) {
+			const struct patch *p = list_entry(pp, struct patch, list);
+			const box_t *b = &p->bbox;
+
+			glColor3f(1,1,0);
+			glBegin(GL_POINTS);
+			glVertex3fv(b->centre.v);
+			glEnd();
+
+			if (p->flags & PF_LATECULL)
+				glColor3f(p->priority, 0, p->priority);
+			else if (p->phase == qt->phase)
+				glColor3f(p->priority, p->priority, 0);
+			else
+				glColor3f(p->priority, p->priority, p->priority);
+			patch_outline(qt, p);
+
+			glColor3f(.75,0,0);
+			//patch_bbox(p);
+		}
+		glPopAttrib();
+	}
+
+	if (have_vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+
+	if (COMPACT_VERTEX)
+		glDisable(GL_RESCALE_NORMAL);
+
+	end_frame(gl);
+	GLERROR();
+}
+
+const struct render_backend render_gl = {
+	.name = "gl",
+	.create = gl_create,
+	.destroy = gl_destroy,
+	.upload_begin = gl_upload_begin,
+	.upload = gl_upload,
+	.upload_end = gl_upload_end,
+	.swap = gl_swap,
+	.normals = gl_normals,
+	.colour = gl_colour,
+	.draw = gl_draw,
+};
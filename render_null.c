@@ -0,0 +1,206 @@
+/*
+   Null render backend.  Nothing is drawn; the vertices are kept in
+   memory, and each upload, swap and draw is appended to a command
+   log which can be inspected or cleared.  It needs no GL context.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/gl.h>
+
+#include "quadtree.h"
+#include "quadtree_priv.h"
+#include "render.h"
+
+struct render_null {
+	struct render r;
+
+	int npatches;
+	struct glvertex *varray;
+
+	unsigned ncmds, maxcmds;
+	struct render_cmd *cmds;
+};
+
+static inline struct render_null *to_null(struct render *r)
+{
+	return (struct render_null *)r;
+}
+
+/* The next command in the log, growing it as needed.  If it can't
+   grow, the command is dropped. */
+static struct render_cmd *record(struct render_null *nr, enum render_op op)
+{
+	static struct render_cmd discard;
+	struct render_cmd *c;
+
+	if (nr->ncmds == nr->maxcmds) {
+		unsigned max = nr->maxcmds ? nr->maxcmds * 2 : 1024;
+		struct render_cmd *cmds = realloc(nr->cmds, sizeof(*cmds) * max);
+
+		if (cmds == NULL)
+			return &discard;
+
+		nr->cmds = cmds;
+		nr->maxcmds = max;
+	}
+
+	c = &nr->cmds[nr->ncmds++];
+	memset(c, 0, sizeof(*c));
+	c->op = op;
+
+	return c;
+}
+
+static struct render *null_create(int num_patches)
+{
+	struct render_null *nr = malloc(sizeof(*nr));
+
+	if (nr == NULL)
+		return NULL;
+
+	nr->varray = malloc(sizeof(struct glvertex) * VERTICES_PER_PATCH * (num_patches + 1));
+	if (nr->varray == NULL) {
+		free(nr);
+		return NULL;
+	}
+
+	nr->r.backend = &render_null;
+	nr->r.can_swap = 1;
+	nr->r.upload_bytes = 0;
+	nr->r.upload_transfers = 0;
+	nr->r.upload_stalled = 0;
+	nr->r.upload_busy = 0;
+	nr->r.upload_deferred = 0;
+	nr->r.swaps_refused = 0;
+
+	for(int k = 0; k < 9; k++)
+		nr->r.indices[k] = patch_indices[k];
+	nr->r.indices[9] = patch_skirt_indices;
+
+	nr->npatches = num_patches;
+	nr->ncmds = nr->maxcmds = 0;
+	nr->cmds = NULL;
+
+	return &nr->r;
+}
+
+static void null_destroy(struct render *r)
+{
+	struct render_null *nr = to_null(r);
+
+	free(nr->cmds);
+	free(nr->varray);
+	free(nr);
+}
+
+static void null_upload_begin(struct render *r)
+{
+}
+
+static struct glvertex *null_upload(struct render *r, unsigned offset, int defer)
+{
+	struct render_null *nr = to_null(r);
+
+	record(nr, RENDER_UPLOAD)->offset = offset;
+
+	r->upload_bytes += sizeof(struct glvertex) * VERTICES_PER_PATCH;
+	r->upload_transfers++;
+
+	return &nr->varray[offset];
+}
+
+static void null_upload_end(struct render *r)
+{
+}
+
+static int null_swap(struct render *r, unsigned a, unsigned b)
+{
+	struct render_null *nr = to_null(r);
+	size_t len = sizeof(struct glvertex) * VERTICES_PER_PATCH;
+	struct render_cmd *c = record(nr, RENDER_SWAP);
+
+	c->offset = a;
+	c->other = b;
+
+	/* via the spare slot, as render_gl does */
+	struct glvertex *spare = &nr->varray[VERTICES_PER_PATCH * nr->npatches];
+
+	memcpy(spare, &nr->varray[a], len);
+	memcpy(&nr->varray[a], &nr->varray[b], len);
+	memcpy(&nr->varray[b], spare, len);
+
+	return 1;
+}
+
+static void null_normals(struct render *r, unsigned offset, const unsigned char (*tile)[4])
+{
+	record(to_null(r), RENDER_NORMALS)->offset = offset;
+}
+
+static void null_colour(struct render *r, unsigned page, unsigned npages,
+			const void *tile)
+{
+	struct render_cmd *c = record(to_null(r), RENDER_COLOUR);
+
+	c->offset = page;
+	c->other = npages;
+}
+
+static void null_draw(struct render *r, const struct quadtree *qt,
+		      void (*prerender)(const struct patch *p),
+		      void (*bind)(void *arg, unsigned state), void *arg)
+{
+	struct render_null *nr = to_null(r);
+
+	for(unsigned g = 0; g < qt->ngroups; g++) {
+		if (bind)
+			record(nr, RENDER_BIND)->other = qt->group_state[g];
+
+		for(unsigned k = qt->group_start[g]; k < qt->group_start[g + 1]; k++) {
+			struct render_cmd *c = record(nr, RENDER_DRAW);
+			const void *idx = qt->draw_indices[k];
+
+			c->offset = qt->draw_base[k];
+			c->count = qt->draw_count[k];
+			c->patch = qt->draw_patch[k];
+			c->nclass = 9;
+			for(int n = 0; n < 9; n++)
+				if (idx == r->indices[n])
+					c->nclass = n;
+		}
+	}
+
+	record(nr, RENDER_FRAME)->count = qt->ndraws;
+}
+
+const struct render_cmd *render_null_commands(const struct render *r, unsigned *count)
+{
+	const struct render_null *nr = (const struct render_null *)r;
+
+	*count = nr->ncmds;
+	return nr->cmds;
+}
+
+void render_null_clear(struct render *r)
+{
+	to_null(r)->ncmds = 0;
+}
+
+const struct glvertex *render_null_vertices(const struct render *r)
+{
+	return ((const struct render_null *)r)->varray;
+}
+
+const struct render_backend render_null = {
+	.name = "null",
+	.create = null_create,
+	.destroy = null_destroy,
+	.upload_begin = null_upload_begin,
+	.upload = null_upload,
+	.upload_end = null_upload_end,
+	.swap = null_swap,
+	.normals = null_normals,
+	.colour = null_colour,
+	.draw = null_draw,
+};
@@ -0,0 +1,869 @@
+/*
+   Software render backend.  The quadtree's draw list is rasterised
+   on the CPU into the backend's own colour and depth buffers, which
+   can then be written out as a PPM; no GL is needed.
+
+   Drawing is in two passes.  First the patches' vertices are
+   transformed and lit, their triangles are clipped to the near plane
+   and set up as edge and attribute plane equations, and each
+   triangle is binned into the screen tiles its bounds cover.  Then
+   the tiles are shared out between worker threads, each of which
+   rasterises its tiles' bins in draw order, four pixels at a time.
+   Since a tile only ever belongs to one thread and its triangles are
+   drawn in a fixed order, the image doesn't depend on the number of
+   threads.
+
+   Shading matches the fixed-function state renderbench and test.c
+   use: the vertex colour lit by one directional light with 0.2
+   ambient, interpolated linearly across the screen.  A patch with a
+   normal map tile is lit per pixel from the tile instead, with its
+   unlit colour interpolated and the tile coordinates interpolated
+   with perspective.  A patch with a colour tile takes its colour
+   from the tile the same way, lit by whichever of those applies.
+   The prerender and bind hooks (and so texturing) aren't
+   supported.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <GL/gl.h>
+
+#include "geom.h"
+#include "quadtree.h"
+#include "quadtree_priv.h"
+#include "render.h"
+#include "simd.h"
+#include "texcomp.h"
+
+#define TILE_SIZE	64	/* pixels; a multiple of LANES */
+#define MAX_THREADS	64
+#define SUBPIXEL	16	/* vertex positions are snapped to 1/SUBPIXEL */
+
+/* A triangle ready to rasterise.  The edge functions are positive
+   inside; the attribute planes give depth and colour at a pixel
+   centre.  The depth is 1/w, which is linear in screen space and,
+   unlike z/w, keeps its precision when the near plane is tiny
+   compared to the distance to the terrain; nearer is larger.  With a
+   normal map tile, the colour is unlit; with a colour tile, it's the
+   light alone.  With either, the tile coordinates are planes of u/w
+   and v/w. */
+struct tri {
+	float ea[3], eb[3];		/* edge k is ea*x + eb*y + ec */
+	double ec[3];
+	int topleft[3];			/* edge k includes its own pixels */
+
+	float plane[6][3];		/* 1/w, r, g, b, u/w, v/w as a*x + b*y + c */
+	const unsigned char (*tile)[4];	/* normal map, or NULL */
+	const unsigned char (*page)[4];	/* colour tile, or NULL */
+
+	int x0, y0, x1, y1;		/* pixel bounds, inclusive */
+};
+
+/* Each tile's triangles, in draw order */
+struct bin {
+	unsigned n, max;
+	unsigned *tris;
+};
+
+/* A clip-space vertex, its colour (lit unless there's a normal map)
+   and its tile coordinates in texels */
+struct cvert {
+	float pos[4];
+	float col[3];
+	float uv[2];
+};
+
+struct render_soft {
+	struct render r;
+
+	int npatches;
+	struct glvertex *varray;
+
+	matrix_t mat;			/* object to clip space */
+	vec3_t light;			/* unit vector towards the light */
+
+	/* Normal map tiles, one per slot, allocated when the first
+	   arrives; tile is the one for the patch being set up */
+	patch_tile_t *tiles;
+	const unsigned char (*tile)[4];
+
+	/* The colour atlas's pages, allocated when the first arrives,
+	   and the patch being set up's page */
+	patch_tile_t *pages;
+	unsigned npages;
+	const unsigned char (*page)[4];
+
+	int width, height;
+	int tiles_x, tiles_y;
+	int stride;			/* pixels per buffer row */
+	unsigned *colour;		/* RGBA, bottom row first */
+	float *depth;
+
+	unsigned ntris, maxtris;
+	struct tri *tris;
+	struct bin *bins;
+
+	/* Worker threads, and the frame they're working on.  The
+	   drawing thread works on tiles too. */
+	int nthreads;
+	pthread_t threads[MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t go, done;
+	unsigned frame;
+	unsigned start_frame;		/* frame when the workers started */
+	int busy;			/* workers still on this frame */
+	int quit;
+	unsigned next_tile;
+};
+
+static inline struct render_soft *to_soft(struct render *r)
+{
+	return (struct render_soft *)r;
+}
+
+static struct tri *new_tri(struct render_soft *s)
+{
+	if (s->ntris == s->maxtris) {
+		unsigned max = s->maxtris ? s->maxtris * 2 : 4096;
+		struct tri *t = realloc(s->tris, sizeof(*t) * max);
+
+		if (t == NULL)
+			return NULL;
+		s->tris = t;
+		s->maxtris = max;
+	}
+
+	return &s->tris[s->ntris];
+}
+
+static void bin_add(struct bin *b, unsigned tri)
+{
+	if (b->n == b->max) {
+		unsigned max = b->max ? b->max * 2 : 64;
+		unsigned *t = realloc(b->tris, sizeof(*t) * max);
+
+		if (t == NULL)
+			return;
+		b->tris = t;
+		b->max = max;
+	}
+
+	b->tris[b->n++] = tri;
+}
+
+/* Set up a triangle from clip-space vertices (all in front of the
+   near plane) and bin it */
+static void setup(struct render_soft *s, const struct cvert *v0,
+		  const struct cvert *v1, const struct cvert *v2)
+{
+	const struct cvert *v[3] = { v0, v1, v2 };
+	float x[3], y[3], z[3];
+
+	for(int k = 0; k < 3; k++) {
+		float w = 1 / v[k]->pos[3];
+
+		x[k] = (v[k]->pos[0] * w * .5f + .5f) * s->width;
+		y[k] = (v[k]->pos[1] * w * .5f + .5f) * s->height;
+		z[k] = w;
+
+		x[k] = roundf(x[k] * SUBPIXEL) / SUBPIXEL;
+		y[k] = roundf(y[k] * SUBPIXEL) / SUBPIXEL;
+	}
+
+	/* twice the signed area; anticlockwise is front-facing */
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+
+	if (!(area > 0))
+		return;
+
+	/* pixel centres are at +.5 */
+	int x0 = ceilf(fminf(x[0], fminf(x[1], x[2])) - .5f);
+	int y0 = ceilf(fminf(y[0], fminf(y[1], y[2])) - .5f);
+	int x1 = floorf(fmaxf(x[0], fmaxf(x[1], x[2])) - .5f);
+	int y1 = floorf(fmaxf(y[0], fmaxf(y[1], y[2])) - .5f);
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > s->width - 1)
+		x1 = s->width - 1;
+	if (y1 > s->height - 1)
+		y1 = s->height - 1;
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	struct tri *t = new_tri(s);
+
+	if (t == NULL)
+		return;
+
+	/* edge k runs between the two vertices other than k, so
+	   it's 0 at them and area at vertex k */
+	for(int k = 0; k < 3; k++) {
+		int j = (k + 1) % 3, l = (k + 2) % 3;
+
+		t->ea[k] = y[j] - y[l];
+		t->eb[k] = x[l] - x[j];
+		t->ec[k] = -((double)t->ea[k] * x[j] + (double)t->eb[k] * y[j]);
+		t->topleft[k] = t->ea[k] > 0 || (t->ea[k] == 0 && t->eb[k] < 0);
+	}
+
+	const float *attr[6] = { z };
+	float col[3][3], uv[2][3];
+	int nattr = s->tile || s->page ? 6 : 4;
+
+	for(int c = 0; c < 3; c++) {
+		for(int k = 0; k < 3; k++)
+			col[c][k] = v[k]->col[c];
+		attr[c + 1] = col[c];
+	}
+
+	for(int c = 0; c < 2; c++) {
+		for(int k = 0; k < 3; k++)
+			uv[c][k] = v[k]->uv[c] * z[k];
+		attr[c + 4] = uv[c];
+	}
+
+	t->tile = s->tile;
+	t->page = s->page;
+
+	float inv = 1 / area;
+
+	for(int a = 0; a < nattr; a++) {
+		float pa = 0, pb = 0;
+		double pc = 0;
+
+		for(int k = 0; k < 3; k++) {
+			pa += t->ea[k] * attr[a][k];
+			pb += t->eb[k] * attr[a][k];
+			pc += t->ec[k] * attr[a][k];
+		}
+		t->plane[a][0] = pa * inv;
+		t->plane[a][1] = pb * inv;
+		t->plane[a][2] = pc * inv;
+	}
+
+	t->x0 = x0;
+	t->y0 = y0;
+	t->x1 = x1;
+	t->y1 = y1;
+
+	unsigned idx = s->ntris++;
+
+	for(int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+		for(int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+			bin_add(&s->bins[ty * s->tiles_x + tx], idx);
+}
+
+static void lerp(struct cvert *out, const struct cvert *a, const struct cvert *b, float t)
+{
+	for(int i = 0; i < 4; i++)
+		out->pos[i] = a->pos[i] + (b->pos[i] - a->pos[i]) * t;
+	for(int i = 0; i < 3; i++)
+		out->col[i] = a->col[i] + (b->col[i] - a->col[i]) * t;
+	for(int i = 0; i < 2; i++)
+		out->uv[i] = a->uv[i] + (b->uv[i] - a->uv[i]) * t;
+}
+
+/* Clip a triangle to the near plane (z >= -w) and set up what's
+   left.  Triangles wholly outside one of the other planes are
+   dropped here; the rest are left to the screen bounds. */
+static void triangle(struct render_soft *s, const struct cvert *v0,
+		     const struct cvert *v1, const struct cvert *v2)
+{
+	const struct cvert *v[3] = { v0, v1, v2 };
+	unsigned out[3] = { 0, 0, 0 };
+
+	for(int k = 0; k < 3; k++) {
+		const float *p = v[k]->pos;
+
+		out[k] = (p[0] < -p[3]) << 0 | (p[0] > p[3]) << 1 |
+			 (p[1] < -p[3]) << 2 | (p[1] > p[3]) << 3 |
+			 (p[2] < -p[3]) << 4 | (p[2] > p[3]) << 5;
+	}
+
+	if (out[0] & out[1] & out[2])
+		return;
+
+	if (((out[0] | out[1] | out[2]) & (1 << 4)) == 0) {
+		setup(s, v0, v1, v2);
+		return;
+	}
+
+	/* Sutherland-Hodgman against the near plane; a triangle
+	   becomes at most a quad */
+	struct cvert poly[4];
+	int n = 0;
+
+	for(int k = 0; k < 3; k++) {
+		const struct cvert *a = v[k], *b = v[(k + 1) % 3];
+		float da = a->pos[2] + a->pos[3];
+		float db = b->pos[2] + b->pos[3];
+
+		if (da >= 0)
+			poly[n++] = *a;
+		if ((da >= 0) != (db >= 0))
+			lerp(&poly[n++], a, b, da / (da - db));
+	}
+
+	for(int k = 2; k < n; k++)
+		setup(s, &poly[0], &poly[k - 1], &poly[k]);
+}
+
+/* Where mesh vertex k falls in a tile */
+static void vertex_uv(int k, float uv[2])
+{
+	int i, j;
+
+	if (k < MESH_SAMPLES * MESH_SAMPLES) {
+		i = k % MESH_SAMPLES;
+		j = k / MESH_SAMPLES;
+	} else
+		skirt_edge(k - MESH_SAMPLES * MESH_SAMPLES, &i, &j);
+
+	uv[0] = i * (PATCH_TILE - 1.f) / PATCH_SAMPLES;
+	uv[1] = j * (PATCH_TILE - 1.f) / PATCH_SAMPLES;
+}
+
+/* Transform and light a patch's vertices; if it has a normal map,
+   the lighting is left to the rasteriser, and if it has a colour
+   tile, so is the colour */
+static void patch_vertices(struct render_soft *s, const struct patch *p,
+			   const struct glvertex *va, struct cvert *cv)
+{
+	const float *m = s->mat.m;
+	v4sf c0 = { m[0], m[1], m[2], m[3] };
+	v4sf c1 = { m[4], m[5], m[6], m[7] };
+	v4sf c2 = { m[8], m[9], m[10], m[11] };
+	v4sf c3 = { m[12], m[13], m[14], m[15] };
+
+	/* fold the patch's origin and scale into the matrix */
+	c3 += c0 * p->origin.x + c1 * p->origin.y + c2 * p->origin.z;
+	c0 *= p->scale;
+	c1 *= p->scale;
+	c2 *= p->scale;
+
+	s->tile = NULL;
+	if (s->tiles && (p->flags & PF_NORMALS))
+		s->tile = s->tiles[p->vertex_offset / VERTICES_PER_PATCH];
+
+	s->page = NULL;
+	if (s->pages && (p->flags & PF_COLOUR) && p->page < s->npages)
+		s->page = s->pages[p->page];
+
+	for(int i = 0; i < VERTICES_PER_PATCH; i++) {
+		const struct glvertex *g = &va[i];
+		v4sf pos = c0 * (float)g->x + c1 * (float)g->y + c2 * (float)g->z + c3;
+		/* the normals are used as they're stored, without
+		   renormalising, as GL does */
+		vec3_t n = VEC3(g->nx / 127.f, g->ny / 127.f, g->nz / 127.f);
+		float d = vec3_dot(&n, &s->light);
+		float lit = .2f + (d > 0 ? d : 0);
+
+		if (s->tile)
+			lit = 1;
+		if (s->tile || s->page)
+			vertex_uv(i, cv[i].uv);
+
+		memcpy(cv[i].pos, &pos, sizeof(cv[i].pos));
+		for(int c = 0; c < 3; c++) {
+			float f = (s->page ? 255 : g->col[c]) * lit;
+
+			cv[i].col[c] = f < 255 ? f : 255;
+		}
+	}
+}
+
+/* Texel (fu,fv) of a tile, bilinearly filtered */
+static inline void tile_texel(const unsigned char (*tile)[4], float fu, float fv, float out[3])
+{
+	/* lanes outside the triangle can be anything */
+	if (!(fu > 0))
+		fu = 0;
+	if (!(fv > 0))
+		fv = 0;
+	if (fu > PATCH_TILE - 1)
+		fu = PATCH_TILE - 1;
+	if (fv > PATCH_TILE - 1)
+		fv = PATCH_TILE - 1;
+
+	int iu = fu < PATCH_TILE - 1 ? (int)fu : PATCH_TILE - 2;
+	int iv = fv < PATCH_TILE - 1 ? (int)fv : PATCH_TILE - 2;
+	float au = fu - iu, av = fv - iv;
+	const unsigned char *t00 = tile[iv * PATCH_TILE + iu];
+	const unsigned char *t10 = t00 + 4;
+	const unsigned char *t01 = t00 + PATCH_TILE * 4;
+	const unsigned char *t11 = t01 + 4;
+
+	for(int k = 0; k < 3; k++) {
+		float a = t00[k] + (t10[k] - t00[k]) * au;
+		float b = t01[k] + (t11[k] - t01[k]) * au;
+
+		out[k] = a + (b - a) * av;
+	}
+}
+
+/* Light four pixels, at tile coordinates u,v, from t's normal map */
+static v4sf tile_light(const struct render_soft *s, const struct tri *t, v4sf u, v4sf v)
+{
+	v4sf lit;
+
+	for(int l = 0; l < LANES; l++) {
+		float n[3], d = 0;
+
+		tile_texel(t->tile, u[l], v[l], n);
+		for(int k = 0; k < 3; k++)
+			d += (n[k] - 127.5f) * (1 / 127.5f) * s->light.v[k];
+
+		lit[l] = .2f + (d > 0 ? d : 0);
+	}
+
+	return lit;
+}
+
+/* Four pixels' colours, at tile coordinates u,v, from t's colour
+   tile, as 0..1 */
+static void tile_colour(const struct tri *t, v4sf u, v4sf v, v4sf rgb[3])
+{
+	for(int l = 0; l < LANES; l++) {
+		float c[3];
+
+		tile_texel(t->page, u[l], v[l], c);
+		for(int k = 0; k < 3; k++)
+			rgb[k][l] = c[k] * (1 / 255.f);
+	}
+}
+
+/* Rasterise t over the part of tile (tx,ty) it covers */
+static void raster(struct render_soft *s, const struct tri *t, int tx, int ty)
+{
+	int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+	int x1 = x0 + TILE_SIZE - 1, y1 = y0 + TILE_SIZE - 1;
+
+	if (t->x0 > x0)
+		x0 = t->x0 & ~(LANES - 1);
+	if (t->y0 > y0)
+		y0 = t->y0;
+	if (t->x1 < x1)
+		x1 = t->x1;
+	if (t->y1 < y1)
+		y1 = t->y1;
+
+	const v4sf lane = { 0, 1, 2, 3 };
+	v4sf ea[3], step[3];
+	v4si tl[3];
+
+	for(int k = 0; k < 3; k++) {
+		ea[k] = v4sf_splat(t->ea[k]) * lane;
+		step[k] = v4sf_splat(t->ea[k] * LANES);
+		tl[k] = (v4si){ 0, 0, 0, 0 } - t->topleft[k];
+	}
+
+	for(int y = y0; y <= y1; y++) {
+		float py = y + .5f;
+		v4sf e[3];
+
+		for(int k = 0; k < 3; k++)
+			e[k] = v4sf_splat((double)t->ea[k] * (x0 + .5) +
+					  (double)t->eb[k] * py + t->ec[k]) + ea[k];
+
+		unsigned *crow = &s->colour[y * s->stride];
+		float *zrow = &s->depth[y * s->stride];
+
+		for(int x = x0; x <= x1; x += LANES) {
+			v4si in = (e[0] > 0) | ((e[0] == 0) & tl[0]);
+
+			in &= (e[1] > 0) | ((e[1] == 0) & tl[1]);
+			in &= (e[2] > 0) | ((e[2] == 0) & tl[2]);
+
+			for(int k = 0; k < 3; k++)
+				e[k] += step[k];
+
+			if (!v4si_any(in))
+				continue;
+
+			v4sf px = v4sf_splat(x + .5f) + lane;
+			v4sf z = px * t->plane[0][0] + (py * t->plane[0][1] + t->plane[0][2]);
+			v4sf zbuf;
+
+			memcpy(&zbuf, &zrow[x], sizeof(zbuf));
+			in &= z > zbuf;
+			if (!v4si_any(in))
+				continue;
+
+			zbuf = v4sf_select(in, z, zbuf);
+			memcpy(&zrow[x], &zbuf, sizeof(zbuf));
+
+			v4si rgb[3];
+			v4sf lit = v4sf_splat(1);
+			v4sf col[3] = { lit, lit, lit };
+
+			if (t->tile || t->page) {
+				v4sf w = v4sf_splat(1) / z;
+				v4sf u = (px * t->plane[4][0] + (py * t->plane[4][1] + t->plane[4][2])) * w;
+				v4sf v = (px * t->plane[5][0] + (py * t->plane[5][1] + t->plane[5][2])) * w;
+
+				if (t->tile)
+					lit = tile_light(s, t, u, v);
+				if (t->page)
+					tile_colour(t, u, v, col);
+			}
+
+			for(int c = 0; c < 3; c++) {
+				const float *pl = t->plane[c + 1];
+				v4sf f = (px * pl[0] + (py * pl[1] + pl[2])) * lit * col[c];
+
+				rgb[c] = __builtin_convertvector(v4sf_clamp(0, 255, f + .5f), v4si);
+			}
+
+			v4si pix = rgb[0] | rgb[1] << 8 | rgb[2] << 16 | (int)0xff000000;
+			v4si old;
+
+			memcpy(&old, &crow[x], sizeof(old));
+			pix = (in & pix) | (~in & old);
+			memcpy(&crow[x], &pix, sizeof(pix));
+		}
+	}
+}
+
+/* Draw tiles until there are none left */
+static void raster_tiles(struct render_soft *s)
+{
+	unsigned ntiles = s->tiles_x * s->tiles_y;
+	unsigned tile;
+
+	while((tile = __atomic_fetch_add(&s->next_tile, 1, __ATOMIC_RELAXED)) < ntiles) {
+		const struct bin *b = &s->bins[tile];
+
+		for(unsigned i = 0; i < b->n; i++)
+			raster(s, &s->tris[b->tris[i]], tile % s->tiles_x, tile / s->tiles_x);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct render_soft *s = arg;
+	unsigned frame = s->start_frame;
+
+	pthread_mutex_lock(&s->lock);
+	for(;;) {
+		while(!s->quit && s->frame == frame)
+			pthread_cond_wait(&s->go, &s->lock);
+		if (s->quit)
+			break;
+		frame = s->frame;
+		pthread_mutex_unlock(&s->lock);
+
+		raster_tiles(s);
+
+		pthread_mutex_lock(&s->lock);
+		if (--s->busy == 0)
+			pthread_cond_signal(&s->done);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void stop_threads(struct render_soft *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->quit = 1;
+	pthread_cond_broadcast(&s->go);
+	pthread_mutex_unlock(&s->lock);
+
+	for(int i = 0; i < s->nthreads - 1; i++)
+		pthread_join(s->threads[i], NULL);
+
+	s->quit = 0;
+	s->nthreads = 1;
+}
+
+static void free_buffers(struct render_soft *s)
+{
+	if (s->bins)
+		for(int i = 0; i < s->tiles_x * s->tiles_y; i++)
+			free(s->bins[i].tris);
+	free(s->bins);
+	free(s->colour);
+	free(s->depth);
+	s->bins = NULL;
+	s->colour = NULL;
+	s->depth = NULL;
+}
+
+int render_soft_configure(struct render *r, int width, int height, int threads)
+{
+	struct render_soft *s = to_soft(r);
+
+	stop_threads(s);
+	free_buffers(s);
+
+	s->width = width;
+	s->height = height;
+	s->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	s->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	s->stride = s->tiles_x * TILE_SIZE;
+
+	size_t pixels = (size_t)s->stride * s->tiles_y * TILE_SIZE;
+
+	s->colour = malloc(sizeof(*s->colour) * pixels);
+	s->depth = malloc(sizeof(*s->depth) * pixels);
+	s->bins = calloc(s->tiles_x * s->tiles_y, sizeof(*s->bins));
+	if (s->colour == NULL || s->depth == NULL || s->bins == NULL) {
+		free_buffers(s);
+		return 0;
+	}
+
+	static const unsigned char black[3] = { 0, 0, 0 };
+
+	render_soft_clear(r, black);
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads < 1)
+		threads = 1;
+
+	s->start_frame = s->frame;
+	while(s->nthreads < threads) {
+		if (pthread_create(&s->threads[s->nthreads - 1], NULL, worker, s) != 0)
+			break;
+		s->nthreads++;
+	}
+
+	return 1;
+}
+
+void render_soft_view(struct render *r, const matrix_t *mat, const vec3_t *light)
+{
+	struct render_soft *s = to_soft(r);
+
+	s->mat = *mat;
+	s->light = *light;
+	vec3_normalize(&s->light);
+}
+
+void render_soft_clear(struct render *r, const unsigned char rgb[3])
+{
+	struct render_soft *s = to_soft(r);
+	size_t pixels = (size_t)s->stride * s->tiles_y * TILE_SIZE;
+	unsigned pix = rgb[0] | rgb[1] << 8 | rgb[2] << 16 | 0xffu << 24;
+
+	for(size_t i = 0; i < pixels; i++) {
+		s->colour[i] = pix;
+		s->depth[i] = 0;
+	}
+}
+
+int render_soft_write_ppm(const struct render *r, const char *path)
+{
+	const struct render_soft *s = (const struct render_soft *)r;
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL)
+		return 0;
+
+	fprintf(f, "P6\n%d %d\n255\n", s->width, s->height);
+
+	for(int y = s->height - 1; y >= 0; y--) {
+		unsigned char row[s->width * 3];
+		const unsigned *c = &s->colour[y * s->stride];
+
+		for(int x = 0; x < s->width; x++) {
+			row[x * 3 + 0] = c[x];
+			row[x * 3 + 1] = c[x] >> 8;
+			row[x * 3 + 2] = c[x] >> 16;
+		}
+		fwrite(row, 3, s->width, f);
+	}
+
+	return fclose(f) == 0;
+}
+
+static struct render *soft_create(int num_patches)
+{
+	struct render_soft *s = calloc(1, sizeof(*s));
+
+	if (s == NULL)
+		return NULL;
+
+	s->varray = malloc(sizeof(struct glvertex) * VERTICES_PER_PATCH * (num_patches + 1));
+	if (s->varray == NULL) {
+		free(s);
+		return NULL;
+	}
+
+	s->r.backend = &render_soft;
+	s->r.can_swap = 1;
+
+	for(int k = 0; k < 9; k++)
+		s->r.indices[k] = patch_indices[k];
+	s->r.indices[9] = patch_skirt_indices;
+
+	s->npatches = num_patches;
+	s->mat = MATRIX_IDENT;
+	s->light = VEC3(0, 0, 1);
+	s->nthreads = 1;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->go, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	if (!render_soft_configure(&s->r, 256, 256, 0)) {
+		free(s->varray);
+		free(s);
+		return NULL;
+	}
+
+	return &s->r;
+}
+
+static void soft_destroy(struct render *r)
+{
+	struct render_soft *s = to_soft(r);
+
+	stop_threads(s);
+	free_buffers(s);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->go);
+	pthread_cond_destroy(&s->done);
+	free(s->tris);
+	free(s->tiles);
+	free(s->pages);
+	free(s->varray);
+	free(s);
+}
+
+static void soft_upload_begin(struct render *r)
+{
+}
+
+static struct glvertex *soft_upload(struct render *r, unsigned offset, int defer)
+{
+	r->upload_bytes += sizeof(struct glvertex) * VERTICES_PER_PATCH;
+	r->upload_transfers++;
+
+	return &to_soft(r)->varray[offset];
+}
+
+static void soft_upload_end(struct render *r)
+{
+}
+
+static int soft_swap(struct render *r, unsigned a, unsigned b)
+{
+	struct render_soft *s = to_soft(r);
+	size_t len = sizeof(struct glvertex) * VERTICES_PER_PATCH;
+	struct glvertex *spare = &s->varray[VERTICES_PER_PATCH * s->npatches];
+
+	memcpy(spare, &s->varray[a], len);
+	memcpy(&s->varray[a], &s->varray[b], len);
+	memcpy(&s->varray[b], spare, len);
+
+	return 1;
+}
+
+static void soft_normals(struct render *r, unsigned offset, const unsigned char (*tile)[4])
+{
+	struct render_soft *s = to_soft(r);
+
+	if (s->tiles == NULL &&
+	    (s->tiles = malloc(sizeof(*s->tiles) * s->npatches)) == NULL)
+		return;
+
+	memcpy(s->tiles[offset / VERTICES_PER_PATCH], tile, sizeof(patch_tile_t));
+}
+
+static void soft_colour(struct render *r, unsigned page, unsigned npages,
+			const void *tile)
+{
+	struct render_soft *s = to_soft(r);
+
+	if (s->npages != npages) {
+		free(s->pages);
+		s->pages = malloc(sizeof(*s->pages) * npages);
+		s->npages = s->pages ? npages : 0;
+	}
+
+	if (page >= s->npages)
+		return;
+
+	if (r->colour_blocks)
+		texcomp_decode(TEXCOMP_BC1, s->pages[page][0], tile, PATCH_TILE, PATCH_TILE);
+	else
+		memcpy(s->pages[page], tile, sizeof(patch_tile_t));
+}
+
+static void soft_draw(struct render *r, const struct quadtree *qt,
+		      void (*prerender)(const struct patch *p),
+		      void (*bind)(void *arg, unsigned state), void *arg)
+{
+	struct render_soft *s = to_soft(r);
+	struct cvert cv[VERTICES_PER_PATCH];
+
+	s->ntris = 0;
+	for(int i = 0; i < s->tiles_x * s->tiles_y; i++)
+		s->bins[i].n = 0;
+
+	for(unsigned k = 0; k < qt->ndraws; k++) {
+		const patch_index_t *idx = qt->draw_indices[k];
+		unsigned count = qt->draw_count[k];
+
+		patch_vertices(s, qt->draw_patch[k], &s->varray[qt->draw_base[k]], cv);
+
+#define INDEX(i)	(USE_INDEX ? idx[i] : (i))
+		if (PATCH_LISTS)
+			for(unsigned i = 0; i + 2 < count; i += 3)
+				triangle(s, &cv[INDEX(i)], &cv[INDEX(i + 1)], &cv[INDEX(i + 2)]);
+		else
+			for(unsigned i = 2; i < count; i++) {
+				unsigned a = INDEX(i - 2), b = INDEX(i - 1), c = INDEX(i);
+
+				if (a == b || b == c || a == c)
+					continue;	/* joins strips */
+
+				/* every other triangle of a strip is
+				   wound the other way */
+				if (i & 1)
+					triangle(s, &cv[b], &cv[a], &cv[c]);
+				else
+					triangle(s, &cv[a], &cv[b], &cv[c]);
+			}
+#undef INDEX
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->next_tile = 0;
+	s->busy = s->nthreads - 1;
+	s->frame++;
+	pthread_cond_broadcast(&s->go);
+	pthread_mutex_unlock(&s->lock);
+
+	raster_tiles(s);
+
+	pthread_mutex_lock(&s->lock);
+	while(s->busy)
+		pthread_cond_wait(&s->done, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+const struct render_backend render_soft = {
+	.name = "soft",
+	.create = soft_create,
+	.destroy = soft_destroy,
+	.upload_begin = soft_upload_begin,
+	.upload = soft_upload,
+	.upload_end = soft_upload_end,
+	.swap = soft_swap,
+	.normals = soft_normals,
+	.colour = soft_colour,
+	.draw = soft_draw,
+};
@@ -0,0 +1,554 @@
+/*
+   Measure the cost of drawing the terrain.  A fixed camera path is
+   flown over a fractal planet, and the time spent updating the
+   quadtree and submitting its draws is reported along with the
+   vertex and index counts.  It runs headless through EGL into a
+   framebuffer object, so it works with Mesa's software rasteriser
+   and needs no window system.
+
+   It's built twice, as renderbench and renderbench-skirts, to
+   compare stitching with skirts (USE_SKIRTS).
+
+   With -n the quadtree draws through the null backend instead, so
+   only the LOD update and vertex generation are measured; no GL is
+   needed at all.  With -s it draws with the software rasteriser,
+   on -t threads (one per CPU by default), and -o writes the last
+   frame to a PPM.
+
+   -l flies low instead, looking at the horizon, twice round a loop
+   over terrain with more than three times the relief.  Much of
+   what's drawn is then hidden behind nearer hills, and the second
+   time round passes over the same ground.
+
+   -f draws the patches front to back.  With GL, the fragments which
+   pass the depth test are counted, to measure overdraw.
+
+   -m draws with quadtree_render_batched(), giving each patch its
+   cube face as a state key, and counts the state changes.
+
+   -b keeps that many copies of each patch's vertices in GL (see
+   render_gl_configure()), and counts the uploads put off to a later
+   frame because every copy the patch isn't drawn from might still
+   be in use, the slot swaps put off for the same reason, and the
+   writes to such copies for new patches, which have nothing else to
+   draw.
+
+   -N makes normal map tiles for the patches on worker threads (see
+   quadtree_normal_maps()); the software rasteriser lights with them.
+   The tiles still waiting are counted each frame, and those dropped
+   because their patches went out of view before they were made,
+   and the share of the patches drawn which had their tile.
+   -V makes colour tiles too, kept in an atlas of that many pages (see
+   quadtree_colour_tiles()), and gives the share of the patches drawn
+   which had their tile, and counts those which found it already
+   made.  With -c the workers BC1 code the colour tiles
+   (if GL can take them, when drawing with GL).
+
+   -e drops the octaves each sample's detail can't show, as the demo
+   does, and checks after every update that the patches agree on the
+   heights of the samples they share (see quadtree_check_edges()),
+   counting those which don't.  The check isn't included in the
+   times.
+
+   Usage: renderbench [-l] [-f] [-m] [-N] [-V pages [-c]] [-e] [-n | -s [-t threads] [-o file.ppm] | -b regions] [frames]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "geom.h"
+#include "noise.h"
+#include "quadtree.h"
+#include "quadtree_priv.h"
+#include "render.h"
+
+#define WIDTH		960
+#define HEIGHT		544
+#define RADIUS		(1<<20)
+#define PATCHES		500
+
+static struct fractal *frac;
+static int check_edges;
+static float relief = .03f;		/* heights, as a fraction of RADIUS */
+
+static elevation_t generate(const struct sample *s, struct vertex *vtx)
+{
+	float octaves = check_edges ? fractal_octaves(frac, 1, s->detail, 8) : 8;
+	float h = fractal_fBm(frac, s->normal.v, octaves);
+	int c = h < -1 ? 0 : h > 1 ? 254 : 127 + h * 127;
+	unsigned char col[4] = { c, 96 + c / 2, 64, 255 };
+
+	vertex_set_colour(vtx, col);
+
+	return h * RADIUS * relief;
+}
+
+/* Six "materials", one per cube face */
+static unsigned face_state(void *arg, const struct patch *p)
+{
+	return patch_face(p);
+}
+
+static void count_bind(void *arg, unsigned state)
+{
+	(*(unsigned long *)arg)++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int init_gl(void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getdisplay;
+	EGLDisplay dpy;
+	EGLConfig config;
+	EGLContext ctx;
+	EGLint n;
+
+	static const EGLint config_attr[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	static const EGLint ctx_attr[] = {
+		EGL_CONTEXT_OPENGL_PROFILE_MASK,
+		EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	getdisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+		eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getdisplay == NULL)
+		return 0;
+
+	dpy = getdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL))
+		return 0;
+
+	if (!eglBindAPI(EGL_OPENGL_API) ||
+	    !eglChooseConfig(dpy, config_attr, &config, 1, &n) || n == 0)
+		return 0;
+
+	ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, ctx_attr);
+	if (ctx == EGL_NO_CONTEXT ||
+	    !eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx))
+		return 0;
+
+	GLuint fb, rb[2];
+
+	glGenFramebuffers(1, &fb);
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
+	glGenRenderbuffers(2, rb);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, rb[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				  GL_RENDERBUFFER, rb[0]);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, rb[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, WIDTH, HEIGHT);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+				  GL_RENDERBUFFER, rb[1]);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		return 0;
+
+	glViewport(0, 0, WIDTH, HEIGHT);
+
+	printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+	return 1;
+}
+
+/* As gluPerspective() */
+static void perspective(matrix_t *m, float fovy, float aspect, float near, float far)
+{
+	float f = 1 / tanf(fovy * M_PI / 360);
+
+	*m = (matrix_t) { .m = { 0 } };
+	m->m[0] = f / aspect;
+	m->m[5] = f;
+	m->m[10] = (far + near) / (near - far);
+	m->m[11] = -1;
+	m->m[14] = 2 * far * near / (near - far);
+}
+
+/* Camera for frame f of n: spiralling down from orbit to low
+   altitude.  The view is gluLookAt() from (0,0,-dist) to the
+   origin, then turned by angle about y. */
+static void camera(int f, int n, matrix_t *proj, matrix_t *mv, vec3_t *pos)
+{
+	float t = (float)f / n;
+	float dist = RADIUS * (3 - 1.9f * t);
+	float angle = t * 180;
+	float c = cosf(angle * M_PI / 180), s = sinf(angle * M_PI / 180);
+	matrix_t look = MATRIX_IDENT, rot = MATRIX_IDENT;
+
+	perspective(proj, 50, (float)WIDTH / HEIGHT, 10, RADIUS * 4);
+
+	look.m[0] = -1;
+	look.m[10] = -1;
+	look.m[14] = -dist;
+
+	rot.m[0] = c;
+	rot.m[2] = -s;
+	rot.m[8] = s;
+	rot.m[10] = c;
+
+	matrix_multiply(&look, &rot, mv);
+
+	*pos = VEC3(0, 0, -dist);
+	vec3_rotate(pos, pos, -angle * M_PI / 180.f, &vec_py);
+}
+
+/* As gluLookAt(), looking from eye along dir */
+static void look_along(matrix_t *m, const vec3_t *eye, const vec3_t *dir, const vec3_t *up)
+{
+	vec3_t f = *dir, s, u;
+
+	vec3_normalize(&f);
+	vec3_cross(&s, &f, up);
+	vec3_normalize(&s);
+	vec3_cross(&u, &s, &f);
+
+	*m = MATRIX_IDENT;
+	for(int k = 0; k < 3; k++) {
+		m->m[k * 4 + 0] = s.v[k];
+		m->m[k * 4 + 1] = u.v[k];
+		m->m[k * 4 + 2] = -f.v[k];
+	}
+	m->m[12] = -vec3_dot(&s, eye);
+	m->m[13] = -vec3_dot(&u, eye);
+	m->m[14] = vec3_dot(&f, eye);
+}
+
+/* The ground under the loop low_camera() flies at angle a, round
+   some of the roughest country */
+static void low_ground(float a, vec3_t *n)
+{
+	static const float r = .05f;	/* the loop's radius, on the unit sphere */
+	vec3_t c = VEC3(-.968f, -.177f, -.178f), e1, e2;
+
+	vec3_normalize(&c);
+	vec3_cross(&e1, &c, &vec_pz);
+	vec3_normalize(&e1);
+	vec3_cross(&e2, &c, &e1);
+	vec3_scale(&c, cosf(r));
+	vec3_scale(&e1, sinf(r) * cosf(a));
+	vec3_scale(&e2, sinf(r) * sinf(a));
+	vec3_add(n, &c, &e1);
+	vec3_add(n, n, &e2);
+	vec3_normalize(n);
+}
+
+static float terrain_height(const vec3_t *n)
+{
+	return fractal_fBm(frac, n->v, 8) * RADIUS * relief;
+}
+
+/* Camera for frame f of n with -l: twice round a loop a little
+   above the ground, looking ahead just below the horizon, so nearby
+   hills hide much of what's behind them. */
+static void low_camera(int f, int n, matrix_t *proj, matrix_t *mv, vec3_t *pos)
+{
+	float a = 4 * M_PI * f / n;
+	float clearance = RADIUS * .002f;
+	vec3_t ground, ahead, dir, down;
+
+	low_ground(a, &ground);
+	low_ground(a + .05f, &ahead);
+
+	/* keep above the rise in front */
+	float h = terrain_height(&ground);
+
+	for(int k = 1; k <= 4; k++) {
+		vec3_t g;
+
+		low_ground(a + k * .05f, &g);
+		h = fmaxf(h, terrain_height(&g));
+	}
+
+	*pos = ground;
+	vec3_scale(pos, RADIUS + h + clearance);
+
+	vec3_sub(&dir, &ahead, &ground);
+	vec3_normalize(&dir);
+	down = ground;
+	vec3_scale(&down, -.05f);
+	vec3_add(&dir, &dir, &down);
+
+	perspective(proj, 50, (float)WIDTH / HEIGHT, 100, RADIUS / 2);
+	look_along(mv, pos, &dir, &ground);
+}
+
+int main(int argc, char **argv)
+{
+	const struct render_backend *backend = &render_gl;
+	const char *ppm = NULL;
+	int frames = 200;
+	int threads = 0;
+	int sorted = 0;
+	int batched = 0;
+	int regions = 1;
+	int normals = 0;
+	int pages = 0;
+	int blocks = 0;
+	int low = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "lfmNV:censt:o:b:")) != -1)
+		switch(opt) {
+		case 'l':	low = 1; relief = .1f;		break;
+		case 'f':	sorted = 1;			break;
+		case 'm':	batched = 1;			break;
+		case 'N':	normals = 1;			break;
+		case 'V':	pages = atoi(optarg);		break;
+		case 'c':	blocks = 1;			break;
+		case 'e':	check_edges = 1;		break;
+		case 'n':	backend = &render_null;		break;
+		case 's':	backend = &render_soft;		break;
+		case 't':	threads = atoi(optarg);		break;
+		case 'o':	ppm = optarg;			break;
+		case 'b':	regions = atoi(optarg);		break;
+		default:
+			fprintf(stderr, "usage: renderbench [-l] [-f] [-m] [-N] [-V pages [-c]] [-e] [-n | -s [-t threads] [-o file.ppm] | -b regions] [frames]\n");
+			return 1;
+		}
+
+	if (optind < argc)
+		frames = atoi(argv[optind]);
+
+	int gl = backend == &render_gl;
+	int null = backend == &render_null;
+	int soft = backend == &render_soft;
+
+	if (gl && !init_gl()) {
+		fprintf(stderr, "renderbench: can't set up GL\n");
+		return 1;
+	}
+
+	frac = fractal_create(3, 210, 0.9, 5);
+
+	struct quadtree *qt = quadtree_create_backend(PATCHES, RADIUS, generate, NULL, NULL,
+						      backend);
+
+	if (qt == NULL) {
+		fprintf(stderr, "renderbench: can't create quadtree\n");
+		return 1;
+	}
+
+	struct render *r = quadtree_render_backend(qt);
+
+	quadtree_front_to_back(qt, sorted);
+	r->colour_blocks = blocks && (!gl || r->colour_blocks);
+
+	if (normals && !quadtree_normal_maps(qt, 1, 0)) {
+		fprintf(stderr, "renderbench: can't make normal maps\n");
+		return 1;
+	}
+
+	if (pages && !quadtree_colour_tiles(qt, pages, 0)) {
+		fprintf(stderr, "renderbench: can't make colour tiles\n");
+		return 1;
+	}
+
+	if (gl && !render_gl_configure(r, regions)) {
+		fprintf(stderr, "renderbench: can't use %d vertex regions\n", regions);
+		return 1;
+	}
+
+	if (soft && !render_soft_configure(r, WIDTH, HEIGHT, threads)) {
+		fprintf(stderr, "renderbench: can't set up software rendering\n");
+		return 1;
+	}
+
+	GLuint query = 0;
+
+	if (gl) {
+		glGenQueries(1, &query);
+		glEnable(GL_DEPTH_TEST);
+		glEnable(GL_CULL_FACE);
+		glEnable(GL_LIGHTING);
+		glEnable(GL_LIGHT0);
+		glEnable(GL_COLOR_MATERIAL);
+	}
+
+	double update = 0, submit = 0, total = 0;
+	unsigned long draws = 0, runs = 0, transforms = 0, moves = 0, indices = 0, bytes = 0;
+	unsigned long sorts = 0, fragments = 0, groups = 0, binds = 0, busy = 0, deferred = 0;
+	unsigned long refused = 0;
+	unsigned long tiles = 0, waiting = 0, cancelled = 0, lit = 0, coloured = 0, reused = 0;
+	unsigned long cracks = 0, cracked = 0;
+	unsigned long cmds[RENDER_FRAME + 1] = { 0 };
+
+	if (batched)
+		quadtree_state_keys(qt, face_state, &binds);
+
+	for(int f = 0; f < frames; f++) {
+		matrix_t mv, proj, combined;
+		vec3_t pos;
+		double start, t;
+
+		(low ? low_camera : camera)(f, frames, &proj, &mv, &pos);
+		matrix_multiply(&proj, &mv, &combined);
+
+		if (gl) {
+			glMatrixMode(GL_PROJECTION);
+			glLoadMatrixf(proj.m);
+			glMatrixMode(GL_MODELVIEW);
+			glLoadMatrixf(mv.m);
+		}
+
+		start = now();
+		quadtree_update_view(qt, &combined, &pos);
+		update += now() - start;
+
+		if (gl)
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (soft) {
+			static const unsigned char black[3];
+
+			/* a headlight, like GL's default light */
+			render_soft_view(r, &combined, &pos);
+			render_soft_clear(r, black);
+		}
+
+		if (gl)
+			glBeginQuery(GL_SAMPLES_PASSED, query);
+
+		t = now();
+		if (batched)
+			quadtree_render_batched(qt, count_bind);
+		else
+			quadtree_render(qt, NULL);
+		submit += now() - t;
+
+		if (gl) {
+			glEndQuery(GL_SAMPLES_PASSED);
+			glFinish();
+		}
+		total += now() - start;
+
+		if (check_edges) {
+			unsigned bad = quadtree_check_edges(qt);
+
+			cracks += bad;
+			cracked += bad != 0;
+		}
+
+		if (gl) {
+			GLuint passed;
+
+			glGetQueryObjectuiv(query, GL_QUERY_RESULT, &passed);
+			fragments += passed;
+		}
+
+		unsigned long b;
+		unsigned transfers;
+		float stalled;
+
+		quadtree_upload_stats(qt, &b, &transfers, &stalled);
+		bytes += b;
+		busy += r->upload_busy;
+		deferred += r->upload_deferred;
+		refused += r->swaps_refused;
+		draws += qt->ndraws;
+		runs += qt->draw_runs;
+		transforms += qt->draw_frames;
+		moves += qt->compact_moves;
+		sorts += qt->draw_sorts;
+		groups += quadtree_state_groups(qt);
+		tiles += qt->tiles_made;
+		waiting += qt->tiles_pending;
+		cancelled += qt->tiles_cancelled;
+		reused += qt->pages_reused;
+		for(unsigned k = 0; k < qt->ndraws; k++) {
+			indices += qt->draw_count[k];
+			lit += !!(qt->draw_patch[k]->flags & PF_NORMALS);
+			coloured += !!(qt->draw_patch[k]->flags & PF_COLOUR);
+		}
+
+		if (null) {
+			const struct render_cmd *c;
+			unsigned n;
+
+			c = render_null_commands(r, &n);
+			for(unsigned k = 0; k < n; k++)
+				cmds[c[k].op]++;
+			binds = cmds[RENDER_BIND];
+			render_null_clear(r);
+		}
+	}
+
+	printf("%s, %s, %s, %s backend: %d frames, %.1f patches drawn per frame\n",
+	       USE_SKIRTS ? "skirts" : "stitching",
+	       PATCH_LISTS ? "triangle lists" : "triangle strips",
+	       sorted ? "front to back" : "pool order",
+	       r->backend->name, frames, (double)draws / frames);
+	printf("  per patch:  %d vertices, %.1f indices\n",
+	       VERTICES_PER_PATCH, (double)indices / draws);
+	printf("  per frame:  %.0f vertices, %.0f indices, %.0f bytes uploaded\n",
+	       (double)draws / frames * VERTICES_PER_PATCH,
+	       (double)indices / frames, (double)bytes / frames);
+	printf("  pool:       %.1f contiguous runs drawn, %.1f slot moves per frame\n",
+	       (double)runs / frames, (double)moves / frames);
+	printf("  transforms: %.1f per frame, each for a multi-draw of %.1f patches\n",
+	       (double)transforms / frames, (double)draws / transforms);
+	if (sorted)
+		printf("  sorted:     %.2f times per frame\n", (double)sorts / frames);
+	if (batched)
+		printf("  state:      %.1f groups, %.1f binds per frame\n",
+		       (double)groups / frames, (double)binds / frames);
+	if (normals || pages)
+		printf("  tiles:      %.1f made, %.1f waiting, %.1f cancelled per frame\n",
+		       (double)tiles / frames, (double)waiting / frames,
+		       (double)cancelled / frames);
+	if (normals)
+		printf("  normals:    %.1f%% of patches drawn had their tile\n",
+		       100. * lit / draws);
+	if (pages)
+		printf("  colour:     %d pages of %s, %.1f%% of patches drawn had their tile, "
+		       "%.1f reusing tiles per frame\n",
+		       pages, r->colour_blocks ? "BC1" : "RGBA", 100. * coloured / draws,
+		       (double)reused / frames);
+	if (check_edges)
+		printf("  edges:      %lu shared samples with different heights, in %lu frames\n",
+		       cracks, cracked);
+	if (regions > 1)
+		printf("  regions:    %d, %.2f uploads and %.2f swaps deferred, "
+		       "%.2f writes to busy vertices per frame\n",
+		       regions, (double)deferred / frames, (double)refused / frames,
+		       (double)busy / frames);
+	if (gl)
+		printf("  depth:      %.0f fragments passed per frame, %.2f per pixel\n",
+		       (double)fragments / frames, (double)fragments / frames / (WIDTH * HEIGHT));
+	if (null)
+		printf("  recorded:   %.1f uploads, %.1f swaps, %.1f draws per frame\n",
+		       (double)cmds[RENDER_UPLOAD] / frames, (double)cmds[RENDER_SWAP] / frames,
+		       (double)cmds[RENDER_DRAW] / frames);
+	printf("  update %.3fms  submit %.3fms  frame %.3fms  (%.1f fps)\n",
+	       update / frames * 1e3, submit / frames * 1e3, total / frames * 1e3,
+	       frames / total);
+
+	if (soft && ppm && !render_soft_write_ppm(r, ppm)) {
+		fprintf(stderr, "renderbench: can't write %s\n", ppm);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+/*
+   Small helpers over GCC's vector extensions.  All operations are
+   done lane-by-lane with ordinary IEEE arithmetic, so a computation
+   done on a vector gives exactly the same answer in each lane as the
+   same sequence of scalar operations would.  That's what lets the
+   batch entrypoints promise the same results as the scalar ones.
+ */
+
+#define LANES	4
+
+typedef float v4sf __attribute__((vector_size(LANES * sizeof(float))));
+typedef int   v4si __attribute__((vector_size(LANES * sizeof(int))));
+
+static inline v4sf v4sf_splat(float f)
+{
+	return (v4sf){ f, f, f, f };
+}
+
+/* mask lanes are either 0 or ~0, as produced by vector comparisons */
+static inline v4sf v4sf_select(v4si mask, v4sf a, v4sf b)
+{
+	return (v4sf)((mask & (v4si)a) | (~mask & (v4si)b));
+}
+
+static inline v4sf v4sf_abs(v4sf f)
+{
+	return (v4sf)((v4si)f & 0x7fffffff);
+}
+
+static inline int v4si_any(v4si mask)
+{
+	return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+/* Same as (int)floor(f) in each lane, for f in int range */
+static inline v4si v4sf_floor(v4sf f)
+{
+	v4si n = __builtin_convertvector(f, v4si);
+
+	/* truncation rounded negative values up; comparisons are -1
+	   when true */
+	return n + (f < __builtin_convertvector(n, v4sf));
+}
+
+/* Same semantics as the scalar clamp() in noise.c */
+static inline v4sf v4sf_clamp(float min, float max, v4sf f)
+{
+	f = v4sf_select(f < v4sf_splat(min), v4sf_splat(min), f);
+	f = v4sf_select(f < v4sf_splat(max), f, v4sf_splat(max));
+
+	return f;
+}
+
+#endif	/* _SIMD_H */
@@ -11,26 +11,41 @@
 
 #include "quadtree.h"
 #include "noise.h"
+#include "noisegraph.h"
+#include "terrain_kernel.h"
+#include "basemap.h"
+#include "gentexture.h"
 #include "font.h"
 
 #define RADIUS (1<<20)
 
 #define LABELS 1
-
-GLuint buildtexture(float variance);
+#define NOISEGRAPH 0		/* generate terrain from a noise graph */
+#ifndef KERNEL
+#define KERNEL 0		/* use the generated kernel instead of the octave cache;
+				   make USE_KERNEL=1 sets it */
+#endif
+#define BASEMAP 1		/* bake the continents into a base map */
+#define BASEMAP_SIZE 256
+#define BASEMAP_FILE "basemap.cache"
 
 static struct quadtree *qt;
 
 static float elevation, bearing;
 static int wireframe = 0;
 static int update_view = 1;
+static int upload_stats = 0;
+static int check_edges = 0;	/* check for cracks after each update */
+static int front_to_back = 0;
 
 static int animate = 0;
 
 static struct fractal *frac;
 static float maxvariance, variance, offset;
 
-static GLuint texture;
+/* The planet texture, which without labels colours the terrain */
+static struct texture *planet;
+#define COLOUR_PAGES	512	/* colour tile atlas pages */
 
 #define GLERROR()							\
 do {									\
@@ -101,7 +116,11 @@ void reshape (int w, int h)
 	glMatrixMode(GL_MODELVIEW);
 }
 
-static void set_texture(const struct patch *p)
+/* The state key for a patch: the texture it's drawn with.  With
+   labels every patch has its own, made the first time it's asked
+   for; the quadtree keeps the key, so that's once per patch rather
+   than once per frame. */
+static unsigned patch_texture(void *arg, const struct patch *p)
 {
 #if LABELS
 	GLuint texid = (patch_id(p)+1) + (1 << (patch_level(p) * 2 + 4));
@@ -121,13 +140,19 @@ static void set_texture(const struct patch *p)
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
 		texprintf("%s", s);
-	} else
-		glBindTexture(GL_TEXTURE_2D, texid);
+	}
+
+	return texid;
 #else
-	glBindTexture(GL_TEXTURE_2D, texture);
+	return 0;
 #endif
 }
 
+static void bind_texture(void *arg, unsigned texid)
+{
+	glBindTexture(GL_TEXTURE_2D, texid);
+}
+
 static float delta = 1;
 
 static float dolly = RADIUS * 2.5;
@@ -170,6 +195,24 @@ static void display()
 		//printf("camerapos=%g, %g, %g, alt=%g\n", camdir.x, camdir.y, camdir.z, vec3_magnitude(&camdir));
 
 		quadtree_update_view(qt, &combined, &camdir);
+
+		if (upload_stats) {
+			unsigned long bytes;
+			unsigned transfers;
+			float stalled;
+
+			quadtree_upload_stats(qt, &bytes, &transfers, &stalled);
+			if (bytes)
+				printf("upload: %lu bytes in %u transfers, %.3fms stalled\n",
+				       bytes, transfers, stalled * 1000);
+		}
+
+		if (check_edges) {
+			unsigned bad = quadtree_check_edges(qt);
+
+			if (bad)
+				printf("edges: %u shared samples with different heights\n", bad);
+		}
 	}
 
 
@@ -201,10 +244,6 @@ static void display()
 
 	if (LABELS)
 		glScalef(1./PATCH_SAMPLES, 1./PATCH_SAMPLES, 1);
-	else {
-		glTranslatef(.4, 0, 0);
-		glScalef(1./32767, 1./32767, 1);
-	}
 
 	glMatrixMode(GL_MODELVIEW);
 
@@ -212,11 +251,13 @@ static void display()
 		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_BLEND);
 		GLERROR();
 	} else {
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		GLERROR();
+		/* the planet texture is in the colours */
+		glDisable(GL_TEXTURE_2D);
 	}
 
-	quadtree_render(qt, set_texture);
+	/* without labels every patch has the same state, so the
+	   patches are all in one group and drawn at once */
+	quadtree_render_batched(qt, bind_texture);
 
 #if 0
 	glEnable(GL_POLYGON_OFFSET_LINE);
@@ -249,7 +290,7 @@ static void display()
 
 	glDisable(GL_CULL_FACE);
 
-	quadtree_render(qt, set_texture);
+	quadtree_render_batched(qt, bind_texture);
 	glPopMatrix();
 	glPopAttrib();
 
@@ -315,6 +356,19 @@ static void keydown(unsigned char key, int x, int y)
 		wireframe = !wireframe;
 		break;
 
+	case 'u':
+		upload_stats = !upload_stats;
+		break;
+
+	case 'c':
+		check_edges = !check_edges;
+		break;
+
+	case 'f':
+		front_to_back = !front_to_back;
+		quadtree_front_to_back(qt, front_to_back);
+		break;
+
 	case 'a':
 		animate = !animate;
 		if (animate)
@@ -404,6 +458,77 @@ static void mouse(int buttons, int state, int x, int y)
 	glutPostRedisplay();
 }
 
+#define CACHE_RATIO	8	/* parent samples per feature for cached octaves */
+
+static struct basemap *basemap;	/* baked low octaves, or NULL */
+
+static float height_at(const struct sample *s, const vec3_t *nv)
+{
+	float octaves = fractal_octaves(frac, 2, s->detail, terrain_kernel_OCTAVES);
+	int base = 0;
+
+	if (basemap)
+		base = basemap_octaves(basemap);
+
+	if (s->coarse_out == NULL && isnan(s->coarse)) {
+		if (basemap) {
+			float value = basemap_sample(basemap, nv) +
+				fractal_fBm_partial(frac, nv->v, 2, base, octaves);
+
+			return fractal_fBmtest_shape(frac, nv->v, value, octaves);
+		}
+#if KERNEL
+		return terrain_kernel(nv->v, octaves);
+#else
+		return fractal_fBmtest(frac, nv->v, octaves);
+#endif
+	}
+
+	/* Octaves [0, smooth) are interpolated from the parent where
+	   possible, and passed on to our children.  The base map's
+	   octaves are always included. */
+	int smooth = fractal_smooth_octaves(frac, 2, s->spacing, CACHE_RATIO);
+	float value;
+
+	if (smooth > octaves)
+		smooth = octaves;
+	if (smooth < base)
+		smooth = base;
+
+	if (isnan(s->coarse)) {
+		/* Nothing to start from, as for samples on the patch's
+		   edge, which other patches share: the octaves are
+		   summed in one go, as above, so the sample comes out
+		   the same whichever patch it's generated for. */
+		float low;
+
+		value = fractal_fBm_split(frac, nv->v, 2, base, smooth, octaves, &low);
+		if (basemap) {
+			float b = basemap_sample(basemap, nv);
+
+			value = b + value;
+			low = b + low;
+		}
+
+		*s->coarse_out = low;
+	} else {
+		int cached = fractal_smooth_octaves(frac, 2, s->spacing * 2, CACHE_RATIO);
+
+		if (cached > smooth)
+			cached = smooth;
+		if (cached < base)
+			cached = base;
+		value = s->coarse + fractal_fBm_partial(frac, nv->v, 2, cached, smooth);
+
+		if (s->coarse_out)
+			*s->coarse_out = value;
+
+		value += fractal_fBm_partial(frac, nv->v, 2, smooth, octaves);
+	}
+
+	return fractal_fBmtest_shape(frac, nv->v, value, octaves);
+}
+
 #if LABELS
 static const GLubyte gradient[] = {
 	0x06, 0x1d, 0x98,
@@ -664,16 +789,16 @@ static const GLubyte gradient[] = {
 	0xf4, 0xf5, 0xf4,
 };
 
-static elevation_t generate(const vec3_t *v, struct vertex *vtx)
+static elevation_t generate(const struct sample *s, struct vertex *vtx)
 {
 	float height;
 	elevation_t e;
 	int idx;
-	vec3_t nv = *v;
+	vec3_t nv = s->normal;
 
 	vec3_normalize(&nv);
 
-	height = fractal_fBmtest(frac, nv.v, 8);
+	height = height_at(s, &nv);
 
 	//printf("height(%g, %g, %g) = %g, variance=%g\n", v[0], v[1], v[2], height, variance);
 	idx = ((height * .5f) + .5f) * 255;
@@ -694,38 +819,101 @@ static elevation_t generate(const vec3_t *v, struct vertex *vtx)
 	return e;
 }
 #else
-static elevation_t generate(const vec3_t *v, struct vertex *vtx)
+/* The planet texture's colour at u,v, filtered as GL_LINEAR and
+   GL_CLAMP_TO_EDGE would */
+static void planet_colour(float u, float v, unsigned char col[4])
+{
+	int size = planet->size;
+	const unsigned char *pix = planet->data;
+	float x = fminf(fmaxf(u * size - .5f, 0), size - 1);
+	float y = fminf(fmaxf(v * size - .5f, 0), size - 1);
+	int x0 = x, y0 = y;
+	int x1 = x0 + (x0 < size - 1), y1 = y0 + (y0 < size - 1);
+	float fx = x - x0, fy = y - y0;
+
+	for(int c = 0; c < 3; c++) {
+		float a = pix[(y0 * size + x0) * 3 + c] * (1 - fx) + pix[(y0 * size + x1) * 3 + c] * fx;
+		float b = pix[(y1 * size + x0) * 3 + c] * (1 - fx) + pix[(y1 * size + x1) * 3 + c] * fx;
+
+		col[c] = a * (1 - fy) + b * fy + .5f;
+	}
+	col[3] = 255;
+}
+
+static elevation_t generate(const struct sample *s, struct vertex *vtx)
 {
 	float height;
 	elevation_t e;
+	const vec3_t *v = &s->normal;
 	vec3_t nv = *v;
 
 	vec3_normalize(&nv);
 
-	height = fractal_fBmtest(frac, nv.v, 8);
+	height = height_at(s, &nv);
 
 	//printf("height(%g, %g, %g) = %g, variance=%g\n", v[0], v[1], v[2], height, variance);
 	e = height * variance + offset;
 
-	texcoord_t s = e * 16384 / maxvariance;
-	texcoord_t t = (fabsf(v->z) + .1f * fractal_fBm(frac, v->v, 4)) * 32767;
+	/* Compact vertices have no texcoords of their own, so the
+	   texture is looked up here, by altitude and latitude, and
+	   drawn as the colour; the colour tiles keep its detail
+	   between vertices */
+	float tu = .4f + e * .5f / maxvariance;
+	float tv = fabsf(v->z) + .1f * fractal_fBm(frac, v->v, 4);
+	unsigned char col[4];
 
 	if (0)
-		printf("set texcoord(%g,%g,%g) = st=(%d,%d), maxvariance=%g\n",
-		       v->x, v->y, v->z, s, t, maxvariance);
+		printf("texture(%g,%g,%g) at %g,%g, maxvariance=%g\n",
+		       v->x, v->y, v->z, tu, tv, maxvariance);
 
-	vertex_set_texcoord(vtx, s, t);
+	planet_colour(tu, tv, col);
+	vertex_set_colour(vtx, col);
 
 	return e;
 }
 #endif	/* LABELS */
 
+#if NOISEGRAPH
+/* Warped ridged mountains over rolling fBm hills */
+static struct noiseprog *terrain_prog(void)
+{
+	struct noisegraph *g = noisegraph_create();
+	struct noiseprog *prog;
+	static const float shape[][2] = {
+		{ -1, -1 }, { -.2, -.3 }, { .2, .1 }, { .6, .6 }, { 1, 1 },
+	};
+
+	noisenode_t p = noisegraph_point(g);
+	noisenode_t dx = noisegraph_fractal(g, NOISE_FBM, frac, p, 3, 4, 0, 0);
+	noisenode_t dy = noisegraph_fractal(g, NOISE_FBM, frac, p, 3.1, 4, 0, 0);
+	noisenode_t dz = noisegraph_fractal(g, NOISE_FBM, frac, p, 3.2, 4, 0, 0);
+	noisenode_t wp = noisegraph_warp(g, p, dx, dy, dz, .05);
+
+	noisenode_t hills = noisegraph_fractal(g, NOISE_FBM, frac, wp, 2, 8, 0, 0);
+	noisenode_t ridges = noisegraph_fractal(g, NOISE_RIDGED, frac, wp, 2, 8, 1, 2);
+	ridges = noisegraph_scale(g, ridges, .5, -.5);
+
+	noisenode_t control = noisegraph_fractal(g, NOISE_FBM, frac, p, 1, 3, 0, 0);
+	noisenode_t height = noisegraph_select(g, control, hills, ridges, .1, .2);
+
+	height = noisegraph_curve(g, height, shape, sizeof(shape) / sizeof(*shape));
+	height = noisegraph_scale(g, height, variance, offset);
+
+	prog = noisegraph_compile(g, height);
+	noisegraph_free(g);
+
+	return prog;
+}
+#endif	/* NOISEGRAPH */
+
 int main(int argc, char **argv)
 {
 	float _variance = RADIUS * .03;
-	float _roughness = .1;
 
-	frac = fractal_create(3, 210, 1.0 - _roughness, 5);
+	/* the Makefile gives the terrain's parameters to genkernel,
+	   which records them in the kernel's header */
+	frac = fractal_create(terrain_kernel_NDIM, terrain_kernel_SEED,
+			      terrain_kernel_H, terrain_kernel_LACUNARITY);
 	
 	maxvariance = _variance;
 	variance = maxvariance / .75f;
@@ -739,7 +927,32 @@ int main(int argc, char **argv)
         glutInitWindowSize(480*2, 272*2);
 	glutCreateWindow( __FILE__ );
 
+	if (BASEMAP && !KERNEL) {
+		/* octaves with at least 4 grid samples per feature */
+		int octaves = fractal_smooth_octaves(frac, 2, 2.f / BASEMAP_SIZE, 4);
+
+		if (octaves > 0)
+			basemap = basemap_load(BASEMAP_FILE, frac, 2, octaves, BASEMAP_SIZE);
+	}
+
+	if (!LABELS) {
+		planet = texture_load(".", TEXTURE_SEED, variance, TEXTURE_SIZE, 0, 0);
+		if (planet == NULL) {
+			printf("can't make the planet texture\n");
+			exit(1);
+		}
+	}
+
+#if NOISEGRAPH
+	qt = quadtree_create_batch(500, RADIUS, noiseprog_generate, terrain_prog());
+#else
 	qt = quadtree_create(500, RADIUS, generate);
+#endif
+	/* the noise graph program doesn't use or fill the cache */
+	quadtree_octave_cache(qt, !KERNEL && !NOISEGRAPH);
+	quadtree_state_keys(qt, patch_texture, NULL);
+	if (!LABELS && !NOISEGRAPH)
+		quadtree_colour_tiles(qt, COLOUR_PAGES, 0);
 	
 	glutSpecialFunc(specialdown);
 	glutKeyboardFunc(keydown);
@@ -768,12 +981,5 @@ int main(int argc, char **argv)
 	}
 	GLERROR();
 
-	texture = buildtexture(variance);
-	GLERROR();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
 	glutMainLoop();
 }
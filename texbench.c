@@ -0,0 +1,179 @@
+/*
+   Measure the block compression of generated textures: how fast
+   texcomp_encode() codes them, on one thread and on one per CPU,
+   and how close the decoded texels are to the originals.  The
+   textures are the demo's planet texture, a colour tile field like
+   renderbench's, with an fBm alpha for BC3, and a normal map of an
+   fBm heightfield for BC5, whose error is also given as the angle
+   between the original and decoded normals.
+
+   Usage: texbench [size]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "noise.h"
+#include "texcomp.h"
+#include "gentexture.h"
+
+#define MINTIME		.25	/* seconds per measurement */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Pixels coded per second */
+static double encode_rate(enum texcomp_format fmt, void *out,
+			  const unsigned char *pixels, int size, int bpp,
+			  int threads)
+{
+	unsigned long count = 0;
+	double start = now(), elapsed;
+
+	do {
+		texcomp_encode(fmt, out, pixels, size, size, bpp, threads);
+		count++;
+		elapsed = now() - start;
+	} while(elapsed < MINTIME);
+
+	return count * size * size / elapsed;
+}
+
+static void report(const char *name, enum texcomp_format fmt,
+		   const unsigned char *pixels, int size, int bpp, int channels)
+{
+	static const char *const formats[] = { "BC1", "BC3", "BC5" };
+	size_t bytes = texcomp_size(fmt, size, size);
+	unsigned char *out = malloc(bytes);
+	unsigned char *dec = malloc((size_t)size * size * 4);
+	double one = encode_rate(fmt, out, pixels, size, bpp, 1);
+	double all = encode_rate(fmt, out, pixels, size, bpp, 0);
+	double sum = 0;
+
+	texcomp_decode(fmt, dec, out, size, size);
+
+	for(size_t i = 0; i < (size_t)size * size; i++)
+		for(int k = 0; k < channels; k++) {
+			double d = pixels[i * bpp + k] - dec[i * 4 + k];
+
+			sum += d * d;
+		}
+
+	double rmse = sqrt(sum / ((double)size * size * channels));
+
+	printf("%-10s %-4s %6.1f:1 %7.2f %7.2f %10.1f %10.1f\n",
+	       name, formats[fmt], (double)size * size * bpp / bytes,
+	       rmse, 20 * log10(255 / rmse), one * 1e-6, all * 1e-6);
+
+	if (fmt == TEXCOMP_BC5) {
+		double angle = 0, worst = 0;
+
+		for(size_t i = 0; i < (size_t)size * size; i++) {
+			float a[3], b[3], aa = 0, bb = 0, ab = 0;
+
+			/* z worked out from x and y, as a shader would */
+			for(int k = 0; k < 2; k++) {
+				a[k] = pixels[i * bpp + k] / 127.5f - 1;
+				b[k] = dec[i * 4 + k] / 127.5f - 1;
+			}
+			a[2] = sqrtf(fmaxf(0, 1 - a[0] * a[0] - a[1] * a[1]));
+			b[2] = sqrtf(fmaxf(0, 1 - b[0] * b[0] - b[1] * b[1]));
+			for(int k = 0; k < 3; k++) {
+				aa += a[k] * a[k];
+				bb += b[k] * b[k];
+				ab += a[k] * b[k];
+			}
+
+			double d = acos(fminf(1, ab / sqrtf(aa * bb))) * 180 / M_PI;
+
+			angle += d;
+			if (d > worst)
+				worst = d;
+		}
+
+		printf("%-10s      normals %.2f degrees out on average, %.2f at worst\n",
+		       "", angle / ((double)size * size), worst);
+	}
+
+	free(out);
+	free(dec);
+}
+
+int main(int argc, char **argv)
+{
+	int size = 512;
+
+	if (argc > 1)
+		size = atoi(argv[1]);
+
+	unsigned char *planet = malloc(TEXTURE_SIZE * TEXTURE_SIZE * 3);
+	unsigned char *tiles = malloc((size_t)size * size * 4);
+	unsigned char *normals = malloc((size_t)size * size * 4);
+	float *height = malloc(sizeof(*height) * (size + 1) * (size + 1));
+	struct fractal *frac = fractal_create(2, 210, 0.9, 2);
+	struct fractal *alpha = fractal_create(2, 77, 0.9, 2);
+
+	/* down to features 8 texels across */
+	float octaves = log2f(size / 64.f) + 1;
+
+	maketexture(planet, TEXTURE_SEED, (1 << 20) * .04f, TEXTURE_SIZE, 0);
+
+	/* heights over 8 features' worth of fBm, coloured as
+	   renderbench colours its terrain */
+	for(int j = 0; j <= size; j++)
+		for(int i = 0; i <= size; i++) {
+			float v[2] = { i * 8.f / size, j * 8.f / size };
+
+			height[j * (size + 1) + i] = fractal_fBm(frac, v, octaves);
+		}
+
+	for(int j = 0; j < size; j++)
+		for(int i = 0; i < size; i++) {
+			float h = height[j * (size + 1) + i];
+			float v[2] = { i * 8.f / size, j * 8.f / size };
+			float a = fractal_fBm(alpha, v, octaves);
+			int c = h < -1 ? 0 : h > 1 ? 254 : 127 + h * 127;
+			unsigned char *t = &tiles[((size_t)j * size + i) * 4];
+			unsigned char *n = &normals[((size_t)j * size + i) * 4];
+
+			t[0] = c;
+			t[1] = 96 + c / 2;
+			t[2] = 64;
+			t[3] = a < -1 ? 0 : a > 1 ? 255 : 127.5f + a * 127.5f;
+
+			/* the slope, scaled so it's a steep landscape */
+			float dx = (height[j * (size + 1) + i + 1] - h) * size / 4;
+			float dy = (height[(j + 1) * (size + 1) + i] - h) * size / 4;
+			float m = 1 / sqrtf(dx * dx + dy * dy + 1);
+
+			n[0] = 127.5f - dx * m * 127.5f;
+			n[1] = 127.5f - dy * m * 127.5f;
+			n[2] = 127.5f + m * 127.5f;
+			n[3] = 255;
+		}
+
+	printf("%-10s %-4s %8s %7s %7s %10s %10s\n", "texture", "", "vs 8 bit",
+	       "rmse", "psnr", "Mpix/s 1", "Mpix/s all");
+
+	report("planet", TEXCOMP_BC1, planet, TEXTURE_SIZE, 3, 3);
+	report("tiles", TEXCOMP_BC1, tiles, size, 4, 3);
+	report("tiles", TEXCOMP_BC3, tiles, size, 4, 4);
+	report("normals", TEXCOMP_BC5, normals, size, 4, 2);
+
+	free(planet);
+	free(tiles);
+	free(normals);
+	free(height);
+	free(frac);
+	free(alpha);
+
+	return 0;
+}
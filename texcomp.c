@@ -0,0 +1,482 @@
+/*
+   BC1/BC3/BC5 block encoding and decoding.  A block's 16 texels are
+   held a row to a vector, so fitting the texels to a palette is
+   done 4 at a time.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "texcomp.h"
+#include "simd.h"
+
+#define MAX_THREADS	64
+
+/* One block's texels, a row to a vector */
+struct block {
+	v4sf c[4][4];		/* channel, row */
+};
+
+static inline float hsum(v4sf v)
+{
+	return v[0] + v[1] + v[2] + v[3];
+}
+
+static inline void put16(unsigned char *out, unsigned v)
+{
+	out[0] = v;
+	out[1] = v >> 8;
+}
+
+static inline unsigned get16(const unsigned char *in)
+{
+	return in[0] | in[1] << 8;
+}
+
+static void load_block(struct block *b, const unsigned char *pixels,
+		       int width, int height, int bpp, int bx, int by)
+{
+	for(int y = 0; y < 4; y++) {
+		int sy = by * 4 + y < height ? by * 4 + y : height - 1;
+
+		for(int x = 0; x < 4; x++) {
+			int sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+			const unsigned char *p = &pixels[((size_t)sy * width + sx) * bpp];
+
+			b->c[0][y][x] = p[0];
+			b->c[1][y][x] = p[1];
+			b->c[2][y][x] = p[2];
+			b->c[3][y][x] = bpp == 4 ? p[3] : 255;
+		}
+	}
+}
+
+/* 565 colours, and their 8 bit expansions */
+static unsigned pack565(const float c[3])
+{
+	int r = c[0] * (31 / 255.f) + .5f;
+	int g = c[1] * (63 / 255.f) + .5f;
+	int b = c[2] * (31 / 255.f) + .5f;
+
+	r = r < 0 ? 0 : r > 31 ? 31 : r;
+	g = g < 0 ? 0 : g > 63 ? 63 : g;
+	b = b < 0 ? 0 : b > 31 ? 31 : b;
+
+	return r << 11 | g << 5 | b;
+}
+
+static void unpack565(unsigned c, int rgb[3])
+{
+	int r = c >> 11, g = c >> 5 & 63, b = c & 31;
+
+	rgb[0] = r << 3 | r >> 2;
+	rgb[1] = g << 2 | g >> 4;
+	rgb[2] = b << 3 | b >> 2;
+}
+
+/* The 4 colour palette for endpoints c0 and c1, as the decoder
+   makes it */
+static void colour_palette(unsigned c0, unsigned c1, int pal[4][3])
+{
+	unpack565(c0, pal[0]);
+	unpack565(c1, pal[1]);
+	for(int k = 0; k < 3; k++) {
+		pal[2][k] = (2 * pal[0][k] + pal[1][k]) / 3;
+		pal[3][k] = (pal[0][k] + 2 * pal[1][k]) / 3;
+	}
+}
+
+/* Pick the nearest palette entry for each texel; returns the
+   summed squared error, with the 2 bit indices in *indices */
+static float colour_indices(const struct block *b, unsigned c0, unsigned c1,
+			    unsigned *indices)
+{
+	int pal[4][3];
+	float err = 0;
+	unsigned bits = 0;
+
+	colour_palette(c0, c1, pal);
+
+	for(int y = 0; y < 4; y++) {
+		v4sf best = v4sf_splat(INFINITY);
+		v4si index = { 0, 0, 0, 0 };
+
+		for(int k = 0; k < 4; k++) {
+			v4sf dr = b->c[0][y] - v4sf_splat(pal[k][0]);
+			v4sf dg = b->c[1][y] - v4sf_splat(pal[k][1]);
+			v4sf db = b->c[2][y] - v4sf_splat(pal[k][2]);
+			v4sf d = dr * dr + dg * dg + db * db;
+			v4si closer = d < best;
+
+			best = v4sf_select(closer, d, best);
+			index = (closer & k) | (~closer & index);
+		}
+
+		for(int x = 0; x < 4; x++)
+			bits |= (unsigned)index[x] << (2 * (y * 4 + x));
+		err += hsum(best);
+	}
+
+	*indices = bits;
+	return err;
+}
+
+/* The endpoints which best fit the texels with the given indices,
+   by least squares; returns 0 if they're all on one entry */
+static int fit_endpoints(const struct block *b, unsigned indices,
+			 float e0[3], float e1[3])
+{
+	static const float weight[4] = { 1, 0, 2 / 3.f, 1 / 3.f };
+	float aa = 0, ab = 0, bb = 0;
+	float ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+
+	for(int i = 0; i < 16; i++) {
+		float a = weight[indices >> (2 * i) & 3], c = 1 - a;
+
+		aa += a * a;
+		ab += a * c;
+		bb += c * c;
+		for(int k = 0; k < 3; k++) {
+			float x = b->c[k][i / 4][i % 4];
+
+			ax[k] += a * x;
+			bx[k] += c * x;
+		}
+	}
+
+	float det = aa * bb - ab * ab;
+
+	if (fabsf(det) < 1e-6f)
+		return 0;
+
+	for(int k = 0; k < 3; k++) {
+		e0[k] = (ax[k] * bb - bx[k] * ab) / det;
+		e1[k] = (bx[k] * aa - ax[k] * ab) / det;
+	}
+
+	return 1;
+}
+
+/* Code the colour half of a block, always with the 4 colour palette
+   (c0 > c1) as BC3 needs */
+static void encode_colour(const struct block *b, unsigned char *out)
+{
+	float mean[3], cov[6];
+	v4sf d[3][4];
+
+	for(int k = 0; k < 3; k++)
+		mean[k] = hsum(b->c[k][0] + b->c[k][1] + b->c[k][2] + b->c[k][3]) / 16;
+
+	for(int k = 0; k < 3; k++)
+		for(int y = 0; y < 4; y++)
+			d[k][y] = b->c[k][y] - v4sf_splat(mean[k]);
+
+	/* covariance: rr, rg, rb, gg, gb, bb */
+	for(int n = 0, i = 0; i < 3; i++)
+		for(int j = i; j < 3; j++, n++) {
+			v4sf s = d[i][0] * d[j][0] + d[i][1] * d[j][1] +
+				 d[i][2] * d[j][2] + d[i][3] * d[j][3];
+
+			cov[n] = hsum(s);
+		}
+
+	/* the principal axis, by power iteration from the diagonal */
+	float axis[3] = { 1, 1, 1 };
+
+	for(int it = 0; it < 4; it++) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float m = fmaxf(fabsf(x), fmaxf(fabsf(y), fabsf(z)));
+
+		if (m == 0)
+			break;
+		axis[0] = x / m;
+		axis[1] = y / m;
+		axis[2] = z / m;
+	}
+
+	/* the extremes along it */
+	v4sf lo = v4sf_splat(INFINITY), hi = v4sf_splat(-INFINITY);
+
+	for(int y = 0; y < 4; y++) {
+		v4sf t = d[0][y] * v4sf_splat(axis[0]) + d[1][y] * v4sf_splat(axis[1]) +
+			 d[2][y] * v4sf_splat(axis[2]);
+
+		lo = v4sf_select(t < lo, t, lo);
+		hi = v4sf_select(t > hi, t, hi);
+	}
+
+	float tmin = fminf(fminf(lo[0], lo[1]), fminf(lo[2], lo[3]));
+	float tmax = fmaxf(fmaxf(hi[0], hi[1]), fmaxf(hi[2], hi[3]));
+	float e0[3], e1[3];
+
+	for(int k = 0; k < 3; k++) {
+		e0[k] = mean[k] + axis[k] * tmax;
+		e1[k] = mean[k] + axis[k] * tmin;
+	}
+
+	unsigned c0 = pack565(e0), c1 = pack565(e1), indices;
+	float err = colour_indices(b, c0, c1, &indices);
+
+	/* refine once, keeping whichever is better */
+	if (err > 0 && fit_endpoints(b, indices, e0, e1)) {
+		unsigned r0 = pack565(e0), r1 = pack565(e1), ri;
+
+		if (colour_indices(b, r0, r1, &ri) < err) {
+			c0 = r0;
+			c1 = r1;
+			indices = ri;
+		}
+	}
+
+	if (c0 < c1) {
+		unsigned t = c0;
+
+		c0 = c1;
+		c1 = t;
+		indices ^= 0x55555555;		/* 0<->1, 2<->3 */
+	} else if (c0 == c1)
+		indices = 0;
+
+	put16(out, c0);
+	put16(out + 2, c1);
+	for(int i = 0; i < 4; i++)
+		out[4 + i] = indices >> (8 * i);
+}
+
+/* Code one channel of a block as BC3's alpha and BC5's halves are,
+   with the 8 value palette between the extremes */
+static void encode_channel(const v4sf v[4], unsigned char *out)
+{
+	v4sf lo = v[0], hi = v[0];
+
+	for(int y = 1; y < 4; y++) {
+		lo = v4sf_select(v[y] < lo, v[y], lo);
+		hi = v4sf_select(v[y] > hi, v[y], hi);
+	}
+
+	int min = fminf(fminf(lo[0], lo[1]), fminf(lo[2], lo[3]));
+	int max = fmaxf(fmaxf(hi[0], hi[1]), fmaxf(hi[2], hi[3]));
+	unsigned long long bits = 0;
+
+	out[0] = max;
+	out[1] = min;
+
+	if (max > min) {
+		v4sf scale = v4sf_splat(7.f / (max - min));
+
+		for(int y = 0; y < 4; y++) {
+			/* the step along the ramp from min, then its index:
+			   0 is max, 1 min, and 2-7 the steps down from max */
+			v4sf t = (v[y] - v4sf_splat(min)) * scale + v4sf_splat(.5f);
+			v4si step = __builtin_convertvector(t, v4si);
+
+			for(int x = 0; x < 4; x++) {
+				int s = step[x] > 7 ? 7 : step[x];
+				unsigned index = s == 7 ? 0 : s == 0 ? 1 : 8 - s;
+
+				bits |= (unsigned long long)index << (3 * (y * 4 + x));
+			}
+		}
+	}
+
+	for(int i = 0; i < 6; i++)
+		out[2 + i] = bits >> (8 * i);
+}
+
+static size_t block_bytes(enum texcomp_format fmt)
+{
+	return fmt == TEXCOMP_BC1 ? 8 : 16;
+}
+
+size_t texcomp_size(enum texcomp_format fmt, int width, int height)
+{
+	return block_bytes(fmt) * ((width + 3) / 4) * ((height + 3) / 4);
+}
+
+unsigned texcomp_gl_format(enum texcomp_format fmt)
+{
+	switch(fmt) {
+	case TEXCOMP_BC1:
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case TEXCOMP_BC3:
+		return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case TEXCOMP_BC5:
+		return GL_COMPRESSED_RG_RGTC2;
+	}
+
+	return 0;
+}
+
+struct encode {
+	enum texcomp_format fmt;
+	unsigned char *out;
+	const unsigned char *pixels;
+	int width, height, bpp;
+	int row, rows;		/* of blocks */
+};
+
+static void *encode_rows(void *arg)
+{
+	const struct encode *e = arg;
+	int bw = (e->width + 3) / 4;
+	size_t bytes = block_bytes(e->fmt);
+	unsigned char *out = e->out + bytes * bw * e->row;
+
+	for(int by = e->row; by < e->row + e->rows; by++)
+		for(int bx = 0; bx < bw; bx++, out += bytes) {
+			struct block b;
+
+			load_block(&b, e->pixels, e->width, e->height, e->bpp, bx, by);
+
+			switch(e->fmt) {
+			case TEXCOMP_BC1:
+				encode_colour(&b, out);
+				break;
+			case TEXCOMP_BC3:
+				encode_channel(b.c[3], out);
+				encode_colour(&b, out + 8);
+				break;
+			case TEXCOMP_BC5:
+				encode_channel(b.c[0], out);
+				encode_channel(b.c[1], out + 8);
+				break;
+			}
+		}
+
+	return NULL;
+}
+
+void texcomp_encode(enum texcomp_format fmt, void *out,
+		    const unsigned char *pixels, int width, int height,
+		    int bpp, int threads)
+{
+	int bh = (height + 3) / 4;
+	struct encode e[MAX_THREADS];
+	pthread_t tid[MAX_THREADS];
+	int started = 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads > bh)
+		threads = bh;
+	if (threads < 1)
+		threads = 1;
+
+	for(int i = 0; i < threads; i++) {
+		e[i].fmt = fmt;
+		e[i].out = out;
+		e[i].pixels = pixels;
+		e[i].width = width;
+		e[i].height = height;
+		e[i].bpp = bpp;
+		e[i].row = bh * i / threads;
+		e[i].rows = bh * (i + 1) / threads - e[i].row;
+	}
+
+	/* the last share is done here, along with any whose thread
+	   couldn't be started */
+	for(int i = 0; i < threads - 1; i++) {
+		if (pthread_create(&tid[i], NULL, encode_rows, &e[i]) != 0)
+			break;
+		started++;
+	}
+
+	for(int i = started; i < threads; i++)
+		encode_rows(&e[i]);
+
+	for(int i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+}
+
+static void decode_colour(const unsigned char *in, unsigned char *pixels,
+			  int width, int height, int bx, int by)
+{
+	unsigned c0 = get16(in), c1 = get16(in + 2);
+	unsigned indices = in[4] | in[5] << 8 | in[6] << 16 | (unsigned)in[7] << 24;
+	int pal[4][3];
+
+	colour_palette(c0, c1, pal);
+	if (c0 <= c1) {
+		/* 3 colours and black; only BC1 has this mode, and
+		   encode_colour() doesn't use it */
+		for(int k = 0; k < 3; k++) {
+			pal[2][k] = (pal[0][k] + pal[1][k]) / 2;
+			pal[3][k] = 0;
+		}
+	}
+
+	for(int i = 0; i < 16; i++) {
+		int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+
+		if (x >= width || y >= height)
+			continue;
+
+		unsigned char *p = &pixels[((size_t)y * width + x) * 4];
+		const int *c = pal[indices >> (2 * i) & 3];
+
+		p[0] = c[0];
+		p[1] = c[1];
+		p[2] = c[2];
+	}
+}
+
+static void decode_channel(const unsigned char *in, unsigned char *pixels,
+			   int width, int height, int bx, int by, int channel)
+{
+	int a0 = in[0], a1 = in[1], pal[8];
+	unsigned long long indices = 0;
+
+	for(int i = 0; i < 6; i++)
+		indices |= (unsigned long long)in[2 + i] << (8 * i);
+
+	pal[0] = a0;
+	pal[1] = a1;
+	for(int i = 2; i < 8; i++)
+		pal[i] = a0 > a1 ? ((8 - i) * a0 + (i - 1) * a1) / 7 :
+			 i < 6 ? ((6 - i) * a0 + (i - 1) * a1) / 5 :
+			 i == 6 ? 0 : 255;
+
+	for(int i = 0; i < 16; i++) {
+		int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+
+		if (x < width && y < height)
+			pixels[((size_t)y * width + x) * 4 + channel] = pal[indices >> (3 * i) & 7];
+	}
+}
+
+void texcomp_decode(enum texcomp_format fmt, unsigned char *pixels,
+		    const void *in, int width, int height)
+{
+	const unsigned char *block = in;
+	int bw = (width + 3) / 4, bh = (height + 3) / 4;
+
+	for(size_t i = 0; i < (size_t)width * height; i++) {
+		pixels[i * 4 + 2] = 0;
+		pixels[i * 4 + 3] = 255;
+	}
+
+	for(int by = 0; by < bh; by++)
+		for(int bx = 0; bx < bw; bx++, block += block_bytes(fmt))
+			switch(fmt) {
+			case TEXCOMP_BC1:
+				decode_colour(block, pixels, width, height, bx, by);
+				break;
+			case TEXCOMP_BC3:
+				decode_channel(block, pixels, width, height, bx, by, 3);
+				decode_colour(block + 8, pixels, width, height, bx, by);
+				break;
+			case TEXCOMP_BC5:
+				decode_channel(block, pixels, width, height, bx, by, 0);
+				decode_channel(block + 8, pixels, width, height, bx, by, 1);
+				break;
+			}
+}
@@ -0,0 +1,48 @@
+#ifndef _TEXCOMP_H
+#define _TEXCOMP_H
+
+/*
+   Block compression of generated textures, so they take less
+   memory and upload bandwidth.  Images are coded in 4x4 texel
+   blocks:
+
+   BC1 (DXT1) codes RGB in 8 bytes a block, 6:1 against RGB8 or 8:1
+   against RGBA8.  BC3 (DXT5) adds a separately coded alpha, in 16
+   bytes a block.  BC5 (RGTC2) codes just the first two channels, in
+   16 bytes a block, each like BC3's alpha; it's for normal maps
+   with the third component worked out when they're sampled.
+
+   The encoder is a quick one, fit for textures made at run time: it
+   takes endpoints from the principal axis of each block's colours
+   and refines them once by least squares.  Pixels are 3 or 4 bytes,
+   RGB or RGBA; images whose sizes aren't multiples of 4 have their
+   edge texels repeated to fill the last blocks.
+ */
+
+#include <stddef.h>
+
+enum texcomp_format {
+	TEXCOMP_BC1,
+	TEXCOMP_BC3,
+	TEXCOMP_BC5,
+};
+
+/* Bytes in the coded image */
+size_t texcomp_size(enum texcomp_format fmt, int width, int height);
+
+/* The GL internal format for fmt, for glCompressedTexImage2D() */
+unsigned texcomp_gl_format(enum texcomp_format fmt);
+
+/* Code width x height pixels of bpp bytes each into out, a row of
+   blocks at a time across threads threads (0 for one per CPU; with
+   1 it's all done in the calling thread) */
+void texcomp_encode(enum texcomp_format fmt, void *out,
+		    const unsigned char *pixels, int width, int height,
+		    int bpp, int threads);
+
+/* Decode back into width x height RGBA pixels.  BC1 comes back with
+   alpha 255, and BC5 with blue 0 and alpha 255. */
+void texcomp_decode(enum texcomp_format fmt, unsigned char *pixels,
+		    const void *in, int width, int height);
+
+#endif	/* _TEXCOMP_H */